@@ -76,8 +76,18 @@ static void Gelman_Rubin_diagnostic(TStats **stats_arr, unsigned int N_chains, d
  *   Affine Sampler class protoype
  *************************************************************************/
 
-/* An affine-invariant ensemble sampler, introduced by Goodman & Weare (2010). */
-template<class TParams, class TLogger>
+// Default type of the target density: a plain function pointer
+template<class TParams>
+using TAffinePdfPtr = double (*)(const double *const _X, unsigned int _N, TParams& _params);
+
+/* An affine-invariant ensemble sampler, introduced by Goodman & Weare (2010).
+ *
+ * TPdf may be any callable with the signature of pdf_t. Passing a functor
+ * type, rather than a function pointer, lets the compiler inline the target
+ * density into the proposal and acceptance loops. If NDim is nonzero, it
+ * must equal the dimensionality passed to the constructor, and the state
+ * storage and loops over dimensions are then sized at compile time. */
+template<class TParams, class TLogger, class TPdf=TAffinePdfPtr<TParams>, unsigned int NDim=0>
 class TAffineSampler {
 	
 	// Sampler settings
@@ -143,27 +153,36 @@ class TAffineSampler {
 	
 	// Private member functions
 	void affine_proposal(unsigned int j, double& scale);		// Generate a proposal state for sampler j, with the given step scale, using the stretch algorithm (default)
+	void affine_proposal_split(unsigned int j, unsigned int k_begin, unsigned int k_end, double& scale);	// Stretch proposal against a walker in [k_begin, k_end), without evaluating pdf(Y)
+	void stretch_accept(unsigned int j, double scale, bool record_step);	// Accept or reject the stretch proposal for sampler j
 	void replacement_proposal(unsigned int j, bool unbalanced);	// Generate a proposal state for sampler j using the replacement algorithm (long-range steps)
 	void replacement_proposal_diag(unsigned int j, bool unbalanced);	// Geenrate proposal state using replacement algorithm (with diagonal covariance)
 	void mixture_proposal(unsigned int j);				// Generate a proposal state for sampler j from a Gaussian mixture model designed to resemble the target distribution
-	void MH_proposal(unsigned int j);				// Generate a Metropolis-Hastings proposal for sampler j
+	void MH_proposal(unsigned int j, bool evaluate=true);		// Generate a Metropolis-Hastings proposal for sampler j
+	void eval_proposals(unsigned int begin, unsigned int end);	// Evaluate pdf(Y) for proposals [begin, end), in parallel (and through <pdf_batch>, if set)
+	void draw_step(double *const w);				// Draw w ~ N(0, ensemble covariance)
+	unsigned int dim() const { return NDim ? NDim : N; }		// Dimensionality, constant if NDim is set
 	void update_ensemble_cov();					// Calculate the covariance of the ensemble, as well as its inverse, determinant and square-root (A A^T = Cov)
 	double log_gaussian_density(const TState *const x, const TState *const y);	// Log gaussian density at (x-y) given covariance matrix of ensemble
 	double log_gaussian_density_diag(const TState *const x, const TState *const y);	// Log gaussian density at (x-y) given diagonal approximation of covariance matrix of ensemble
 	
 public:
-	typedef double (*pdf_t)(const double *const _X, unsigned int _N, TParams& _params);
+	typedef TAffinePdfPtr<TParams> pdf_t;
 	typedef void (*rand_state_t)(double *const _X, unsigned int _N, gsl_rng* r, TParams& _params);
 	typedef double (*reversible_step_t)(double *const _X, double *const _Y, unsigned int _N, gsl_rng* r, TParams& _params);
+	// Evaluates pdf at _n points at once, writing the results to _pi
+	typedef void (*pdf_batch_t)(const double *const *const _X, unsigned int _n, unsigned int _N, TParams& _params, double *const _pi);
 	
 	// Constructor & destructor
-	TAffineSampler(pdf_t _pdf, rand_state_t _rand_state, unsigned int _N, unsigned int _L, TParams& _params, TLogger& _logger, bool _use_log=true);
+	TAffineSampler(TPdf _pdf, rand_state_t _rand_state, unsigned int _N, unsigned int _L, TParams& _params, TLogger& _logger, bool _use_log=true);
 	~TAffineSampler();
 	
 	// Mutators
 	void step(bool record_step=true, double p_replacement=0.1,
 	          bool unbalanced=false, bool diag_approx=false);	// Advance each sampler in ensemble by one step
+	bool draw_replacement(double p_replacement) { return gsl_rng_uniform(r) < p_replacement; }	// Decide whether the next step should be a replacement step
 	void step_affine(bool record_step=true);					
+	void step_affine_split(bool record_step=true);	// Stretch step updating each half of the ensemble against the other half
 	void step_replacement(bool record_step=true, bool unbalanced=false, bool diag_approx=false);	// Replacement step using full covariance (affine invariant)
 	void step_MH(bool record_step=true);		// Advance each sampler using Metropolis-Hastings step
 	void step_custom_reversible(reversible_step_t f_reversible_step, bool record_step=true);
@@ -172,6 +191,8 @@ public:
 	void set_MH_bandwidth(double _h);
 	void set_replacement_accept_bias(double epsilon);
 	void set_sigma_min(double _sigma_min);
+	void set_pdf_batch(pdf_batch_t _pdf_batch) { pdf_batch = _pdf_batch; }	// Used for steps whose proposals are independent of each other
+	void set_split_stretch(bool _split_stretch) { split_stretch = _split_stretch; }	// Use step_affine_split for stretch steps
 	void flush(bool record_steps=true);		// Clear the weights in the ensemble and record the outstanding component states
 	void clear();					// Clear the stats, acceptance information and weights
 	
@@ -206,7 +227,11 @@ public:
 	
 private:
 	rand_state_t rand_state;	// Function which generates a random state
-	pdf_t pdf;			// pi(X), a function proportional to the target distribution
+	TPdf pdf;			// pi(X), a function proportional to the target distribution
+	pdf_batch_t pdf_batch;		// Same as <pdf>, for many states at once (optional)
+	bool split_stretch;		// If true, stretch steps use the red-blue split of the ensemble
+	std::vector<const double*> batch_X;	// Workspace for <pdf_batch>
+	std::vector<double> batch_pi;
 };
 
 
@@ -214,9 +239,9 @@ private:
  *   Parallel Affine Sampler Prototype
  *************************************************************************/
 
-template<class TParams, class TLogger>
+template<class TParams, class TLogger, class TPdf=TAffinePdfPtr<TParams>, unsigned int NDim=0>
 class TParallelAffineSampler {
-	TAffineSampler<TParams, TLogger>** sampler;
+	TAffineSampler<TParams, TLogger, TPdf, NDim>** sampler;
 	unsigned int N;
 	unsigned int N_samplers;
 	TStats stats;
@@ -224,10 +249,11 @@ class TParallelAffineSampler {
 	TLogger& logger;
 	TParams& params;
 	double *R;
+	bool parallel_walkers;	// If true, threads go to the walkers of each sampler in stretch and M-H steps, rather than to the samplers
 	
 public:
 	// Constructor & Destructor
-	TParallelAffineSampler(typename TAffineSampler<TParams, TLogger>::pdf_t _pdf, typename TAffineSampler<TParams, TLogger>::rand_state_t _rand_state, unsigned int _N, unsigned int _L, TParams& _params, TLogger& _logger, unsigned int _N_samplers, bool _use_log=true);
+	TParallelAffineSampler(TPdf _pdf, typename TAffineSampler<TParams, TLogger, TPdf, NDim>::rand_state_t _rand_state, unsigned int _N, unsigned int _L, TParams& _params, TLogger& _logger, unsigned int _N_samplers, bool _use_log=true);
 	~TParallelAffineSampler();
 	
 	// Mutators
@@ -235,7 +261,7 @@ public:
 	          double p_replacement=0.1, bool unbalanced=false, bool diag_approx=false);	// Take the given number of steps in each affine sampler
 	void step_MH(unsigned int N_steps, bool record_steps);		// Take the given number of Metropolis-Hastings steps in each affine sampler
 	void step_custom_reversible(unsigned int N_steps,
-	                            typename TAffineSampler<TParams, TLogger>::reversible_step_t f_reversible_step,
+	                            typename TAffineSampler<TParams, TLogger, TPdf, NDim>::reversible_step_t f_reversible_step,
 	                            bool record_steps);	// Take given number of steps using custom user-provided reversible step
 	void tune_stretch(unsigned int N_rounds, double target_acceptance);	// Adjust stretch scale to achieve desired acceptance rate
 	void tune_MH(unsigned int N_rounds, double target_acceptance);		// Adjust step size to achieve desired acceptance rate
@@ -244,6 +270,8 @@ public:
 	void set_MH_bandwidth(double h) { for(unsigned int i=0; i<N_samplers; i++) { sampler[i]->set_MH_bandwidth(h); } };	// Set size of M-H steps (in units of covariance) 
 	void set_replacement_accept_bias(double epsilon) { for(unsigned int i=0; i<N_samplers; i++) { sampler[i]->set_replacement_accept_bias(epsilon); } };
 	void set_sigma_min(double _sigma_min) { for(unsigned int i=0; i<N_samplers; i++) { sampler[i]->set_sigma_min(_sigma_min); } };
+	void set_pdf_batch(typename TAffineSampler<TParams, TLogger, TPdf, NDim>::pdf_batch_t f) { for(unsigned int i=0; i<N_samplers; i++) { sampler[i]->set_pdf_batch(f); } };
+	void set_split_stretch(bool split) { parallel_walkers = split; for(unsigned int i=0; i<N_samplers; i++) { sampler[i]->set_split_stretch(split); } };	// Also moves the threads from the samplers to their walkers
 	void init_gaussian_mixture_target(unsigned int nclusters, unsigned int iterations=100) { for(unsigned int i=0; i<N_samplers; i++) { sampler[i]->init_gaussian_mixture_target(nclusters, iterations); } };
 	void clear() { for(unsigned int i=0; i<N_samplers; i++) { sampler[i]->clear(); }; stats.clear(); };
 	
@@ -264,7 +292,7 @@ public:
 	void print_diagnostics();
 	void print_state() { for(unsigned int i=0; i<N_samplers; i++) { sampler[i]->print_state(); } }
 	void print_clusters() { for(unsigned int i=0; i<N_samplers; i++) { std::cout << std::endl; sampler[i]->print_clusters(); } } 
-	TAffineSampler<TParams, TLogger>* get_sampler(unsigned int index) { assert(index < N_samplers); return sampler[index]; }
+	TAffineSampler<TParams, TLogger, TPdf, NDim>* get_sampler(unsigned int index) { assert(index < N_samplers); return sampler[index]; }
 	
 	// Calculate the GR diagnostic on a transformed space
 	void calc_GR_transformed(std::vector<double>& GR, TTransformParamSpace* transf);
@@ -276,28 +304,34 @@ public:
  *************************************************************************/
 
 // Component state type
-template<class TParams, class TLogger>
-struct TAffineSampler<TParams, TLogger>::TState {
+template<class TParams, class TLogger, class TPdf, unsigned int NDim>
+struct TAffineSampler<TParams, TLogger, TPdf, NDim>::TState {
 	double *element;
 	unsigned int N;
 	double pi;		// pdf(X) = likelihood of state (up to normalization)
 	unsigned int weight;	// # of times the chain has remained on this state
 	double replacement_factor;	// Factor of Q(Y->X) / Q(X->Y) used when evaluating acceptance probability of replacement step
+	double storage[NDim ? NDim : 1];	// Holds <element> in place if NDim is set
 	
 	TState() : N(0), element(NULL) {}
-	TState(unsigned int _N) : N(_N) { element = new double[N]; }
-	~TState() { if(element != NULL) { delete[] element; } }
+	TState(unsigned int _N) : N(0), element(NULL) { initialize(_N); }
+	~TState() { if((element != NULL) && (element != storage)) { delete[] element; } }
 	
 	void initialize(unsigned int _N) {
 		N = _N;
-		if(element == NULL) { element = new double[N]; }
+		if(element == NULL) {
+			assert((NDim == 0) || (NDim == N));
+			element = NDim ? storage : new double[N];
+		}
 	}
 	
+	unsigned int dim() const { return NDim ? NDim : N; }
+	
 	double& operator[](unsigned int index) { return element[index]; }
 	
 	// Assignment operator
 	TState& operator=(const TState& rhs) {
-		for(unsigned int i=0; i<N; i++) { element[i] = rhs.element[i]; }
+		for(unsigned int i=0; i<dim(); i++) { element[i] = rhs.element[i]; }
 		pi = rhs.pi;
 		weight = rhs.weight;
 		return *this;
@@ -307,13 +341,13 @@ struct TAffineSampler<TParams, TLogger>::TState {
 	bool operator==(const TState& rhs) {
 		assert(rhs.N == N);
 		if(pi != rhs.pi){ return false; }
-		for(unsigned int i=0; i<N; i++) { if(element[i] != rhs.element[i]) { return false; } }
+		for(unsigned int i=0; i<dim(); i++) { if(element[i] != rhs.element[i]) { return false; } }
 		return true;
 	}
 	bool operator!=(const TState& rhs) {
 		assert(rhs.N == N);
 		if(pi != rhs.pi){ return true; }
-		for(unsigned int i=0; i<N; i++) { if(element[i] != rhs.element[i]) { return true; } }
+		for(unsigned int i=0; i<dim(); i++) { if(element[i] != rhs.element[i]) { return true; } }
 		return false;
 	}
 	
@@ -342,9 +376,9 @@ struct TAffineSampler<TParams, TLogger>::TState {
 // 	_params		Misc. constant model parameters needed by _pdf
 // 	_logger		Object which logs the chain in some way. It must have an operator()(double state[N], unsigned int weight).
 // 			The logger could, for example, bin the chain, or just push back each state into a vector.
-template<class TParams, class TLogger>
-TAffineSampler<TParams, TLogger>::TAffineSampler(pdf_t _pdf, rand_state_t _rand_state, unsigned int _N, unsigned int _L, TParams& _params, TLogger& _logger, bool _use_log)
-	: pdf(_pdf), rand_state(_rand_state), params(_params), logger(_logger), N(_N), L(_L), X(NULL), Y(NULL), accept(NULL),
+template<class TParams, class TLogger, class TPdf, unsigned int NDim>
+TAffineSampler<TParams, TLogger, TPdf, NDim>::TAffineSampler(TPdf _pdf, rand_state_t _rand_state, unsigned int _N, unsigned int _L, TParams& _params, TLogger& _logger, bool _use_log)
+	: pdf(_pdf), pdf_batch(NULL), split_stretch(false), rand_state(_rand_state), params(_params), logger(_logger), N(_N), L(_L), X(NULL), Y(NULL), accept(NULL),
 	  r(NULL), use_log(_use_log), chain(_N, 1000*_L), W(NULL), ensemble_mean(NULL), ensemble_cov(NULL), sqrt_ensemble_cov(NULL),
 	  inv_ensemble_cov(NULL), wv(NULL), ws(NULL), wm1(NULL), wm2(NULL), wp(NULL), gm_target(NULL),
 	  diag_cov(NULL), sqrt_diag_cov(NULL), inv_diag_cov(NULL)
@@ -453,8 +487,8 @@ TAffineSampler<TParams, TLogger>::TAffineSampler(pdf_t _pdf, rand_state_t _rand_
 }
 
 // Destructor
-template<class TParams, class TLogger>
-TAffineSampler<TParams, TLogger>::~TAffineSampler() {
+template<class TParams, class TLogger, class TPdf, unsigned int NDim>
+TAffineSampler<TParams, TLogger, TPdf, NDim>::~TAffineSampler() {
 	gsl_rng_free(r);
 	if(X != NULL) { delete[] X; X = NULL; }
 	if(Y != NULL) { delete[] Y; Y = NULL; }
@@ -481,8 +515,8 @@ TAffineSampler<TParams, TLogger>::~TAffineSampler() {
  *************************************************************************/
 
 // Generate a proposal state
-template<class TParams, class TLogger>
-inline void TAffineSampler<TParams, TLogger>::affine_proposal(unsigned int j, double& scale) {
+template<class TParams, class TLogger, class TPdf, unsigned int NDim>
+inline void TAffineSampler<TParams, TLogger, TPdf, NDim>::affine_proposal(unsigned int j, double& scale) {
 	// Determine stretch scale
 	scale = (sqrta - 1./sqrta) * gsl_rng_uniform(r) + 1./sqrta;
 	scale *= scale;
@@ -492,7 +526,7 @@ inline void TAffineSampler<TParams, TLogger>::affine_proposal(unsigned int j, do
 	if(k >= j) { k += 1; }
 	
 	// Determine the coordinates of the proposal
-	for(unsigned int i=0; i<N; i++) {
+	for(unsigned int i=0; i<dim(); i++) {
 		Y[j].element[i] = (1. - scale) * X[k].element[i] + scale * X[j].element[i];
 	}
 	
@@ -502,6 +536,26 @@ inline void TAffineSampler<TParams, TLogger>::affine_proposal(unsigned int j, do
 	Y[j].replacement_factor = 1.;
 }
 
+// Generate a stretch proposal from a walker in [k_begin, k_end), which
+// must not contain j. pdf(Y) is left to the caller.
+template<class TParams, class TLogger, class TPdf, unsigned int NDim>
+inline void TAffineSampler<TParams, TLogger, TPdf, NDim>::affine_proposal_split(unsigned int j, unsigned int k_begin, unsigned int k_end, double& scale) {
+	// Determine stretch scale
+	scale = (sqrta - 1./sqrta) * gsl_rng_uniform(r) + 1./sqrta;
+	scale *= scale;
+	
+	// Choose a sampler to stretch from
+	unsigned int k = k_begin + gsl_rng_uniform_int(r, (long unsigned int)(k_end - k_begin));
+	
+	// Determine the coordinates of the proposal
+	for(unsigned int i=0; i<dim(); i++) {
+		Y[j].element[i] = (1. - scale) * X[k].element[i] + scale * X[j].element[i];
+	}
+	
+	Y[j].weight = 1;
+	Y[j].replacement_factor = 1.;
+}
+
 
 // Calculate the transformation matrix A s.t. AA^T = S, where S is the covariance matrix.
 // wv, wm1, wm2 and wm3 are workspaces required by the algorithm. The dimensions of wv and ws must be N, while wm1 and wm2 must have dimensions NxN.
@@ -528,8 +582,8 @@ static void calc_sqrt_A(gsl_matrix *A, const gsl_matrix * const S, gsl_vector* w
 	gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, 1., wm1, wm2, 0., A);
 }
 
-template<class TParams, class TLogger>
-void TAffineSampler<TParams, TLogger>::update_ensemble_cov() {
+template<class TParams, class TLogger, class TPdf, unsigned int NDim>
+void TAffineSampler<TParams, TLogger, TPdf, NDim>::update_ensemble_cov() {
 	double sum_weight = 0.;
 	double weight;
 	
@@ -540,30 +594,30 @@ void TAffineSampler<TParams, TLogger>::update_ensemble_cov() {
 	}
 	
 	// Mean
-	for(unsigned int i=0; i<N; i++) { ensemble_mean[i] = 0.; }
+	for(unsigned int i=0; i<dim(); i++) { ensemble_mean[i] = 0.; }
 	
 	if(use_log) {
 		for(unsigned int n=0; n<L; n++) {
 			weight = exp(X[n].pi - pi_0);
 			sum_weight += weight;
-			for(unsigned int i=0; i<N; i++) { ensemble_mean[i] += weight * X[n].element[i]; }
+			for(unsigned int i=0; i<dim(); i++) { ensemble_mean[i] += weight * X[n].element[i]; }
 		}
 	} else {
 		for(unsigned int n=0; n<L; n++) {
 			weight = X[n].pi / pi_0;
 			sum_weight += weight;
-			for(unsigned int i=0; i<N; i++) { ensemble_mean[i] += weight * X[n].element[i]; }
+			for(unsigned int i=0; i<dim(); i++) { ensemble_mean[i] += weight * X[n].element[i]; }
 		}
 	}
 	
-	for(unsigned int i=0; i<N; i++) { ensemble_mean[i] /= sum_weight; }
+	for(unsigned int i=0; i<dim(); i++) { ensemble_mean[i] /= sum_weight; }
 	
 	// Covariance
 	double tmp;
 	
 	if(use_log) {
-		for(unsigned int j=0; j<N; j++) {
-			for(unsigned int k=j; k<N; k++) {
+		for(unsigned int j=0; j<dim(); j++) {
+			for(unsigned int k=j; k<dim(); k++) {
 				gsl_matrix_set(ensemble_cov, j, k, 0.);
 			}
 		}
@@ -571,8 +625,8 @@ void TAffineSampler<TParams, TLogger>::update_ensemble_cov() {
 		for(unsigned int n=0; n<L; n++) {
 			weight = exp(X[n].pi - pi_0);
 			
-			for(unsigned int j=0; j<N; j++) {
-				for(unsigned int k=j; k<N; k++) {
+			for(unsigned int j=0; j<dim(); j++) {
+				for(unsigned int k=j; k<dim(); k++) {
 					tmp = gsl_matrix_get(ensemble_cov, j, k);
 					tmp += weight * (X[n].element[j] - ensemble_mean[j]) * (X[n].element[k] - ensemble_mean[k]);
 					gsl_matrix_set(ensemble_cov, j, k, tmp);
@@ -580,8 +634,8 @@ void TAffineSampler<TParams, TLogger>::update_ensemble_cov() {
 			}
 		}
 		
-		for(unsigned int j=0; j<N; j++) {
-			for(unsigned int k=j; k<N; k++) {
+		for(unsigned int j=0; j<dim(); j++) {
+			for(unsigned int k=j; k<dim(); k++) {
 				tmp = gsl_matrix_get(ensemble_cov, j, k) / sum_weight;
 				gsl_matrix_set(ensemble_cov, j, k, tmp);
 				gsl_matrix_set(ensemble_cov, k, j, tmp);
@@ -589,8 +643,8 @@ void TAffineSampler<TParams, TLogger>::update_ensemble_cov() {
 		}
 		
 	} else {
-		for(unsigned int j=0; j<N; j++) {
-			for(unsigned int k=j; k<N; k++) {
+		for(unsigned int j=0; j<dim(); j++) {
+			for(unsigned int k=j; k<dim(); k++) {
 				tmp = 0.;
 				sum_weight = 0.;
 				for(unsigned int n=0; n<L; n++) {
@@ -610,7 +664,7 @@ void TAffineSampler<TParams, TLogger>::update_ensemble_cov() {
 	
 	// Add in small constant along diagonals
 	if(sigma_min > 0.) {
-		for(unsigned int j=0; j<N; j++) {
+		for(unsigned int j=0; j<dim(); j++) {
 			tmp = gsl_matrix_get(ensemble_cov, j, j);
 			tmp = sqrt(tmp*tmp + sigma_min*sigma_min);
 			gsl_matrix_set(ensemble_cov, j, j, tmp);
@@ -619,7 +673,7 @@ void TAffineSampler<TParams, TLogger>::update_ensemble_cov() {
 	
 	/*#pragma omp critical (cout)
 	{
-	for(int k=0; k<N; k++) {
+	for(int k=0; k<dim(); k++) {
 		std::cerr << sqrt(gsl_matrix_get(ensemble_cov, k, k)) << "  ";
 	}
 	std::cerr << std::endl;
@@ -634,7 +688,7 @@ void TAffineSampler<TParams, TLogger>::update_ensemble_cov() {
 	det_diag_cov = 1.;
 	//#pragma omp critical
 	//{
-	for(unsigned int j=0; j<N; j++) {
+	for(unsigned int j=0; j<dim(); j++) {
 		tmp = 0.;
 		for(unsigned int n=0; n<L; n++) { tmp += (X[n].element[j] - ensemble_mean[j]) * (X[n].element[j] - ensemble_mean[j]); }
 		tmp /= (double)(L - 1);
@@ -651,16 +705,16 @@ void TAffineSampler<TParams, TLogger>::update_ensemble_cov() {
 }
 
 // Get the density Gaussian proposal distribution
-template<class TParams, class TLogger>
-double TAffineSampler<TParams, TLogger>::log_gaussian_density(const TState *const x, const TState *const y) {
+template<class TParams, class TLogger, class TPdf, unsigned int NDim>
+double TAffineSampler<TParams, TLogger, TPdf, NDim>::log_gaussian_density(const TState *const x, const TState *const y) {
 	double sum = 0.;
 	double tmp;
 	//double *inv = inv_ensemble_cov->data;
-	for(unsigned int i=0; i<N; i++) {
+	for(unsigned int i=0; i<dim(); i++) {
 		tmp = (x->element[i] - y->element[i]);
 		//sum += tmp * tmp * inv[i + N*i];
 		sum += tmp * gsl_matrix_get(inv_ensemble_cov, i, i) * tmp;
-		for(unsigned int j=i+1; j<N; j++) {
+		for(unsigned int j=i+1; j<dim(); j++) {
 			sum += 2. * tmp * gsl_matrix_get(inv_ensemble_cov, i, j) * (x->element[j] - y->element[j]);
 		}
 	}
@@ -674,27 +728,27 @@ double TAffineSampler<TParams, TLogger>::log_gaussian_density(const TState *cons
 }
 
 // Get the density Gaussian proposal distribution, using only the diagonal terms in the covariance matrix
-template<class TParams, class TLogger>
-double TAffineSampler<TParams, TLogger>::log_gaussian_density_diag(const TState *const x, const TState *const y) {
+template<class TParams, class TLogger, class TPdf, unsigned int NDim>
+double TAffineSampler<TParams, TLogger, TPdf, NDim>::log_gaussian_density_diag(const TState *const x, const TState *const y) {
 	double sum = 0.;
 	double tmp;
-	for(unsigned int i=0; i<N; i++) {
+	for(unsigned int i=0; i<dim(); i++) {
 		tmp = (x->element[i] - y->element[i]);
 		sum += tmp * tmp * inv_diag_cov[i];
 	}
 	return -(double)N * log_h + log_norm_diag_cov - sum/(2.*h*h);
 }
 
-template<class TParams, class TLogger>
-void TAffineSampler<TParams, TLogger>::replacement_proposal(unsigned int j, bool unbalanced) {
+template<class TParams, class TLogger, class TPdf, unsigned int NDim>
+void TAffineSampler<TParams, TLogger, TPdf, NDim>::replacement_proposal(unsigned int j, bool unbalanced) {
 	// Choose a sampler to step from
 	unsigned int k = gsl_rng_uniform_int(r, (long unsigned int)L);
 	
 	// Determine step vector
-	draw_from_cov(W, sqrt_ensemble_cov, N, r);
+	draw_step(W);
 	
 	// Determine the coordinates of the proposal
-	for(unsigned int i=0; i<N; i++) {
+	for(unsigned int i=0; i<dim(); i++) {
 		Y[j].element[i] = X[k].element[i] + h * W[i];
 	}
 	
@@ -762,8 +816,8 @@ void TAffineSampler<TParams, TLogger>::replacement_proposal(unsigned int j, bool
 	Y[j].weight = 1.;
 }
 
-template<class TParams, class TLogger>
-void TAffineSampler<TParams, TLogger>::replacement_proposal_diag(unsigned int j, bool unbalanced) {
+template<class TParams, class TLogger, class TPdf, unsigned int NDim>
+void TAffineSampler<TParams, TLogger, TPdf, NDim>::replacement_proposal_diag(unsigned int j, bool unbalanced) {
 	// Choose a sampler to step from
 	unsigned int k = gsl_rng_uniform_int(r, (long unsigned int)L);
 	
@@ -771,7 +825,7 @@ void TAffineSampler<TParams, TLogger>::replacement_proposal_diag(unsigned int j,
 	//draw_from_cov(W, sqrt_ensemble_cov, N, r);
 	
 	// Determine the coordinates of the proposal
-	for(unsigned int i=0; i<N; i++) {
+	for(unsigned int i=0; i<dim(); i++) {
 		//Y[j].element[i] = X[k].element[i] + h * W[i];
 		Y[j].element[i] = X[k].element[i] + h * sqrt_diag_cov[i] * gsl_ran_gaussian_ziggurat(r, 1.);
 	}
@@ -839,24 +893,77 @@ void TAffineSampler<TParams, TLogger>::replacement_proposal_diag(unsigned int j,
 	Y[j].weight = 1.;
 }
 
-template<class TParams, class TLogger>
-void TAffineSampler<TParams, TLogger>::MH_proposal(unsigned int j) {
+template<class TParams, class TLogger, class TPdf, unsigned int NDim>
+void TAffineSampler<TParams, TLogger, TPdf, NDim>::MH_proposal(unsigned int j, bool evaluate) {
 	// Determine step vector
-	draw_from_cov(W, sqrt_ensemble_cov, N, r);
+	draw_step(W);
 	
 	// Determine the coordinates of the proposal
-	for(unsigned int i=0; i<N; i++) {
+	for(unsigned int i=0; i<dim(); i++) {
 		Y[j].element[i] = X[j].element[i] + h_MH * W[i];
 	}
 	
 	// Get pdf(Y) and initialize weight of proposal point to unity
-	Y[j].pi = pdf(Y[j].element, N, params);
+	if(evaluate) { Y[j].pi = pdf(Y[j].element, N, params); }
 	Y[j].weight = 1.;
 	Y[j].replacement_factor = 1.;
 }
 
-template<class TParams, class TLogger>
-void TAffineSampler<TParams, TLogger>::mixture_proposal(unsigned int j) {
+// Same draws, in the same order, as draw_from_cov
+template<class TParams, class TLogger, class TPdf, unsigned int NDim>
+inline void TAffineSampler<TParams, TLogger, TPdf, NDim>::draw_step(double *const w) {
+	const double *const A = sqrt_ensemble_cov->data;
+	const size_t tda = sqrt_ensemble_cov->tda;
+	for(unsigned int i=0; i<dim(); i++) { w[i] = 0.; }
+	for(unsigned int j=0; j<dim(); j++) {
+		double tmp = gsl_ran_gaussian_ziggurat(r, 1.);
+		for(unsigned int i=0; i<dim(); i++) { w[i] += A[i*tda + j] * tmp; }
+	}
+}
+
+template<class TParams, class TLogger, class TPdf, unsigned int NDim>
+void TAffineSampler<TParams, TLogger, TPdf, NDim>::eval_proposals(unsigned int begin, unsigned int end) {
+	unsigned int n = end - begin;
+	
+	// Only open a parallel region if not already in an active one. Inside a
+	// nested, inactive region, omp_get_thread_num() would return 0 in every
+	// thread, and the per-thread workspaces in <params> would be shared.
+	bool threaded = !omp_in_parallel();
+	
+	if(pdf_batch != NULL) {
+		batch_X.resize(L);
+		batch_pi.resize(L);
+		for(unsigned int j=begin; j<end; j++) { batch_X[j] = Y[j].element; }
+		
+		if(threaded) {
+			// Each thread evaluates one contiguous chunk as a batch
+			#pragma omp parallel
+			{
+				unsigned int n_threads = omp_get_num_threads();
+				unsigned int t = omp_get_thread_num();
+				unsigned int j0 = begin + (n * t) / n_threads;
+				unsigned int j1 = begin + (n * (t+1)) / n_threads;
+				if(j1 > j0) { pdf_batch(&(batch_X[j0]), j1-j0, N, params, &(batch_pi[j0])); }
+			}
+		} else {
+			pdf_batch(&(batch_X[begin]), n, N, params, &(batch_pi[begin]));
+		}
+		
+		for(unsigned int j=begin; j<end; j++) { Y[j].pi = batch_pi[j]; }
+	} else if(threaded) {
+		#pragma omp parallel for schedule(dynamic)
+		for(int j=begin; j<(int)end; j++) {
+			Y[j].pi = pdf(Y[j].element, N, params);
+		}
+	} else {
+		for(unsigned int j=begin; j<end; j++) {
+			Y[j].pi = pdf(Y[j].element, N, params);
+		}
+	}
+}
+
+template<class TParams, class TLogger, class TPdf, unsigned int NDim>
+void TAffineSampler<TParams, TLogger, TPdf, NDim>::mixture_proposal(unsigned int j) {
 	// Draw from Gaussian mixture
 	gm_target->draw(Y[j].element);
 	
@@ -867,8 +974,8 @@ void TAffineSampler<TParams, TLogger>::mixture_proposal(unsigned int j) {
 	Y[j].replacement_factor = gm_target->density(X[j].element) / gm_target->density(Y[j].element);
 }
 
-template<class TParams, class TLogger>
-void TAffineSampler<TParams, TLogger>::init_gaussian_mixture_target(unsigned int nclusters, unsigned int iterations) {
+template<class TParams, class TLogger, class TPdf, unsigned int NDim>
+void TAffineSampler<TParams, TLogger, TPdf, NDim>::init_gaussian_mixture_target(unsigned int nclusters, unsigned int iterations) {
 	if(gm_target != NULL) { delete gm_target; }
 	gm_target = new TGaussianMixture(N, nclusters);
 	get_chain().fit_gaussian_mixture(gm_target, iterations);
@@ -879,14 +986,13 @@ void TAffineSampler<TParams, TLogger>::init_gaussian_mixture_target(unsigned int
  *   Mutators
  *************************************************************************/
 
-template<class TParams, class TLogger>
-void TAffineSampler<TParams, TLogger>::step(bool record_step, double p_replacement,
+template<class TParams, class TLogger, class TPdf, unsigned int NDim>
+void TAffineSampler<TParams, TLogger, TPdf, NDim>::step(bool record_step, double p_replacement,
                                             bool unbalanced, bool diag_approx) {
 	// Make either a stretch or a replacement step
-	double p = gsl_rng_uniform(r);
 	//#pragma omp critical
 	//{
-	if(p < p_replacement) {
+	if(draw_replacement(p_replacement)) {
 		//std::cerr << "replacement" << std::endl;
 		step_replacement(record_step, unbalanced, diag_approx);
 	} else {
@@ -896,88 +1002,129 @@ void TAffineSampler<TParams, TLogger>::step(bool record_step, double p_replaceme
 	//}
 }
 
-template<class TParams, class TLogger>
-void TAffineSampler<TParams, TLogger>::step_affine(bool record_step) {
-	double scale, alpha, p;
+template<class TParams, class TLogger, class TPdf, unsigned int NDim>
+void TAffineSampler<TParams, TLogger, TPdf, NDim>::step_affine(bool record_step) {
+	if(split_stretch) {
+		step_affine_split(record_step);
+		return;
+	}
+	
+	double scale;
 	for(unsigned int j=0; j<L; j++) {
 		// Draw a proposal
 		affine_proposal(j, scale);
+		stretch_accept(j, scale, record_step);
+	}
+}
+
+// Stretch step with the ensemble split into two halves (Foreman-Mackey et
+// al. 2013). Each walker in one half is stretched against a walker in the
+// other, frozen half, so the proposals within a half are independent, and
+// pdf can be evaluated for all of them at once. The random draws are still
+// made serially, from this sampler's generator.
+template<class TParams, class TLogger, class TPdf, unsigned int NDim>
+void TAffineSampler<TParams, TLogger, TPdf, NDim>::step_affine_split(bool record_step) {
+	assert(L >= 2);
+	
+	std::vector<double> scale(L);
+	unsigned int half = L / 2;
+	
+	for(unsigned int side=0; side<2; side++) {
+		unsigned int j_begin = (side == 0) ? 0 : half;
+		unsigned int j_end = (side == 0) ? half : L;
+		unsigned int k_begin = (side == 0) ? half : 0;
+		unsigned int k_end = (side == 0) ? L : half;
 		
-		// Determine if the proposal is the maximum-likelihood point
-		if(Y[j].pi > X_ML.pi) { X_ML = Y[j]; }
+		for(unsigned int j=j_begin; j<j_end; j++) {
+			affine_proposal_split(j, k_begin, k_end, scale[j]);
+		}
 		
-		// Determine whether to accept or reject
-		accept[j] = false;
-		if(use_log) {	// If <pdf> returns log probability
-			// Determine the acceptance probability
-			if(is_neg_inf_replacement(X[j].pi) && !(is_neg_inf_replacement(Y[j].pi))) {
-				alpha = 1;	// Accept the proposal if the current state has zero probability and the proposed state doesn't
-			} else {
-				alpha = (double)(N - 1) * log(scale) + Y[j].pi - X[j].pi;
-			}
-			
-			// Decide whether to accept or reject
-			if(alpha > 0.) {	// Accept if probability of acceptance is greater than unity
+		eval_proposals(j_begin, j_end);
+		
+		for(unsigned int j=j_begin; j<j_end; j++) {
+			stretch_accept(j, scale[j], record_step);
+		}
+	}
+}
+
+template<class TParams, class TLogger, class TPdf, unsigned int NDim>
+inline void TAffineSampler<TParams, TLogger, TPdf, NDim>::stretch_accept(unsigned int j, double scale, bool record_step) {
+	double alpha, p;
+	
+	// Determine if the proposal is the maximum-likelihood point
+	if(Y[j].pi > X_ML.pi) { X_ML = Y[j]; }
+	
+	// Determine whether to accept or reject
+	accept[j] = false;
+	if(use_log) {	// If <pdf> returns log probability
+		// Determine the acceptance probability
+		if(is_neg_inf_replacement(X[j].pi) && !(is_neg_inf_replacement(Y[j].pi))) {
+			alpha = 1;	// Accept the proposal if the current state has zero probability and the proposed state doesn't
+		} else {
+			alpha = (double)(N - 1) * log(scale) + Y[j].pi - X[j].pi;
+		}
+		
+		// Decide whether to accept or reject
+		if(alpha > 0.) {	// Accept if probability of acceptance is greater than unity
+			accept[j] = true;
+		} else {
+			p = gsl_rng_uniform(r);
+			if((p == 0.) && (Y[j] > neg_inf_replacement)) {	// Accept if zero is rolled but proposal has nonzero probability
 				accept[j] = true;
-			} else {
-				p = gsl_rng_uniform(r);
-				if((p == 0.) && (Y[j] > neg_inf_replacement)) {	// Accept if zero is rolled but proposal has nonzero probability
-					accept[j] = true;
-				} else if(log(p) < alpha) {
-					accept[j] = true;
-				}
-			}
-		} else {	// If <pdf> returns bare probability
-			// Determine the acceptance probability
-			if((X[j].pi == 0) && (Y[j].pi != 0)) {
-				alpha = 2;	// Accept the proposal if the current state has zero probability and the proposed state doesn't
-			} else {
-				alpha = pow(scale, (double)(N - 1)) * Y[j].pi / X[j].pi;
-			}
-			
-			// Decide whether to accept or reject
-			if(alpha > 1.) {	// Accept if probability of acceptance is greater than unity
+			} else if(log(p) < alpha) {
 				accept[j] = true;
-			} else {
-				p = gsl_rng_uniform(r);
-				if((p == 0.) && (Y[j] != 0.)) {	// Accept if zero is rolled but proposal has nonzero probability
-					accept[j] = true;
-				} else if(p < alpha) {
-					accept[j] = true;
-				}
 			}
 		}
+	} else {	// If <pdf> returns bare probability
+		// Determine the acceptance probability
+		if((X[j].pi == 0) && (Y[j].pi != 0)) {
+			alpha = 2;	// Accept the proposal if the current state has zero probability and the proposed state doesn't
+		} else {
+			alpha = pow(scale, (double)(N - 1)) * Y[j].pi / X[j].pi;
+		}
 		
-		// Update sampler j
-		if(accept[j]) {
-		    if(is_neg_inf_replacement(Y[j].pi)) {
-		        #pragma omp critical (cout)
-		        {
-		        std::cerr << "!!! Accepted -infinity point! (affine step)" << std::endl;
-		        }
-		    }
-			if(record_step) {
-				chain.add_point(X[j].element, X[j].pi, (double)(X[j].weight));
-				
-				#pragma omp critical (logger)
-				logger(X[j].element, X[j].weight);
-			}
-			
-			X[j] = Y[j];
-			
-			N_accepted++;
-			N_stretch_accepted++;
+		// Decide whether to accept or reject
+		if(alpha > 1.) {	// Accept if probability of acceptance is greater than unity
+			accept[j] = true;
 		} else {
-			X[j].weight++;
+			p = gsl_rng_uniform(r);
+			if((p == 0.) && (Y[j] != 0.)) {	// Accept if zero is rolled but proposal has nonzero probability
+				accept[j] = true;
+			} else if(p < alpha) {
+				accept[j] = true;
+			}
+		}
+	}
+	
+	// Update sampler j
+	if(accept[j]) {
+	    if(is_neg_inf_replacement(Y[j].pi)) {
+	        #pragma omp critical (cout)
+	        {
+	        std::cerr << "!!! Accepted -infinity point! (affine step)" << std::endl;
+	        }
+	    }
+		if(record_step) {
+			chain.add_point(X[j].element, X[j].pi, (double)(X[j].weight));
 			
-			N_rejected++;
-			N_stretch_rejected++;
+			#pragma omp critical (logger)
+			logger(X[j].element, X[j].weight);
 		}
+		
+		X[j] = Y[j];
+		
+		N_accepted++;
+		N_stretch_accepted++;
+	} else {
+		X[j].weight++;
+		
+		N_rejected++;
+		N_stretch_rejected++;
 	}
 }
 
-template<class TParams, class TLogger>
-void TAffineSampler<TParams, TLogger>::step_replacement(bool record_step, bool unbalanced, bool diag_approx) {
+template<class TParams, class TLogger, class TPdf, unsigned int NDim>
+void TAffineSampler<TParams, TLogger, TPdf, NDim>::step_replacement(bool record_step, bool unbalanced, bool diag_approx) {
 	update_ensemble_cov();
 	
 	double alpha, p;
@@ -1079,16 +1226,24 @@ void TAffineSampler<TParams, TLogger>::step_replacement(bool record_step, bool u
 	}
 }
 
-template<class TParams, class TLogger>
-void TAffineSampler<TParams, TLogger>::step_MH(bool record_step) {
+template<class TParams, class TLogger, class TPdf, unsigned int NDim>
+void TAffineSampler<TParams, TLogger, TPdf, NDim>::step_MH(bool record_step) {
 	double alpha, p;
 	
 	// Update statistics on ensemble
 	update_ensemble_cov();
 	
+	// Each proposal depends only on its own walker, so they can all be
+	// drawn first and then evaluated together
+	bool batch = (pdf_batch != NULL);
+	if(batch) {
+		for(unsigned int j=0; j<L; j++) { MH_proposal(j, false); }
+		eval_proposals(0, L);
+	}
+	
 	for(unsigned int j=0; j<L; j++) {
 		// Generate proposal
-		MH_proposal(j);
+		if(!batch) { MH_proposal(j); }
 		
 		// Determine if the proposal is the maximum-likelihood point
 		if(Y[j].pi > X_ML.pi) { X_ML = Y[j]; }
@@ -1162,8 +1317,8 @@ void TAffineSampler<TParams, TLogger>::step_MH(bool record_step) {
 	}
 }
 
-template<class TParams, class TLogger>
-void TAffineSampler<TParams, TLogger>::step_custom_reversible(reversible_step_t f_reversible_step, bool record_step) {
+template<class TParams, class TLogger, class TPdf, unsigned int NDim>
+void TAffineSampler<TParams, TLogger, TPdf, NDim>::step_custom_reversible(reversible_step_t f_reversible_step, bool record_step) {
 	double alpha, p, Q_factor;
 	
 	for(unsigned int j=0; j<L; j++) {
@@ -1241,40 +1396,40 @@ void TAffineSampler<TParams, TLogger>::step_custom_reversible(reversible_step_t
 }
 
 // Set the dimensionless step scale
-template<class TParams, class TLogger>
-void TAffineSampler<TParams, TLogger>::set_scale(double a) {
+template<class TParams, class TLogger, class TPdf, unsigned int NDim>
+void TAffineSampler<TParams, TLogger, TPdf, NDim>::set_scale(double a) {
 	assert(a > 0);
 	sqrta = sqrt(a);
 }
 
-template<class TParams, class TLogger>
-void TAffineSampler<TParams, TLogger>::set_replacement_bandwidth(double _h) {
+template<class TParams, class TLogger, class TPdf, unsigned int NDim>
+void TAffineSampler<TParams, TLogger, TPdf, NDim>::set_replacement_bandwidth(double _h) {
 	assert(_h > 0.);
 	h = _h;
 	log_h = log(h);
 }
 
-template<class TParams, class TLogger>
-void TAffineSampler<TParams, TLogger>::set_MH_bandwidth(double _h) {
+template<class TParams, class TLogger, class TPdf, unsigned int NDim>
+void TAffineSampler<TParams, TLogger, TPdf, NDim>::set_MH_bandwidth(double _h) {
 	assert(_h > 0);
 	h_MH = _h;
 	log_h_MH = log(h_MH);
 }
 
-template<class TParams, class TLogger>
-void TAffineSampler<TParams, TLogger>::set_sigma_min(double _sigma_min) {
+template<class TParams, class TLogger, class TPdf, unsigned int NDim>
+void TAffineSampler<TParams, TLogger, TPdf, NDim>::set_sigma_min(double _sigma_min) {
 	assert(_sigma_min >= 0.);
 	sigma_min = _sigma_min;
 }
 
-template<class TParams, class TLogger>
-void TAffineSampler<TParams, TLogger>::set_replacement_accept_bias(double epsilon) {
+template<class TParams, class TLogger, class TPdf, unsigned int NDim>
+void TAffineSampler<TParams, TLogger, TPdf, NDim>::set_replacement_accept_bias(double epsilon) {
 	assert(epsilon >= 0.);
 	replacement_accept_bias = epsilon;
 }
 
-template<class TParams, class TLogger>
-void TAffineSampler<TParams, TLogger>::flush(bool record_steps) {
+template<class TParams, class TLogger, class TPdf, unsigned int NDim>
+void TAffineSampler<TParams, TLogger, TPdf, NDim>::flush(bool record_steps) {
 	for(unsigned int i=0; i<L; i++) {
 		if(record_steps) {
 			//stats(X[i].element, X[i].weight);
@@ -1287,8 +1442,8 @@ void TAffineSampler<TParams, TLogger>::flush(bool record_steps) {
 }
 
 // Clear the stats, acceptance information and weights
-template<class TParams, class TLogger>
-void TAffineSampler<TParams, TLogger>::clear() {
+template<class TParams, class TLogger, class TPdf, unsigned int NDim>
+void TAffineSampler<TParams, TLogger, TPdf, NDim>::clear() {
 	for(unsigned int i=0; i<L; i++) {
 		X[i].weight = 0;
 	}
@@ -1312,8 +1467,8 @@ void TAffineSampler<TParams, TLogger>::clear() {
  *   Accessors
  *************************************************************************/
 
-template<class TParams, class TLogger>
-void TAffineSampler<TParams, TLogger>::print_state() {
+template<class TParams, class TLogger, class TPdf, unsigned int NDim>
+void TAffineSampler<TParams, TLogger, TPdf, NDim>::print_state() {
 	for(unsigned int i=0; i<L; i++) {
 		std::cout << "p(X) = " << X[i].pi << std::endl;
 		std::cout << "Weight = " << X[i].weight << std::endl << "X [" << i << "] = { ";
@@ -1322,8 +1477,8 @@ void TAffineSampler<TParams, TLogger>::print_state() {
 	}
 }
 
-template<class TParams, class TLogger>
-void TAffineSampler<TParams, TLogger>::print_stats() {
+template<class TParams, class TLogger, class TPdf, unsigned int NDim>
+void TAffineSampler<TParams, TLogger, TPdf, NDim>::print_stats() {
 	TStats &stats = get_stats();
 	stats.print();
 	
@@ -1391,30 +1546,31 @@ void TAffineSampler<TParams, TLogger>::print_stats() {
  *   Parallel Affine Sampler Class Member Functions
  *************************************************************************/
 
-template<class TParams, class TLogger>
-TParallelAffineSampler<TParams, TLogger>::TParallelAffineSampler(typename TAffineSampler<TParams, TLogger>::pdf_t _pdf, typename TAffineSampler<TParams, TLogger>::rand_state_t _rand_state,
+template<class TParams, class TLogger, class TPdf, unsigned int NDim>
+TParallelAffineSampler<TParams, TLogger, TPdf, NDim>::TParallelAffineSampler(TPdf _pdf, typename TAffineSampler<TParams, TLogger, TPdf, NDim>::rand_state_t _rand_state,
                                                                  unsigned int _N, unsigned int _L, TParams& _params, TLogger& _logger, unsigned int _N_samplers, bool _use_log)
-	: logger(_logger), params(_params), N(_N), sampler(NULL), component_stats(NULL), R(NULL), stats(_N)
+	: logger(_logger), params(_params), N(_N), sampler(NULL), component_stats(NULL), R(NULL), stats(_N),
+	  parallel_walkers(false)
 {
 	assert(_N_samplers > 1);
 	N_samplers = _N_samplers;
 	
-	sampler = new TAffineSampler<TParams, TLogger>*[N_samplers];
+	sampler = new TAffineSampler<TParams, TLogger, TPdf, NDim>*[N_samplers];
 	component_stats = new TStats*[N_samplers];
 	
 	for(unsigned int i=0; i<N_samplers; i++) { sampler[i] = NULL; component_stats[i] = NULL; }
 	
 	#pragma omp parallel for
 	for(unsigned int i=0; i<N_samplers; i++) {
-		sampler[i] = new TAffineSampler<TParams, TLogger>(_pdf, _rand_state, N, _L, _params, _logger, _use_log);
+		sampler[i] = new TAffineSampler<TParams, TLogger, TPdf, NDim>(_pdf, _rand_state, N, _L, _params, _logger, _use_log);
 		component_stats[i] = &(sampler[i]->get_stats());
 	}
 	
 	R = new double[N];
 }
 
-template<class TParams, class TLogger>
-TParallelAffineSampler<TParams, TLogger>::~TParallelAffineSampler() {
+template<class TParams, class TLogger, class TPdf, unsigned int NDim>
+TParallelAffineSampler<TParams, TLogger, TPdf, NDim>::~TParallelAffineSampler() {
 	if(sampler != NULL) {
 		for(unsigned int i=0; i<N_samplers; i++) { if(sampler[i] != NULL) { delete sampler[i]; } }
 		delete[] sampler;
@@ -1423,23 +1579,52 @@ TParallelAffineSampler<TParams, TLogger>::~TParallelAffineSampler() {
 	if(R != NULL) { delete[] R; }
 }
 
-template<class TParams, class TLogger>
-void TParallelAffineSampler<TParams, TLogger>::step(unsigned int N_steps, bool record_steps, double cycle,
+template<class TParams, class TLogger, class TPdf, unsigned int NDim>
+void TParallelAffineSampler<TParams, TLogger, TPdf, NDim>::step(unsigned int N_steps, bool record_steps, double cycle,
                                                     double p_replacement, bool unbalanced, bool diag_approx) {
-	#pragma omp parallel for schedule(dynamic) firstprivate(record_steps, N_steps, cycle, p_replacement, unbalanced, diag_approx)
-	for(int sampler_num = 0; sampler_num < N_samplers; sampler_num++) {
+	if(!parallel_walkers) {
+		#pragma omp parallel for schedule(dynamic) firstprivate(record_steps, N_steps, cycle, p_replacement, unbalanced, diag_approx)
+		for(int sampler_num = 0; sampler_num < N_samplers; sampler_num++) {
+			for(unsigned int i=0; i<N_steps; i++) {
+				sampler[sampler_num]->step(record_steps, p_replacement, unbalanced, diag_approx);
+			}
+			sampler[sampler_num]->flush(record_steps);
+		}
+	} else {
+		// Replacement steps cannot be split over the walkers, so they still
+		// run in parallel over the samplers. Stretch steps are threaded over
+		// the walkers of one sampler at a time. Each sampler draws its step
+		// types in the same order as above.
+		std::vector<char> replace(N_samplers);
 		for(unsigned int i=0; i<N_steps; i++) {
-			sampler[sampler_num]->step(record_steps, p_replacement, unbalanced, diag_approx);
+			bool any_replace = false;
+			for(unsigned int s=0; s<N_samplers; s++) {
+				replace[s] = sampler[s]->draw_replacement(p_replacement);
+				if(replace[s]) { any_replace = true; }
+			}
+			
+			if(any_replace) {
+				#pragma omp parallel for schedule(dynamic)
+				for(int sampler_num = 0; sampler_num < N_samplers; sampler_num++) {
+					if(replace[sampler_num]) {
+						sampler[sampler_num]->step_replacement(record_steps, unbalanced, diag_approx);
+					}
+				}
+			}
+			
+			for(unsigned int s=0; s<N_samplers; s++) {
+				if(!replace[s]) { sampler[s]->step_affine(record_steps); }
+			}
 		}
-		sampler[sampler_num]->flush(record_steps);
+		for(unsigned int s=0; s<N_samplers; s++) { sampler[s]->flush(record_steps); }
 	}
 	#pragma omp barrier
 	Gelman_Rubin_diagnostic(component_stats, N_samplers, R, N);
 }
 
-template<class TParams, class TLogger>
-void TParallelAffineSampler<TParams, TLogger>::step_MH(unsigned int N_steps, bool record_steps) {
-	#pragma omp parallel for schedule(dynamic) firstprivate(record_steps, N_steps)
+template<class TParams, class TLogger, class TPdf, unsigned int NDim>
+void TParallelAffineSampler<TParams, TLogger, TPdf, NDim>::step_MH(unsigned int N_steps, bool record_steps) {
+	#pragma omp parallel for schedule(dynamic) firstprivate(record_steps, N_steps) if(!parallel_walkers)
 	for(int sampler_num = 0; sampler_num < N_samplers; sampler_num++) {
 		for(unsigned int i=0; i<N_steps; i++) {
 			sampler[sampler_num]->step_MH(record_steps);
@@ -1450,9 +1635,9 @@ void TParallelAffineSampler<TParams, TLogger>::step_MH(unsigned int N_steps, boo
 	Gelman_Rubin_diagnostic(component_stats, N_samplers, R, N);
 }
 
-template<class TParams, class TLogger>
-void TParallelAffineSampler<TParams, TLogger>::step_custom_reversible(unsigned int N_steps,
-	                                                              typename TAffineSampler<TParams, TLogger>::reversible_step_t f_reversible_step,
+template<class TParams, class TLogger, class TPdf, unsigned int NDim>
+void TParallelAffineSampler<TParams, TLogger, TPdf, NDim>::step_custom_reversible(unsigned int N_steps,
+	                                                              typename TAffineSampler<TParams, TLogger, TPdf, NDim>::reversible_step_t f_reversible_step,
 	                                                              bool record_steps) {
 	#pragma omp parallel for schedule(dynamic) firstprivate(record_steps, N_steps)
 	for(int sampler_num = 0; sampler_num < N_samplers; sampler_num++) {
@@ -1465,9 +1650,9 @@ void TParallelAffineSampler<TParams, TLogger>::step_custom_reversible(unsigned i
 	Gelman_Rubin_diagnostic(component_stats, N_samplers, R, N);
 }
 
-template<class TParams, class TLogger>
-void TParallelAffineSampler<TParams, TLogger>::tune_MH(unsigned int N_rounds, double target_acceptance) {
-	#pragma omp parallel for
+template<class TParams, class TLogger, class TPdf, unsigned int NDim>
+void TParallelAffineSampler<TParams, TLogger, TPdf, NDim>::tune_MH(unsigned int N_rounds, double target_acceptance) {
+	#pragma omp parallel for if(!parallel_walkers)
 	for(int sampler_num = 0; sampler_num < N_samplers; sampler_num++) {
 		unsigned int N_steps = 100. / ((double)(sampler[sampler_num]->get_N_walkers()) * target_acceptance);
 		if(N_steps < 3) { N_steps = 3; }
@@ -1502,9 +1687,9 @@ void TParallelAffineSampler<TParams, TLogger>::tune_MH(unsigned int N_rounds, do
 	}
 }
 
-template<class TParams, class TLogger>
-void TParallelAffineSampler<TParams, TLogger>::tune_stretch(unsigned int N_rounds, double target_acceptance) {
-	#pragma omp parallel for
+template<class TParams, class TLogger, class TPdf, unsigned int NDim>
+void TParallelAffineSampler<TParams, TLogger, TPdf, NDim>::tune_stretch(unsigned int N_rounds, double target_acceptance) {
+	#pragma omp parallel for if(!parallel_walkers)
 	for(int sampler_num = 0; sampler_num < N_samplers; sampler_num++) {
 		unsigned int N_steps = 100. / ((double)(sampler[sampler_num]->get_N_walkers()) * target_acceptance);
 		if(N_steps < 3) { N_steps = 3; }
@@ -1540,8 +1725,8 @@ void TParallelAffineSampler<TParams, TLogger>::tune_stretch(unsigned int N_round
 }
 
 
-template<class TParams, class TLogger>
-void TParallelAffineSampler<TParams, TLogger>::calc_stats() {
+template<class TParams, class TLogger, class TPdf, unsigned int NDim>
+void TParallelAffineSampler<TParams, TLogger, TPdf, NDim>::calc_stats() {
 	stats.clear();
 	for(int i=0; i<N_samplers; i++) {
 		stats += sampler[i]->get_stats();
@@ -1549,8 +1734,8 @@ void TParallelAffineSampler<TParams, TLogger>::calc_stats() {
 }
 
 
-template<class TParams, class TLogger>
-void TParallelAffineSampler<TParams, TLogger>::print_stats() {
+template<class TParams, class TLogger, class TPdf, unsigned int NDim>
+void TParallelAffineSampler<TParams, TLogger, TPdf, NDim>::print_stats() {
 	calc_stats();
 	stats.print();
 	
@@ -1642,8 +1827,8 @@ void TParallelAffineSampler<TParams, TLogger>::print_stats() {
 	std::cout << std::setprecision(6);
 }
 
-template<class TParams, class TLogger>
-void TParallelAffineSampler<TParams, TLogger>::print_diagnostics() {
+template<class TParams, class TLogger, class TPdf, unsigned int NDim>
+void TParallelAffineSampler<TParams, TLogger, TPdf, NDim>::print_diagnostics() {
 	std::cout << "Gelman-Rubin diagnostic:" << std::endl;
 	for(unsigned int i=0; i<N; i++) { std::cout << (i==0 ? "" : "\t") << std::setprecision(5) << R[i]; }
 	std::cout << std::endl;
@@ -1732,8 +1917,8 @@ void TParallelAffineSampler<TParams, TLogger>::print_diagnostics() {
 	std::cout << std::setprecision(6);
 }
 
-template<class TParams, class TLogger>
-TChain TParallelAffineSampler<TParams, TLogger>::get_chain() {
+template<class TParams, class TLogger, class TPdf, unsigned int NDim>
+TChain TParallelAffineSampler<TParams, TLogger, TPdf, NDim>::get_chain() {
 	unsigned int capacity = 0;
 	for(unsigned int i=0; i<N_samplers; i++) {
 		capacity += sampler[i]->get_chain().get_length();
@@ -1745,8 +1930,8 @@ TChain TParallelAffineSampler<TParams, TLogger>::get_chain() {
 	return tmp;
 }
 
-template<class TParams, class TLogger>
-void TParallelAffineSampler<TParams, TLogger>::calc_GR_transformed(std::vector<double>& GR, TTransformParamSpace* transf) {
+template<class TParams, class TLogger, class TPdf, unsigned int NDim>
+void TParallelAffineSampler<TParams, TLogger, TPdf, NDim>::calc_GR_transformed(std::vector<double>& GR, TTransformParamSpace* transf) {
 	TStats **transf_stats = new TStats*[N_samplers];
 	for(size_t n=0; n<N_samplers; n++) {
 		transf_stats[n] = new TStats(N);
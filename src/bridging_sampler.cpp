@@ -9,6 +9,7 @@ bridgesamp::BridgingSampler::BridgingSampler(
         uint16_t n_samples,
         std::function<double(const std::vector<uint16_t>&)> logp_node)
     : n_dim(n_dim), n_samples(n_samples),
+      node(n_dim), state(NodeStore::npos),
       eval_node(logp_node),
       r_dim(0,n_dim-1), r_samp(0,n_samples-1),
       r_uniform(0., 1.)
@@ -24,6 +25,10 @@ bridgesamp::BridgingSampler::BridgingSampler(
     _gibbs_state_dim_ws.resize(n_dim);
     _transition_state_dim_ws.resize(n_dim);
     _percolate_dim_ws.resize(n_dim);
+    _percolate_key_dim_ws.resize(n_dim);
+    _percolate_start_dim_ws.resize(n_dim);
+    _percolate_idx_dim_ws.reserve(n_dim);
+    state_key.resize(n_dim);
 
     // Transition probabilities
     b_prob.reserve(n_dim);
@@ -113,12 +118,12 @@ uint16_t bridgesamp::BridgingSampler::get_n_samples() const {
 
 
 const std::vector<uint16_t>& bridgesamp::BridgingSampler::get_state() const {
-    return state->first;
+    return state_key;
 }
 
 
 double bridgesamp::BridgingSampler::get_logp() const {
-    return state->second.logp;
+    return node.node(state).logp;
 }
 
 
@@ -138,10 +143,10 @@ void bridgesamp::BridgingSampler::randomize_state() {
     }
     
     // Find node
-    auto it = node.find(_rand_state_dim_ws);
+    NodeStore::index_t it = node.find(_rand_state_dim_ws);
 
     // Create node if it doesn't exist
-    if(it == node.end()) {
+    if(it == NodeStore::npos) {
         #if LOGVERBOSE
         std::cout << "Creating node";
         for(auto s : _rand_state_dim_ws) {
@@ -152,17 +157,15 @@ void bridgesamp::BridgingSampler::randomize_state() {
 
         double logp = eval_node(_rand_state_dim_ws);
         it = node.insert(
-            std::make_pair(
-                _rand_state_dim_ws,
-                bridgesamp::Node{std::exp(logp), logp}
-            )
-        ).first;
+            _rand_state_dim_ws,
+            bridgesamp::Node{std::exp(logp), logp}
+        );
 
         percolate_up(it);
     }
 
     // Update the state to point to this node
-    state = it;
+    set_state(it);
     state_rank = 0; // At 0th level in hierarchy
     
     #if LOGVERBOSE
@@ -194,10 +197,10 @@ void bridgesamp::BridgingSampler::_lazy_gibbs_inner(
     for(uint16_t s=0; s<n_samples; s++) {
         starting_state[dim] = s;
 
-        auto it = node.find(starting_state);
-        if(it != node.end()) {
+        NodeStore::index_t it = node.find(starting_state);
+        if(it != NodeStore::npos) {
             _gibbs_idx_samp_ws.push_back(s);
-            _gibbs_lnp_samp_ws.push_back(it->second.logp);
+            _gibbs_lnp_samp_ws.push_back(node.node(it).logp);
         }
     }
 
@@ -249,7 +252,7 @@ void bridgesamp::BridgingSampler::_lazy_gibbs_inner(
         );
 
         starting_state[dim] = _gibbs_idx_samp_ws[d(r)];
-        state = node.find(starting_state);
+        set_state(node.find(starting_state));
         
         #if LOGVERBOSE
         std::cout << "Picked explored state:";
@@ -295,7 +298,7 @@ void bridgesamp::BridgingSampler::_lazy_gibbs_inner(
 
         // Add the new state
         starting_state[dim] = idx-1;
-        state = get_node(starting_state);
+        set_state(get_node(starting_state));
         
         #if LOGVERBOSE
         std::cout << "Picked unexplored state:";
@@ -327,12 +330,7 @@ void bridgesamp::BridgingSampler::gibbs(uint16_t dim) {
     }
     
     // Copy current state into workspace
-    _gibbs_state_dim_ws.clear();
-    std::copy(
-        state->first.begin(),
-        state->first.end(),
-        std::back_inserter(_gibbs_state_dim_ws)
-    );
+    _gibbs_state_dim_ws.assign(state_key.begin(), state_key.end());
 
     #if LOGVERBOSE
     std::cout << "Starting state:";
@@ -344,8 +342,9 @@ void bridgesamp::BridgingSampler::gibbs(uint16_t dim) {
 
     // Find out which nodes have been explored, and which not
     _gibbs_idx_samp_ws.clear(); // Will hold samples corresponding to unexplored nodes
+    _gibbs_lnp_samp_ws.clear();
 
-    NodeMap::iterator it;
+    NodeStore::index_t it;
 
     if(eval_conditional) {
         #if LOGVERBOSE
@@ -358,11 +357,11 @@ void bridgesamp::BridgingSampler::gibbs(uint16_t dim) {
             // Try to find node
             it = node.find(_gibbs_state_dim_ws);
 
-            if(it == node.end()) { // Node not found
+            if(it == NodeStore::npos) { // Node not found
                 _gibbs_idx_samp_ws.push_back(k);
                 _gibbs_lnp_samp_ws.push_back(0.); // dummy value, update later
             } else {
-                _gibbs_lnp_samp_ws.push_back(it->second.logp);
+                _gibbs_lnp_samp_ws.push_back(node.node(it).logp);
             }
         }
 
@@ -384,11 +383,9 @@ void bridgesamp::BridgingSampler::gibbs(uint16_t dim) {
             logp = _gibbs_lnp_samp_ws[s];
 
             it = node.insert(
-                std::make_pair(
-                    _gibbs_state_dim_ws,
-                    bridgesamp::Node{std::exp(logp), logp}
-                )
-            ).first;
+                _gibbs_state_dim_ws,
+                bridgesamp::Node{std::exp(logp), logp}
+            );
 
             // Propagate change in log(p) upward
             percolate_up(it);
@@ -405,12 +402,12 @@ void bridgesamp::BridgingSampler::gibbs(uint16_t dim) {
 
             // Get or create node
             it = get_node(_gibbs_state_dim_ws);
-            _gibbs_lnp_samp_ws.push_back(it->second.logp);
+            _gibbs_lnp_samp_ws.push_back(node.node(it).logp);
         }
     }
 
     // Get maximum log(p), and transform log(p) to p/p_max.
-    double logp_max = *std::max(_gibbs_lnp_samp_ws.begin(), _gibbs_lnp_samp_ws.end());
+    double logp_max = *std::max_element(_gibbs_lnp_samp_ws.begin(), _gibbs_lnp_samp_ws.end());
     for(auto& p : _gibbs_lnp_samp_ws) {
         p = std::exp(p - logp_max);
     }
@@ -428,7 +425,7 @@ void bridgesamp::BridgingSampler::gibbs(uint16_t dim) {
     std::cout << "Chose sample #" << _gibbs_state_dim_ws[dim] << std::endl;
     #endif
 
-    state = get_node(_gibbs_state_dim_ws);
+    set_state(get_node(_gibbs_state_dim_ws));
 
     // TODO: Bulk percolate-up function?
 
@@ -443,7 +440,7 @@ void bridgesamp::BridgingSampler::lazy_gibbs(uint16_t dim) {
     std::cout << "Entering lazy_gibbs()" << std::endl;
     #endif
 
-    if(state->first[dim] == n_samples) {
+    if(state_key[dim] == n_samples) {
         #if LOGVERBOSE
         std::cout << "Cannot take Gibbs step in empty dimension." << std::endl;
         std::cout << "Exiting lazy_gibbs()" << std::endl;
@@ -452,12 +449,7 @@ void bridgesamp::BridgingSampler::lazy_gibbs(uint16_t dim) {
     }
 
     // Copy current state into workspace
-    _gibbs_state_dim_ws.clear();
-    std::copy(
-        state->first.begin(),
-        state->first.end(),
-        std::back_inserter(_gibbs_state_dim_ws)
-    );
+    _gibbs_state_dim_ws.assign(state_key.begin(), state_key.end());
 
     _lazy_gibbs_inner(_gibbs_state_dim_ws, dim);
 
@@ -491,9 +483,12 @@ void bridgesamp::BridgingSampler::lazy_gibbs_choose_dim() {
 
     int32_t i_nonempty = -1;
     uint16_t dim = 0;
-    for(auto it=state->first.begin(); i_nonempty != i_pick; ++it, dim++) {
-        if(*it != n_samples) {
+    for(; dim<n_dim; dim++) {
+        if(state_key[dim] != n_samples) {
             i_nonempty++;
+            if(i_nonempty == i_pick) {
+                break;
+            }
         }
     }
 
@@ -513,13 +508,15 @@ void bridgesamp::BridgingSampler::lazy_gibbs_choose_dim() {
 }
 
 
-bridgesamp::NodeMap::const_iterator bridgesamp::BridgingSampler::cbegin() const {
-    return node.cbegin();
+const bridgesamp::NodeStore& bridgesamp::BridgingSampler::get_nodes() const {
+    return node;
 }
 
 
-bridgesamp::NodeMap::const_iterator bridgesamp::BridgingSampler::cend() const {
-    return node.cend();
+void bridgesamp::BridgingSampler::set_state(NodeStore::index_t idx) {
+    state = idx;
+    const uint16_t* key = node.key(idx);
+    std::copy(key, key+n_dim, state_key.begin());
 }
 
 
@@ -541,7 +538,7 @@ double bridgesamp::BridgingSampler::get_lnp0_of_rank(uint16_t rank) {
 }
 
 
-bridgesamp::NodeMap::iterator bridgesamp::BridgingSampler::get_node(
+bridgesamp::NodeStore::index_t bridgesamp::BridgingSampler::get_node(
         const std::vector<uint16_t>& samp)
 {
     #if LOGVERBOSE
@@ -549,7 +546,7 @@ bridgesamp::NodeMap::iterator bridgesamp::BridgingSampler::get_node(
     #endif
 
     // Find node
-    auto it = node.find(samp);
+    NodeStore::index_t it = node.find(samp);
 
     // Get rank of node
     uint16_t n_empty = get_n_empty(samp);
@@ -558,7 +555,7 @@ bridgesamp::NodeMap::iterator bridgesamp::BridgingSampler::get_node(
     #endif
 
     // Create node if it doesn't exist
-    if(it == node.end()) {
+    if(it == NodeStore::npos) {
         #if LOGVERBOSE
         std::cout << "Creating node";
         for(auto s : samp) {
@@ -577,9 +574,7 @@ bridgesamp::NodeMap::iterator bridgesamp::BridgingSampler::get_node(
             #endif
             
             // Insert the node, and get iterator to it
-            it = node.insert(
-                std::make_pair(samp, bridgesamp::Node{std::exp(logp), logp})
-            ).first;
+            it = node.insert(samp, bridgesamp::Node{std::exp(logp), logp});
 
             // Propagate change in log(p) upward
             percolate_up(it);
@@ -594,9 +589,7 @@ bridgesamp::NodeMap::iterator bridgesamp::BridgingSampler::get_node(
             #endif
             
             // Insert the node, and get iterator to it
-            it = node.insert(
-                std::make_pair(samp, bridgesamp::Node{std::exp(logp), logp})
-            ).first;
+            it = node.insert(samp, bridgesamp::Node{std::exp(logp), logp});
         }
     }
 
@@ -638,7 +631,7 @@ void bridgesamp::BridgingSampler::transition_backward() {
     
     #if LOGVERBOSE
     std::cout << "Starting state:";
-    for(auto s : state->first) {
+    for(auto s : state_key) {
         std::cout << " " << s;
     }
     std::cout << std::endl;
@@ -653,7 +646,7 @@ void bridgesamp::BridgingSampler::transition_backward() {
     }
     
     // Find non-empty dimensions
-    get_nonempty_dims(state, _transition_state_dim_ws);
+    get_nonempty_dims(state_key.data(), _transition_state_dim_ws);
     uint16_t n_nonempty = _transition_state_dim_ws.size();
     #if LOGVERBOSE
     std::cout << n_nonempty << " non-empty dimensions" << std::endl;
@@ -668,21 +661,16 @@ void bridgesamp::BridgingSampler::transition_backward() {
     #endif
 
     // Copy current state into workspace
-    _transition_state_dim_ws.clear();
-    std::copy(
-        state->first.begin(),
-        state->first.end(),
-        std::back_inserter(_transition_state_dim_ws)
-    );
+    _transition_state_dim_ws.assign(state_key.begin(), state_key.end());
     
     // Blank the chosen dimension and transition
     _transition_state_dim_ws[idx] = n_samples;
-    state = get_node(_transition_state_dim_ws);
+    set_state(get_node(_transition_state_dim_ws));
     state_rank++;
     
     #if LOGVERBOSE
     std::cout << "New state:";
-    for(auto s : state->first) {
+    for(auto s : state_key) {
         std::cout << " " << s;
     }
     std::cout << std::endl;
@@ -701,7 +689,7 @@ void bridgesamp::BridgingSampler::transition_forward() {
     
     #if LOGVERBOSE
     std::cout << "Starting state:";
-    for(auto s : state->first) {
+    for(auto s : state_key) {
         std::cout << " " << s;
     }
     std::cout << std::endl;
@@ -716,7 +704,7 @@ void bridgesamp::BridgingSampler::transition_forward() {
     }
     
     // Find empty dimensions
-    get_empty_dims(state, _transition_state_dim_ws);
+    get_empty_dims(state_key.data(), _transition_state_dim_ws);
     uint16_t n_empty = _transition_state_dim_ws.size();
     #if LOGVERBOSE
     std::cout << n_empty << " empty dimensions" << std::endl;
@@ -731,12 +719,7 @@ void bridgesamp::BridgingSampler::transition_forward() {
     #endif
 
     // Copy current state into workspace
-    _transition_state_dim_ws.clear();
-    std::copy(
-        state->first.begin(),
-        state->first.end(),
-        std::back_inserter(_transition_state_dim_ws)
-    );
+    _transition_state_dim_ws.assign(state_key.begin(), state_key.end());
     
     // Fill the chosen dimension with zero
     _transition_state_dim_ws[idx] = 0;
@@ -747,7 +730,7 @@ void bridgesamp::BridgingSampler::transition_forward() {
     
     #if LOGVERBOSE
     std::cout << "New state:";
-    for(auto s : state->first) {
+    for(auto s : state_key) {
         std::cout << " " << s;
     }
     std::cout << std::endl;
@@ -759,21 +742,25 @@ void bridgesamp::BridgingSampler::transition_forward() {
 }
 
 
-void bridgesamp::BridgingSampler::percolate_up(const NodeMap::iterator& n) {
+void bridgesamp::BridgingSampler::percolate_up(NodeStore::index_t n) {
     #if LOGVERBOSE
     std::cout << "Entering percolate_up()" << std::endl;
     #endif
     
+    // Copy starting key, as adding parent nodes may move the key arena
+    const uint16_t* n_key = node.key(n);
+    std::copy(n_key, n_key+n_dim, _percolate_start_dim_ws.begin());
+
     #if LOGVERBOSE
     std::cout << "Starting from state:";
-    for(auto s : n->first) {
+    for(auto s : _percolate_start_dim_ws) {
         std::cout << " " << s;
     }
     std::cout << std::endl;
     #endif
 
     // Find non-empty dimensions
-    get_nonempty_dims(n, _percolate_dim_ws);
+    get_nonempty_dims(_percolate_start_dim_ws.data(), _percolate_dim_ws);
     #if LOGVERBOSE
     std::cout << _percolate_dim_ws.size()
               << " non-empty dimensions" << std::endl;
@@ -782,11 +769,12 @@ void bridgesamp::BridgingSampler::percolate_up(const NodeMap::iterator& n) {
     // Determine change in probability to propagate
     double dlogp; // log(|dp|)
     bool positive; // True if change is positive
-    if(n->second.logp >= logp0) {
-        dlogp = subtract_logs(n->second.logp, logp0);
+    double logp_n = node.node(n).logp;
+    if(logp_n >= logp0) {
+        dlogp = subtract_logs(logp_n, logp0);
         positive = true;
     } else {
-        dlogp = subtract_logs(logp0, n->second.logp);
+        dlogp = subtract_logs(logp0, logp_n);
         positive = false;
     }
 
@@ -800,10 +788,8 @@ void bridgesamp::BridgingSampler::percolate_up(const NodeMap::iterator& n) {
     #endif
 
     // Loop through higher ranks in hierarchy
-    std::vector<unsigned int> idx;
-    std::vector<uint16_t> node_key;
-    idx.reserve(n_dim);
-    node_key.reserve(n_dim);
+    std::vector<unsigned int>& idx = _percolate_idx_dim_ws;
+    std::vector<uint16_t>& node_key = _percolate_key_dim_ws;
 
     for(int rank=1; rank<=_percolate_dim_ws.size(); rank++) {
         // Blank out every combination of <rank> entries, obtaining
@@ -819,11 +805,10 @@ void bridgesamp::BridgingSampler::percolate_up(const NodeMap::iterator& n) {
             #endif
 
             // Copy original key into node_key
-            node_key.clear();
             std::copy(
-                n->first.begin(),
-                n->first.end(),
-                std::back_inserter(node_key)
+                _percolate_start_dim_ws.begin(),
+                _percolate_start_dim_ws.end(),
+                node_key.begin()
             );
             // Blank selected dimensions
             for(auto i : idx) {
@@ -837,13 +822,14 @@ void bridgesamp::BridgingSampler::percolate_up(const NodeMap::iterator& n) {
             std::cout << std::endl;
             #endif
 
-            auto it = get_node(node_key); // Iterator to parent node
+            // Parent node
+            Node& parent = node.node(get_node(node_key));
 
             // Update probability of parent node
             if(positive) {
-                it->second.logp = add_logs(it->second.logp, dlogp);
+                parent.logp = add_logs(parent.logp, dlogp);
             } else {
-                it->second.logp = subtract_logs(it->second.logp, dlogp);
+                parent.logp = subtract_logs(parent.logp, dlogp);
             }
         }
     }
@@ -860,14 +846,14 @@ double bridgesamp::BridgingSampler::n_children(uint16_t order) {
 
 
 void bridgesamp::BridgingSampler::get_nonempty_dims(
-        const NodeMap::iterator& n,
+        const uint16_t* key,
         std::vector<uint16_t>& dims_out)
 {
     dims_out.clear();
     dims_out.reserve(n_dim);
 
     for(int i=0; i<n_dim; i++) {
-        if(n->first[i] != n_samples) {
+        if(key[i] != n_samples) {
             dims_out.push_back(i);
         }
     }
@@ -875,14 +861,14 @@ void bridgesamp::BridgingSampler::get_nonempty_dims(
 
 
 void bridgesamp::BridgingSampler::get_empty_dims(
-        const NodeMap::iterator& n,
+        const uint16_t* key,
         std::vector<uint16_t>& dims_out)
 {
     dims_out.clear();
     dims_out.reserve(n_dim);
 
     for(int i=0; i<n_dim; i++) {
-        if(n->first[i] == n_samples) {
+        if(key[i] == n_samples) {
             dims_out.push_back(i);
         }
     }
@@ -898,6 +884,143 @@ double bridgesamp::BridgingSampler::fill_factor() const {
 
 
 
+
+/*
+ *  Node store - packed state keys -> (p, log(p))
+ */
+
+const bridgesamp::NodeStore::index_t bridgesamp::NodeStore::npos;
+
+
+bridgesamp::NodeStore::NodeStore(uint16_t n_dim)
+    : n_dim(n_dim)
+{
+    rehash(64);
+}
+
+
+uint64_t bridgesamp::NodeStore::hash(const uint16_t* key) const {
+    // FNV-1a over the key, followed by a 64-bit finalizer (from
+    // MurmurHash3), so that the low bits can index the buckets.
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for(int i=0; i<n_dim; i++) {
+        h ^= key[i];
+        h *= 0x100000001b3ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+
+void bridgesamp::NodeStore::rehash(size_t n_buckets) {
+    buckets.assign(n_buckets, Bucket{npos, 0});
+    bucket_mask = n_buckets - 1;
+
+    for(index_t i=0; i<nodes.size(); i++) {
+        uint64_t h = hash(key(i));
+        uint64_t b = h & bucket_mask;
+        while(buckets[b].idx != npos) {
+            b = (b + 1) & bucket_mask;
+        }
+        buckets[b] = Bucket{i, (uint32_t)h};
+    }
+}
+
+
+void bridgesamp::NodeStore::reserve(size_t n_nodes) {
+    keys.reserve(n_nodes * n_dim);
+    nodes.reserve(n_nodes);
+
+    size_t n_buckets = buckets.size();
+    while(n_buckets < 2 * n_nodes) {
+        n_buckets <<= 1;
+    }
+    if(n_buckets != buckets.size()) {
+        rehash(n_buckets);
+    }
+}
+
+
+bridgesamp::NodeStore::index_t bridgesamp::NodeStore::find(
+        const uint16_t* k) const
+{
+    uint64_t h = hash(k);
+    uint32_t tag = (uint32_t)h;
+    for(uint64_t b = h & bucket_mask; ; b = (b + 1) & bucket_mask) {
+        const Bucket& bucket = buckets[b];
+        if(bucket.idx == npos) {
+            return npos;
+        }
+        if((bucket.tag == tag) && std::equal(k, k+n_dim, key(bucket.idx))) {
+            return bucket.idx;
+        }
+    }
+}
+
+
+bridgesamp::NodeStore::index_t bridgesamp::NodeStore::find(
+        const std::vector<uint16_t>& k) const
+{
+    assert(k.size() == n_dim);
+    return find(k.data());
+}
+
+
+bridgesamp::NodeStore::index_t bridgesamp::NodeStore::insert(
+        const std::vector<uint16_t>& k,
+        const Node& n)
+{
+    assert(k.size() == n_dim);
+
+    // Keep load factor <= 1/2
+    if(2 * (nodes.size() + 1) > buckets.size()) {
+        rehash(2 * buckets.size());
+    }
+
+    uint64_t h = hash(k.data());
+    uint32_t tag = (uint32_t)h;
+    uint64_t b = h & bucket_mask;
+    for(; buckets[b].idx != npos; b = (b + 1) & bucket_mask) {
+        if((buckets[b].tag == tag)
+           && std::equal(k.begin(), k.end(), key(buckets[b].idx))) {
+            return buckets[b].idx; // Already present
+        }
+    }
+
+    index_t idx = nodes.size();
+    keys.insert(keys.end(), k.begin(), k.end());
+    nodes.push_back(n);
+    buckets[b] = Bucket{idx, tag};
+
+    return idx;
+}
+
+
+const uint16_t* bridgesamp::NodeStore::key(index_t idx) const {
+    return keys.data() + (size_t)idx * n_dim;
+}
+
+
+bridgesamp::Node& bridgesamp::NodeStore::node(index_t idx) {
+    return nodes[idx];
+}
+
+
+const bridgesamp::Node& bridgesamp::NodeStore::node(index_t idx) const {
+    return nodes[idx];
+}
+
+
+size_t bridgesamp::NodeStore::size() const {
+    return nodes.size();
+}
+
+
+
 /*
  *  Combination generator - cycles through combinations (n choose r)
  */
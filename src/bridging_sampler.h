@@ -35,8 +35,50 @@ struct Node {
 };
 
 
-// An unordered_map that maps state vectors -> (p, log(p))
-typedef std::unordered_map<std::vector<uint16_t>, Node, VectorHasher> NodeMap;
+class NodeStore {
+    // Maps state vectors -> (p, log(p)). Keys have a fixed width (n_dim),
+    // and are packed into one contiguous arena, next to an array of
+    // nodes. Nodes are found through an open-addressing (linear-probing)
+    // index, so lookups do not allocate. Nodes are referred to by their
+    // index in the store, which does not change as nodes are added.
+public:
+    typedef uint32_t index_t;
+    static const index_t npos = 0xFFFFFFFF;
+
+    explicit NodeStore(uint16_t n_dim);
+
+    // Returns the index of the node with the given key, or npos
+    index_t find(const uint16_t* key) const;
+    index_t find(const std::vector<uint16_t>& key) const;
+
+    // Adds a node, if the key is not already present. Returns the index
+    // of the node with the given key.
+    index_t insert(const std::vector<uint16_t>& key, const Node& n);
+
+    // Key and node at given index. Pointers and references are
+    // invalidated when nodes are added.
+    const uint16_t* key(index_t idx) const;
+    Node& node(index_t idx);
+    const Node& node(index_t idx) const;
+
+    size_t size() const;
+    void reserve(size_t n_nodes);
+
+private:
+    struct Bucket {
+        index_t idx;  // npos if empty
+        uint32_t tag; // Low 32 bits of the key's hash
+    };
+
+    uint16_t n_dim;
+    std::vector<uint16_t> keys; // size() x n_dim
+    std::vector<Node> nodes;
+    std::vector<Bucket> buckets; // At least two per node
+    uint64_t bucket_mask;
+
+    uint64_t hash(const uint16_t* key) const;
+    void rehash(size_t n_buckets);
+};
 
 
 class BridgingSampler {
@@ -44,8 +86,9 @@ private:
     uint16_t n_dim;     // # of integers to define a state
     uint16_t n_samples; // # of samples per dimension
     
-    NodeMap node; // All visited nodes
-    NodeMap::iterator state; // Points to current node
+    NodeStore node; // All visited nodes
+    NodeStore::index_t state; // Index of current node
+    std::vector<uint16_t> state_key; // Key of current node
     uint16_t state_rank; // Rank of current state
     
     // Function that returns log(p) of node
@@ -82,14 +125,20 @@ private:
     std::vector<uint16_t> _gibbs_state_dim_ws;
     std::vector<uint16_t> _transition_state_dim_ws;
     std::vector<uint16_t> _percolate_dim_ws;
+    std::vector<uint16_t> _percolate_key_dim_ws;
+    std::vector<uint16_t> _percolate_start_dim_ws;
+    std::vector<unsigned int> _percolate_idx_dim_ws;
 
     // Navigation
     //std::map<std::vector<uint16_t>, Node>::iterator up(
     //        std::map<std::vector<uint16_t>, Node>::iterator s,
     //        int
     
-    // Returns an iterator to the node specified by the given sample numbers
-    NodeMap::iterator get_node(const std::vector<uint16_t>& samp);
+    // Returns the index of the node specified by the given sample numbers
+    NodeStore::index_t get_node(const std::vector<uint16_t>& samp);
+
+    // Move to the given node
+    void set_state(NodeStore::index_t idx);
 
     // # of children of node of given order
     double n_children(uint16_t order);
@@ -98,17 +147,17 @@ private:
     uint16_t get_n_empty(const std::vector<uint16_t>& samp);
 
     // Sampling routines
-    void percolate_up(const NodeMap::iterator& n);
+    void percolate_up(NodeStore::index_t n);
     
     void _lazy_gibbs_inner(std::vector<uint16_t>& starting_state,
                            uint16_t dim);
 
     // Get dimensions which are empty
-    void get_empty_dims(const NodeMap::iterator& n,
+    void get_empty_dims(const uint16_t* key,
                         std::vector<uint16_t>& dims_out);
     
     // Get dimensions which are set (non-empty)
-    void get_nonempty_dims(const NodeMap::iterator& n,
+    void get_nonempty_dims(const uint16_t* key,
                            std::vector<uint16_t>& dims_out);
 
     double get_lnp0_of_rank(uint16_t rank);
@@ -153,8 +202,7 @@ public:
     double fill_factor() const; // Fraction of nodes explored
 
     // Getters
-    NodeMap::const_iterator cbegin() const;
-    NodeMap::const_iterator cend() const;
+    const NodeStore& get_nodes() const; // All visited nodes
 
     uint16_t get_n_dim() const;
     uint16_t get_n_samples() const;
@@ -566,6 +566,7 @@ bool TChain::save(std::string fname, std::string group_name, size_t index,
 
 	H5::Exception::dontPrint();
 
+	H5Utils::IOLock io_lock;
 	std::unique_ptr<H5::H5File> file = H5Utils::openFile(fname);
 	if(!file) { return false; }
 
@@ -925,6 +926,7 @@ void TImgWriteBuffer::add(const cv::Mat& img) {
 }
 
 void TImgWriteBuffer::write(const std::string& fname, const std::string& group, const std::string& img) {
+	H5Utils::IOLock io_lock;
 	std::unique_ptr<H5::H5File> h5file = H5Utils::openFile(fname);
 	std::unique_ptr<H5::Group> h5group = H5Utils::openGroup(*h5file, group);
 
@@ -1126,6 +1128,7 @@ void TChainWriteBuffer::write(
         const std::string& chain,
         const std::string& meta)
 {
+	H5Utils::IOLock io_lock;
 	std::unique_ptr<H5::H5File> h5file = H5Utils::openFile(fname);
 	std::unique_ptr<H5::Group> h5group = H5Utils::openGroup(*h5file, group);
 
@@ -1621,6 +1624,7 @@ bool save_mat_image(cv::Mat& img, TRect& rect, std::string fname, std::string gr
 
 	H5::Exception::dontPrint();
 
+	H5Utils::IOLock io_lock;
 	std::unique_ptr<H5::H5File> file = H5Utils::openFile(fname);
 	if(!file) { return false; }
 
@@ -69,6 +69,7 @@ bool TStellarData::save(const std::string& fname, const std::string& group, cons
 
 	H5::Exception::dontPrint();
 
+	H5Utils::IOLock io_lock;
 	std::unique_ptr<H5::H5File> file = H5Utils::openFile(fname);
 	if(!file) { return false; }
 
@@ -194,6 +195,7 @@ void TStellarData::TMagnitudes::set(const TStellarData::TFileData& dat, double e
 
 bool TStellarData::load(const std::string& fname, const std::string& group, const std::string& dset,
 			double err_floor, double default_EBV) {
+	H5Utils::IOLock io_lock;
 	std::unique_ptr<H5::H5File> file = H5Utils::openFile(fname);
 	if(!file) { return false; }
 
@@ -727,6 +729,7 @@ void get_input_pixels(
         std::vector<std::string> &pix_name,
         const std::string &base
 ) {
+	H5Utils::IOLock io_lock;
 	std::unique_ptr<H5::H5File> file = H5Utils::openFile(fname, H5Utils::READ);
 
 	file->iterateElems(base, NULL, fetch_pixel_name, reinterpret_cast<void*>(&pix_name));
@@ -743,6 +746,7 @@ void get_pixel_props(
         std::vector<uint64_t>& healpix_index,
         const std::string& base
 ) {
+	H5Utils::IOLock io_lock;
 	std::unique_ptr<H5::H5File> f = H5Utils::openFile(fname, H5Utils::READ);
     
     for(auto& name : pix_name) {
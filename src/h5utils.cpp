@@ -32,6 +32,11 @@ int H5Utils::READ = 1;
 int H5Utils::WRITE = (1 << 1);
 int H5Utils::DONOTCREATE = (1 << 2);
 
+std::recursive_mutex& H5Utils::io_mutex() {
+	static std::recursive_mutex mtx;
+	return mtx;
+}
+
 /* 
  * Opens a file, creating it if it does not exist.
  * 
@@ -284,36 +289,42 @@ bool add_watermark_helper(const std::string& filename, const std::string& group_
 
 template<>
 bool H5Utils::add_watermark<bool>(const std::string& filename, const std::string& group_name, const std::string& attribute_name, const bool& value) {
+	H5Utils::IOLock io_lock;
 	H5::DataType dtype = H5::PredType::NATIVE_UCHAR;
 	return add_watermark_helper<bool>(filename, group_name, attribute_name, value, &dtype);
 }
 
 template<>
 bool H5Utils::add_watermark<float>(const std::string& filename, const std::string& group_name, const std::string& attribute_name, const float& value) {
+	H5Utils::IOLock io_lock;
 	H5::DataType dtype = H5::PredType::NATIVE_FLOAT;
 	return add_watermark_helper<float>(filename, group_name, attribute_name, value, &dtype);
 }
 
 template<>
 bool H5Utils::add_watermark<double>(const std::string& filename, const std::string& group_name, const std::string& attribute_name, const double& value) {
+	H5Utils::IOLock io_lock;
 	H5::DataType dtype = H5::PredType::NATIVE_DOUBLE;
 	return add_watermark_helper<double>(filename, group_name, attribute_name, value, &dtype);
 }
 
 template<>
 bool H5Utils::add_watermark<uint32_t>(const std::string& filename, const std::string& group_name, const std::string& attribute_name, const uint32_t& value) {
+	H5Utils::IOLock io_lock;
 	H5::DataType dtype = H5::PredType::NATIVE_UINT32;
 	return add_watermark_helper<uint32_t>(filename, group_name, attribute_name, value, &dtype);
 }
 
 template<>
 bool H5Utils::add_watermark<uint64_t>(const std::string& filename, const std::string& group_name, const std::string& attribute_name, const uint64_t& value) {
+	H5Utils::IOLock io_lock;
 	H5::DataType dtype = H5::PredType::NATIVE_UINT64;
 	return add_watermark_helper<uint64_t>(filename, group_name, attribute_name, value, &dtype);
 }
 
 template<>
 bool H5Utils::add_watermark<std::string>(const std::string& filename, const std::string& group_name, const std::string& attribute_name, const std::string& value) {
+	H5Utils::IOLock io_lock;
 	H5::StrType strtype(0, H5T_VARIABLE);
 	H5::DataSpace dspace(H5S_SCALAR);
 	return add_watermark_helper<std::string>(filename, group_name, attribute_name, value, NULL, &strtype, dspace);
@@ -35,6 +35,7 @@
 #include <memory>
 #include <vector>
 #include <cassert>
+#include <mutex>
 #include <H5Cpp.h>
 
 namespace H5Utils {
@@ -43,6 +44,18 @@ namespace H5Utils {
 	extern int WRITE;
 	extern int DONOTCREATE;
 	
+	// The HDF5 library is not thread-safe. Any scope that touches HDF5
+	// objects (including their destructors) should hold an IOLock, so
+	// that concurrent pixel workers are serialized through one writer.
+	std::recursive_mutex& io_mutex();
+	
+	class IOLock {
+	public:
+		IOLock() : _lock(io_mutex()) {}
+	private:
+		std::lock_guard<std::recursive_mutex> _lock;
+	};
+	
 	std::unique_ptr<H5::H5File> openFile(const std::string& fname, int accessmode = (READ | WRITE));
 	std::unique_ptr<H5::Group> openGroup(H5::H5File& file, const std::string& name, int accessmode = 0);
 	std::unique_ptr<H5::DataSet> openDataSet(H5::H5File& file, const std::string& name);
@@ -129,6 +129,19 @@ void sample_los_extinction_clouds(const std::string& out_fname, const std::strin
 
     TNullLogger logger;
 
+    // Every likelihood evaluation reuses the same images, so build the
+    // running sums along distance once, if they fit in the memory budget.
+    // Sparse images are skipped, as the sums would be as large as the
+    // dense images. Otherwise, each cloud is summed over bin by bin.
+    if(params.img_cumsum.empty() && !params.img_stack->is_sparse()
+                                 && (params.img_cumsum_max_MB > 0.)) {
+        if(!params.build_img_cumsum() && (verbosity >= 1)) {
+            std::cout << "# Running sums for cloud model exceed "
+                      << params.img_cumsum_max_MB << " MB. "
+                      << "Summing along distance directly." << std::endl;
+        }
+    }
+
     unsigned int max_attempts = 2;
     unsigned int N_steps = options.steps;
     unsigned int N_samplers = options.samplers;
@@ -264,7 +277,8 @@ void los_integral_clouds(
         double *const ret,
         const double *const Delta_mu,
         const double *const logDelta_EBV,
-        unsigned int N_clouds)
+        unsigned int N_clouds,
+        const float *const cumsum)
 {
     int x = 0;
     int x_next = ceil((Delta_mu[0] - img_stack.rect->min[1]) / img_stack.rect->dx[1]);
@@ -272,6 +286,8 @@ void los_integral_clouds(
     floating_t y_0 = -img_stack.rect->min[0] / img_stack.rect->dx[0];
     floating_t y = 0.;
     int y_max = img_stack.rect->N_bins[0];
+    const size_t cumsum_row = img_stack.rect->N_bins[1] + 1;
+    const size_t cumsum_img = y_max * cumsum_row;
     floating_t y_ceil, y_floor, dy, y_scaled;
     int y_ceil_int, y_floor_int;
 
@@ -305,11 +321,32 @@ void los_integral_clouds(
             //if(y_ceil_int >= y_max) { std::cout << "!! y_ceil_int >= y_max !!" << std::endl; break; }
             //if(y_floor_int < 0) { std::cout << "!! y_floor_int < 0 !!" << std::endl; break; }
 
-            for(x = x_start; x<x_next; x++) {
-                ret[k] += (y_ceil - y_scaled) * img_stack.img[k]->at<floating_t>(y_floor_int, x)
-                          + (y_scaled - y_floor) * img_stack.img[k]->at<floating_t>(y_ceil_int, x);
+            if(cumsum != nullptr) {
+                // Sum over [x_start, x_next) from the running sums
+                if(x_next > x_start) {
+                    const float *c_floor = cumsum + k*cumsum_img + y_floor_int*cumsum_row;
+                    const float *c_ceil = c_floor + cumsum_row;
+                    ret[k] += (y_ceil - y_scaled) * ((double)c_floor[x_next] - (double)c_floor[x_start])
+                              + (y_scaled - y_floor) * ((double)c_ceil[x_next] - (double)c_ceil[x_start]);
+                }
+                continue;
+            }
+
+            // Sparse images are zero outside of their bounding boxes
+            int x0 = x_start;
+            int x1 = x_next;
+            if(img_stack.is_sparse()) {
+                const cv::Rect& b = img_stack.bbox[k];
+                x0 = std::max(x0, b.x);
+                x1 = std::min(x1, b.x + b.width);
+            }
+
+            for(x = x0; x<x1; x++) {
+                ret[k] += (y_ceil - y_scaled) * img_stack.get(k, y_floor_int, x)
+                          + (y_scaled - y_floor) * img_stack.get(k, y_ceil_int, x);
             }
         }
+        x = x_next;
     }
 }
 
@@ -368,7 +405,8 @@ double lnp_los_extinction_clouds(const double* x, unsigned int N, TLOSMCMCParams
 
     // Compute line integrals through probability surfaces
     double *line_int = params.get_line_int(thread_num);
-    los_integral_clouds(*(params.img_stack), params.subpixel.data(), line_int, Delta_mu, logDelta_EBV, N_clouds);
+    los_integral_clouds(*(params.img_stack), params.subpixel.data(), line_int, Delta_mu, logDelta_EBV, N_clouds,
+                        params.img_cumsum.empty() ? nullptr : params.img_cumsum.data());
 
     // Soften and multiply line integrals
     double lnp_indiv;
@@ -511,6 +549,8 @@ void sample_los_extinction(const std::string& out_fname, const std::string& grou
     TAffineSampler<TLOSMCMCParams, TNullLogger>::reversible_step_t move_one_step = &step_one_Delta_EBV;
 
     TParallelAffineSampler<TLOSMCMCParams, TNullLogger> sampler(f_pdf, f_rand_state, ndim, N_samplers*ndim, params, logger, N_runs);
+    sampler.set_pdf_batch(&lnp_los_extinction_batch);
+    sampler.set_split_stretch(true);
 
     // Burn-in
     if(verbosity >= 1) { std::cout << "# Burn-in ..." << std::endl; }
@@ -852,12 +892,10 @@ void los_integral(TImgStack &img_stack, const double *const subpixel, double *co
     float ret_mult_factor = 1. / (float)subsampling / prec_factor;
 
     float tmp_ret, tmp_subpixel;
-    cv::Mat *img;
 
     // For each image
     for(int k=0; k<img_stack.N_images; k++) {
         tmp_ret = 0.;
-        img = img_stack.img[k];
         tmp_subpixel = subpixel[k];
 
         x = 0;
@@ -878,8 +916,8 @@ void los_integral(TImgStack &img_stack, const double *const subpixel, double *co
                 y_floor = (y_int >> base_2_prec);
                 diff = y_int - (y_floor << base_2_prec);
 
-                tmp_ret += (prec_factor_int - diff) * img->at<floating_t>(y_floor, x)
-                        + diff * img->at<floating_t>(y_floor+1, x);
+                tmp_ret += (prec_factor_int - diff) * img_stack.get(k, y_floor, x)
+                        + diff * img_stack.get(k, y_floor+1, x);
 
                 /*
                 // 1
@@ -905,18 +943,100 @@ void los_integral(TImgStack &img_stack, const double *const subpixel, double *co
     }
 }
 
-double lnp_los_extinction(const double *const logEBV, unsigned int N, TLOSMCMCParams& params) {
+void los_integral_batch(TImgStack &img_stack, const double *const subpixel, double *const ret,
+                        const float *const Delta_EBV, unsigned int N_regions, unsigned int n_walkers) {
+    // Sparse images are bounds-checked pixel by pixel, so fall back on
+    // the scalar integral
+    if(img_stack.is_sparse()) {
+        for(unsigned int w=0; w<n_walkers; w++) {
+            los_integral(img_stack, subpixel, ret + w*img_stack.N_images,
+                         Delta_EBV + w*(N_regions+1), N_regions);
+        }
+        return;
+    }
+
+    assert(img_stack.rect->N_bins[1] % N_regions == 0);
+
+    const int subsampling = 1;
+    const int N_pix_per_bin = img_stack.rect->N_bins[1] / N_regions;
+    const float N_samples = subsampling * N_pix_per_bin;
+
+    const float y_0 = -img_stack.rect->min[0] / img_stack.rect->dx[0];
+
+    // Same Q14.18 fixed-point scheme as los_integral
+    typedef uint32_t fixed_point_t;
+    const int base_2_prec = 18;
+
+    const fixed_point_t prec_factor_int = (1 << base_2_prec);
+    const float prec_factor = (float)prec_factor_int;
+
+    float dy_mult_factor = 1. / N_samples / img_stack.rect->dx[0];
+    float ret_mult_factor = 1. / (float)subsampling / prec_factor;
+
+    // Per-walker state, laid out so that walkers are contiguous
+    std::vector<fixed_point_t> y_int(n_walkers);
+    std::vector<fixed_point_t> dy_int(N_regions * n_walkers);
+    std::vector<float> tmp_ret(n_walkers);
+
+    fixed_point_t *const y_p = y_int.data();
+    float *const ret_p = tmp_ret.data();
+
+    for(int k=0; k<img_stack.N_images; k++) {
+        const float tmp_subpixel = subpixel[k];
+
+        for(unsigned int w=0; w<n_walkers; w++) {
+            const float *const D = Delta_EBV + w*(N_regions+1);
+            float y = y_0 + tmp_subpixel * (D[0] / img_stack.rect->dx[0]);
+            y_p[w] = (fixed_point_t)(prec_factor * y);
+            for(int i=1; i<N_regions+1; i++) {
+                float dy = tmp_subpixel * D[i] * dy_mult_factor;
+                dy_int[(i-1)*n_walkers + w] = (fixed_point_t)(prec_factor * dy);
+            }
+            ret_p[w] = 0.;
+        }
+
+        const floating_t *const p = img_stack.img[k]->ptr<floating_t>(0);
+        const size_t stride = img_stack.img[k]->step1();
+
+        int x = 0;
+        for(int i=0; i<N_regions; i++) {
+            const fixed_point_t *const dy_p = dy_int.data() + i*n_walkers;
+
+            for(int j=0; j<N_pix_per_bin; j++, x++) {
+                // Each walker reads from its own row, so the loads are
+                // gathers
+                #pragma omp simd
+                for(unsigned int w=0; w<n_walkers; w++) {
+                    fixed_point_t y_floor = (y_p[w] >> base_2_prec);
+                    fixed_point_t diff = y_p[w] - (y_floor << base_2_prec);
+
+                    ret_p[w] += (prec_factor_int - diff) * p[y_floor*stride + x]
+                             + diff * p[(y_floor+1)*stride + x];
+
+                    y_p[w] += dy_p[w];
+                }
+            }
+        }
+
+        for(unsigned int w=0; w<n_walkers; w++) {
+            ret[w*img_stack.N_images + k] = ret_p[w] * ret_mult_factor;
+        }
+    }
+}
+
+// Prior on log(Delta E(B-V)) for the piecewise-linear model. Fills in
+// Delta_EBV and EBV_tot. Returns neg_inf_replacement if the total
+// reddening runs off the edge of the images.
+static double lnp_los_extinction_prior(
+        const double *const logEBV, unsigned int N,
+        TLOSMCMCParams& params, float *const Delta_EBV)
+{
     double lnp = 0.;
 
     double EBV_tot = 0.;
-    double EBV_tmp;
     double diff_scaled;
 
-    int thread_num = omp_get_thread_num();
-
     // Calculate Delta E(B-V) from log(Delta E(B-V))
-    float *Delta_EBV = params.get_Delta_EBV(thread_num);
-
     for(int i=0; i<N; i++) {
         Delta_EBV[i] = exp(logEBV[i]);
     }
@@ -954,11 +1074,12 @@ double lnp_los_extinction(const double *const logEBV, unsigned int N, TLOSMCMCPa
         lnp -= (EBV_tot - params.EBV_max) * (EBV_tot - params.EBV_max) / (2. * 0.20 * 0.20 * params.EBV_max * params.EBV_max);
     }
 
-    // Compute line integrals through probability surfaces
-    double *line_int = params.get_line_int(thread_num);
-    los_integral(*(params.img_stack), params.subpixel.data(), line_int, Delta_EBV, N-1);
+    return lnp;
+}
 
-    // Soften and multiply line integrals
+// Soften and multiply line integrals
+static double lnp_los_extinction_likelihood(const double *const line_int, TLOSMCMCParams& params) {
+    double lnp = 0.;
     double lnp_indiv;
     for(size_t i=0; i<params.img_stack->N_images; i++) {
         //if(line_int[i] < 1.e5*params.p0) {
@@ -981,6 +1102,47 @@ double lnp_los_extinction(const double *const logEBV, unsigned int N, TLOSMCMCPa
     return lnp;
 }
 
+double lnp_los_extinction(const double *const logEBV, unsigned int N, TLOSMCMCParams& params) {
+    int thread_num = omp_get_thread_num();
+
+    float *Delta_EBV = params.get_Delta_EBV(thread_num);
+    double lnp = lnp_los_extinction_prior(logEBV, N, params, Delta_EBV);
+    if(lnp == neg_inf_replacement) { return neg_inf_replacement; }
+
+    // Compute line integrals through probability surfaces
+    double *line_int = params.get_line_int(thread_num);
+    los_integral(*(params.img_stack), params.subpixel.data(), line_int, Delta_EBV, N-1);
+
+    return lnp + lnp_los_extinction_likelihood(line_int, params);
+}
+
+void lnp_los_extinction_batch(const double *const *const logEBV, unsigned int n, unsigned int N,
+                              TLOSMCMCParams& params, double *const lnp) {
+    std::vector<float> Delta_EBV(n*N);
+    std::vector<unsigned int> valid;
+    valid.reserve(n);
+
+    // Priors, and gather the walkers that stay on the images
+    for(unsigned int w=0; w<n; w++) {
+        float *const D = Delta_EBV.data() + valid.size()*N;
+        lnp[w] = lnp_los_extinction_prior(logEBV[w], N, params, D);
+        if(lnp[w] != neg_inf_replacement) { valid.push_back(w); }
+    }
+
+    if(valid.empty()) { return; }
+
+    // Compute line integrals through probability surfaces for all walkers
+    // at once
+    size_t n_images = params.img_stack->N_images;
+    std::vector<double> line_int(valid.size() * n_images);
+    los_integral_batch(*(params.img_stack), params.subpixel.data(), line_int.data(),
+                       Delta_EBV.data(), N-1, valid.size());
+
+    for(unsigned int v=0; v<valid.size(); v++) {
+        lnp[valid[v]] += lnp_los_extinction_likelihood(line_int.data() + v*n_images, params);
+    }
+}
+
 void gen_rand_los_extinction(double *const logEBV, unsigned int N, gsl_rng *r, TLOSMCMCParams &params) {
     double EBV_ceil = params.img_stack->rect->max[0] / params.subpixel_max;
     double mu = 1.5 * params.EBV_guess_max / params.subpixel_max / (double)N;
@@ -1042,6 +1204,11 @@ double guess_EBV_max(TImgStack &img_stack) {
     // Stack images
     img_stack.stack(stack);
 
+    // No pixels (e.g., released images): fall back on the lowest reddening
+    if(stack.empty()) {
+        return img_stack.rect->min[0];
+    }
+
     // Sum across each EBV
     cv::reduce(stack, col_avg, 1, cv::REDUCE_AVG);
     //float max_sum = *std::max_element(col_avg.begin<floating_t>(), col_avg.end<floating_t>());
@@ -1509,6 +1676,7 @@ TLOSMCMCParams::TLOSMCMCParams(
     subpixel_max = 1.;
     subpixel_min = 1.;
     alpha_skew = 0.;
+    img_cumsum_max_MB = 0.;
 }
 
 TLOSMCMCParams::~TLOSMCMCParams() {
@@ -1737,6 +1905,36 @@ float* TLOSMCMCParams::get_Delta_EBV(unsigned int thread_num) {
 }
 
 
+bool TLOSMCMCParams::build_img_cumsum() {
+    const int n_rows = img_stack->rect->N_bins[0];
+    const int n_cols = img_stack->rect->N_bins[1];
+    const size_t n_stars = img_stack->N_images;
+    const size_t row_len = n_cols + 1;
+
+    size_t n_entries = n_stars * n_rows * row_len;
+    if(n_entries * sizeof(float) > img_cumsum_max_MB * 1024. * 1024.) {
+        return false;
+    }
+
+    img_cumsum.resize(n_entries);
+
+    #pragma omp parallel for schedule(static)
+    for(int k=0; k<(int)n_stars; k++) {
+        for(int y=0; y<n_rows; y++) {
+            float *c = img_cumsum.data() + ((size_t)k * n_rows + y) * row_len;
+            double sum = 0.;
+            c[0] = 0.;
+            for(int x=0; x<n_cols; x++) {
+                sum += (double)img_stack->get(k, y, x);
+                c[x+1] = (float)sum;
+            }
+        }
+    }
+
+    return true;
+}
+
+
 /****************************************************************************************************************************
  *
  * TDiscreteLosMcmcParams
@@ -1751,6 +1949,7 @@ TDiscreteLosMcmcParams::TDiscreteLosMcmcParams(
             int verbosity)
         : img_stack(std::move(_img_stack)),
           neighbor_pixels(std::move(_neighbor_pixels)),
+          packed_bits(0),
           N_runs(_N_runs), N_threads(_N_threads)
 {
     // Initialize random number generator
@@ -1773,6 +1972,9 @@ TDiscreteLosMcmcParams::TDiscreteLosMcmcParams(
 
     y_zero_idx = -img_stack->rect->min[0] / img_stack->rect->dx[0];
 
+    // Taken now, as the float images may be released once packed
+    EBV_guess_max = guess_EBV_max(*img_stack);
+
     // Priors
     mu_log_dE = -10.;
     set_sigma_log_dE(0.75);
@@ -1808,6 +2010,359 @@ void TDiscreteLosMcmcParams::set_sigma_log_dE(const double s) {
 }
 
 
+template<class T>
+static void quantize_packed(
+        const TImgStack& img_stack,
+        int n_dists, int n_E,
+        std::vector<T>& packed,
+        std::vector<double>& scale)
+{
+    // Each star is scaled so that its peak pixel maps to the largest
+    // stored value, and pixels are rounded to the nearest step.
+    const size_t n_stars = img_stack.N_images;
+    const double q_max = (double)std::numeric_limits<T>::max();
+    packed.resize((size_t)n_dists * n_E * n_stars);
+    scale.resize(n_stars);
+
+    for(size_t k=0; k<n_stars; k++) {
+        double peak = 0.;
+        for(int y=0; y<n_E; y++) {
+            const floating_t *row = img_stack.img[k]->ptr<floating_t>(y);
+            for(int x=0; x<n_dists; x++) {
+                peak = std::max(peak, (double)row[x]);
+            }
+        }
+        scale[k] = peak / q_max;
+        double inv_scale = (peak > 0.) ? q_max / peak : 0.;
+
+        for(int y=0; y<n_E; y++) {
+            const floating_t *row = img_stack.img[k]->ptr<floating_t>(y);
+            for(int x=0; x<n_dists; x++) {
+                double q = std::round(row[x] * inv_scale);
+                q = std::min(std::max(q, 0.), q_max);
+                packed[((size_t)x * n_E + y) * n_stars + k] = (T)q;
+            }
+        }
+    }
+}
+
+
+bool TDiscreteLosMcmcParams::pack_images(int bits) {
+    assert(!img_stack->is_sparse());
+    size_t n_stars = img_stack->N_images;
+
+    if(!valid_pack_bits(bits)) {
+        std::cerr << "Cannot pack images with " << bits << " bits per pixel "
+                  << "(must be 32, 16 or 8)." << std::endl;
+        return false;
+    }
+
+    if(bits == 16) {
+        quantize_packed(*img_stack, n_dists, n_E, img_packed_u16, packed_scale);
+        packed_bits = 16;
+        return true;
+    } else if(bits == 8) {
+        quantize_packed(*img_stack, n_dists, n_E, img_packed_u8, packed_scale);
+        packed_bits = 8;
+        return true;
+    }
+
+    img_packed.resize((size_t)n_dists * n_E * n_stars);
+
+    for(size_t k=0; k<n_stars; k++) {
+        for(int y=0; y<n_E; y++) {
+            const floating_t *row = img_stack->img[k]->ptr<floating_t>(y);
+            for(int x=0; x<n_dists; x++) {
+                img_packed[((size_t)x * n_E + y) * n_stars + k] = row[x];
+            }
+        }
+    }
+    packed_bits = 32;
+    return true;
+}
+
+
+// Kernels on the packed images. Pixels are summed in their stored units,
+// and then multiplied by each star's scale (if any).
+
+template<class T>
+static void packed_line_int_impl(
+        const T *const packed, const double *const scale,
+        size_t n_E, size_t n_stars, int n_dists,
+        const int16_t *const y_idx,
+        double *const ret)
+{
+    std::fill(ret, ret+n_stars, 0.);
+
+    // For each distance, sweep over all stars
+    for(int j = 0; j < n_dists; j++) {
+        const T *p = packed + ((size_t)j * n_E + y_idx[j]) * n_stars;
+        #pragma omp simd
+        for(size_t k = 0; k < n_stars; k++) {
+            ret[k] += (double)p[k];
+        }
+    }
+
+    if(scale != nullptr) {
+        #pragma omp simd
+        for(size_t k = 0; k < n_stars; k++) {
+            ret[k] *= scale[k];
+        }
+    }
+}
+
+
+template<class T>
+static void packed_diff_impl(
+        const T *const packed, const double *const scale,
+        size_t n_E, size_t n_stars,
+        int x, int16_t y_new, int16_t y_old,
+        double *const ret)
+{
+    const T *p_new = packed + ((size_t)x * n_E + y_new) * n_stars;
+    const T *p_old = packed + ((size_t)x * n_E + y_old) * n_stars;
+    if(scale != nullptr) {
+        #pragma omp simd
+        for(size_t k = 0; k < n_stars; k++) {
+            ret[k] = scale[k] * ((double)p_new[k] - (double)p_old[k]);
+        }
+    } else {
+        #pragma omp simd
+        for(size_t k = 0; k < n_stars; k++) {
+            ret[k] = (double)p_new[k] - (double)p_old[k];
+        }
+    }
+}
+
+
+template<class T>
+static void packed_shift_diff_impl(
+        const T *const packed, const double *const scale,
+        size_t n_E, size_t n_stars,
+        int x0, int x1, int dy,
+        const int16_t *const y_idx_old,
+        double *const ret)
+{
+    std::fill(ret, ret+n_stars, 0.);
+
+    // For each distance, sweep over all stars
+    for(int j = x0; j < x1; j++) {
+        const T *p_new = packed + ((size_t)j * n_E + y_idx_old[j] + dy) * n_stars;
+        const T *p_old = packed + ((size_t)j * n_E + y_idx_old[j]) * n_stars;
+        #pragma omp simd
+        for(size_t k = 0; k < n_stars; k++) {
+            ret[k] += (double)p_new[k] - (double)p_old[k];
+        }
+    }
+
+    if(scale != nullptr) {
+        #pragma omp simd
+        for(size_t k = 0; k < n_stars; k++) {
+            ret[k] *= scale[k];
+        }
+    }
+}
+
+
+void TDiscreteLosMcmcParams::packed_line_int(
+        const int16_t *const y_idx,
+        double *const ret) const
+{
+    const size_t n_stars = img_stack->N_images;
+    switch(packed_bits) {
+        case 16:
+            packed_line_int_impl(img_packed_u16.data(), packed_scale.data(),
+                                 n_E, n_stars, n_dists, y_idx, ret);
+            break;
+        case 8:
+            packed_line_int_impl(img_packed_u8.data(), packed_scale.data(),
+                                 n_E, n_stars, n_dists, y_idx, ret);
+            break;
+        default:
+            packed_line_int_impl(img_packed.data(), (const double*)nullptr,
+                                 n_E, n_stars, n_dists, y_idx, ret);
+    }
+}
+
+
+void TDiscreteLosMcmcParams::packed_diff(
+        int x, int16_t y_new, int16_t y_old,
+        double *const ret) const
+{
+    const size_t n_stars = img_stack->N_images;
+    switch(packed_bits) {
+        case 16:
+            packed_diff_impl(img_packed_u16.data(), packed_scale.data(),
+                             n_E, n_stars, x, y_new, y_old, ret);
+            break;
+        case 8:
+            packed_diff_impl(img_packed_u8.data(), packed_scale.data(),
+                             n_E, n_stars, x, y_new, y_old, ret);
+            break;
+        default:
+            packed_diff_impl(img_packed.data(), (const double*)nullptr,
+                             n_E, n_stars, x, y_new, y_old, ret);
+    }
+}
+
+
+void TDiscreteLosMcmcParams::packed_shift_diff(
+        int x0, int x1, int dy,
+        const int16_t *const y_idx_old,
+        double *const ret) const
+{
+    const size_t n_stars = img_stack->N_images;
+    switch(packed_bits) {
+        case 16:
+            packed_shift_diff_impl(img_packed_u16.data(), packed_scale.data(),
+                                   n_E, n_stars, x0, x1, dy, y_idx_old, ret);
+            break;
+        case 8:
+            packed_shift_diff_impl(img_packed_u8.data(), packed_scale.data(),
+                                   n_E, n_stars, x0, x1, dy, y_idx_old, ret);
+            break;
+        default:
+            packed_shift_diff_impl(img_packed.data(), (const double*)nullptr,
+                                   n_E, n_stars, x0, x1, dy, y_idx_old, ret);
+    }
+}
+
+
+double TDiscreteLosMcmcParams::check_packed_accuracy(
+        unsigned int n_profiles,
+        int verbosity)
+{
+    // Line integrals are compared for random non-decreasing profiles.
+    // Stars with line integrals below min_line_int (of a unit-sum image)
+    // are left out of the relative error.
+    const double min_line_int = 1.e-6;
+    const int n_stars = img_stack->N_images;
+
+    std::vector<int16_t> y_idx(n_dists);
+    std::vector<double> line_int_packed(n_stars);
+    std::mt19937 r_check(0);
+    std::uniform_int_distribution<int> u(0, n_E-1);
+
+    double max_abs_err = 0.;
+    double max_rel_err = 0.;
+    double sum_abs_err = 0.;
+    double sum_rel_err = 0.;
+    int64_t n_abs = 0;
+    int64_t n_rel = 0;
+
+    for(unsigned int n=0; n<n_profiles; n++) {
+        for(int j=0; j<n_dists; j++) {
+            y_idx[j] = u(r_check);
+        }
+        std::sort(y_idx.begin(), y_idx.end());
+
+        packed_line_int(y_idx.data(), line_int_packed.data());
+
+        for(int k=0; k<n_stars; k++) {
+            double line_int = 0.;
+            for(int j=0; j<n_dists; j++) {
+                line_int += (double)img_stack->get(k, y_idx[j], j);
+            }
+            double abs_err = std::fabs(line_int_packed[k] - line_int);
+            max_abs_err = std::max(max_abs_err, abs_err);
+            sum_abs_err += abs_err;
+            n_abs++;
+            if(line_int > min_line_int) {
+                max_rel_err = std::max(max_rel_err, abs_err / line_int);
+                sum_rel_err += abs_err / line_int;
+                n_rel++;
+            }
+        }
+    }
+
+    if(verbosity >= 1) {
+        std::cerr << "Packed images (" << packed_bits << " bits), over "
+                  << n_profiles << " random profiles:" << std::endl
+                  << "  line-integral error (absolute): max = " << max_abs_err
+                  << ", mean = " << (n_abs ? sum_abs_err / n_abs : 0.)
+                  << std::endl
+                  << "  line-integral error (relative): max = " << max_rel_err
+                  << ", mean = " << (n_rel ? sum_rel_err / n_rel : 0.)
+                  << std::endl;
+    }
+
+    return max_rel_err;
+}
+
+
+void TDiscreteLosMcmcParams::build_active_index(double threshold) {
+    const int n_stars = img_stack->N_images;
+
+    // Range of nonzero reddening pixels for each (star, distance) pair
+    std::vector<int16_t> y_lo((size_t)n_stars * n_dists);
+    std::vector<int16_t> y_hi((size_t)n_stars * n_dists);
+
+    #pragma omp parallel for schedule(dynamic)
+    for(int k=0; k<n_stars; k++) {
+        int16_t *lo = y_lo.data() + (size_t)k * n_dists;
+        int16_t *hi = y_hi.data() + (size_t)k * n_dists;
+        std::fill(lo, lo+n_dists, (int16_t)n_E);
+        std::fill(hi, hi+n_dists, (int16_t)-1);
+
+        // Only the bounding box of sparse images needs to be scanned
+        int x0 = 0, x1 = n_dists;
+        int y0 = 0, y1 = n_E;
+        if(img_stack->is_sparse()) {
+            const cv::Rect& b = img_stack->bbox[k];
+            x0 = b.x;
+            x1 = b.x + b.width;
+            y0 = b.y;
+            y1 = b.y + b.height;
+        }
+
+        floating_t peak = 0;
+        for(int y=y0; y<y1; y++) {
+            for(int x=x0; x<x1; x++) {
+                peak = std::max(peak, img_stack->get(k, y, x));
+            }
+        }
+        const floating_t cut = threshold * peak;
+
+        for(int y=y0; y<y1; y++) {
+            for(int x=x0; x<x1; x++) {
+                if(img_stack->get(k, y, x) > cut) {
+                    lo[x] = std::min(lo[x], (int16_t)y);
+                    hi[x] = std::max(hi[x], (int16_t)y);
+                }
+            }
+        }
+    }
+
+    // Gather the active stars in each column
+    active_start.assign(n_dists+1, 0);
+    for(int x=0; x<n_dists; x++) {
+        uint32_t n = 0;
+        for(int k=0; k<n_stars; k++) {
+            if(y_hi[(size_t)k*n_dists + x] >= 0) { n++; }
+        }
+        active_start[x+1] = active_start[x] + n;
+    }
+
+    size_t n_entries = active_start[n_dists];
+    active_star.resize(n_entries);
+    active_y_lo.resize(n_entries);
+    active_y_hi.resize(n_entries);
+
+    for(int x=0; x<n_dists; x++) {
+        uint32_t i = active_start[x];
+        for(int k=0; k<n_stars; k++) {
+            size_t kx = (size_t)k*n_dists + x;
+            if(y_hi[kx] >= 0) {
+                active_star[i] = k;
+                active_y_lo[i] = y_lo[kx];
+                active_y_hi[i] = y_hi[kx];
+                i++;
+            }
+        }
+    }
+}
+
+
 void randomize_neighbors(
         TNeighborPixels& neighbor_pixels,
         std::vector<uint16_t>& neighbor_sample,
@@ -1822,18 +2377,21 @@ void randomize_neighbors(
 }
 
 
-void TDiscreteLosMcmcParams::set_central_delta(int16_t* y_idx) {
+void TDiscreteLosMcmcParams::set_central_delta(
+        int16_t* y_idx,
+        unsigned int sample)
+{
     //std::cerr << "y_idx:";
     for(int i=0; i<n_dists; i++) {
         //std::cerr << " " << y_idx[i];
-        neighbor_pixels->set_delta((double)(y_idx[i]), 0, 0, i);
+        neighbor_pixels->set_delta((double)(y_idx[i]), 0, sample, i);
     }
     //std::cerr << std::endl;
     neighbor_pixels->apply_priors_indiv(
         mu_log_dE_0,
         sigma_log_dE_0,
         img_stack->rect->dx[0],
-        0, 0);
+        0, sample);
 }
 
 
@@ -1856,13 +2414,20 @@ double neighbor_gibbs_step(
 
     log_p_sample_ws.resize(n_samples);
 
+    // The mean of the pixel does not depend on which of its samples
+    // is considered, so calculate it once per distance
+    std::vector<double> mu_dist(n_dists, 0.);
+    for(int dist=1; dist<n_dists-1; dist++) {
+        mu_dist[dist] = neighbor_pixels.calc_mean(pix, dist, neighbor_sample);
+    }
+
     // Determine chi^2 of each sample
     for(int sample=0; sample<n_samples; sample++) {
         log_p_sample_ws[sample] = 0.;
         
         for(int dist=1; dist<n_dists-1; dist++) {
-            // Calculate mean, sigma of pixel
-            mu = neighbor_pixels.calc_mean(pix, dist, neighbor_sample);
+            // Mean, sigma of pixel
+            mu = mu_dist[dist];
             ivar = neighbor_pixels.get_inv_var(pix, dist);
 
             // Add to chi^2
@@ -1955,18 +2520,25 @@ neighbor_gibbs_step_shifted_factory(
 
     log_p_sample_ws.resize(n_samples);
 
+    // The mean of the pixel does not depend on which of its samples
+    // is considered, so calculate it once per distance
+    std::vector<double> mu_dist(n_dists, 0.);
+    for(int dist=0; dist<n_dists; dist++) {
+        mu_dist[dist] = neighbor_pixels.calc_mean_shifted(
+            pix,
+            dist,
+            neighbor_sample,
+            shift_weight
+        );
+    }
+
     // Determine chi^2 of each sample
     for(int sample=0; sample<n_samples; sample++) {
         log_p_sample_ws[sample] = 0.;
         
         for(int dist=0; dist<n_dists; dist++) {
-            // Calculate mean, sigma of pixel
-            mu = neighbor_pixels.calc_mean_shifted(
-                pix,
-                dist,
-                neighbor_sample,
-                shift_weight
-            );
+            // Mean, sigma of pixel
+            mu = mu_dist[dist];
             ivar = neighbor_pixels.get_inv_var(pix, dist);
 
             // Add to chi^2
@@ -2003,9 +2575,14 @@ neighbor_gibbs_step_shifted_factory(
 
 struct NeighborGibbsCacheData {
     // Data required in cache to speed up Gibbs steps in
-    // neighboring pixels.
+    // neighboring pixels. Depends only on the samples chosen in the
+    // pixels other than the central pixel and the stepped pixel.
+    
+    // Candidate samples of the stepped pixel
     std::vector<uint16_t> samples;
-    std::vector<double> mu;
+    // Sum over the other non-central pixels that enters the conditional
+    // mean of the stepped pixel (before normalization), at each distance
+    std::vector<double> mu_sum;
 };
 
 
@@ -2015,8 +2592,6 @@ neighbor_gibbs_step_shifted_cache_data(
         TNeighborPixels& neighbor_pixels,
         const std::vector<uint16_t>& neighbor_sample,
         std::vector<double>& log_p_sample_ws,
-        std::vector<double>& p_sample_ws,
-        std::vector<double>& mu_ws,
         const double beta,
         const double shift_weight,
         const double lnp_cutoff)
@@ -2024,82 +2599,79 @@ neighbor_gibbs_step_shifted_cache_data(
     // Gather cache data allowing one to execute a Gibbs step
     // in one of the neighboring pixels, choosing
     // a sample at random, weighted by the Gaussian process prior.
+    //
+    // The candidate samples are those within <lnp_cutoff> of the most
+    // probable sample when the central pixel is left out of the
+    // conditional mean. A cutoff of -infinity keeps every sample.
     
     double mu, ivar, dx;
 
     const int n_samples = neighbor_pixels.get_n_samples();
     const int n_dists = neighbor_pixels.get_n_dists();
+    const double norm = 1. + 2.*shift_weight;
 
+    std::unique_ptr<NeighborGibbsCacheData> cache_data
+        = std::make_unique<NeighborGibbsCacheData>();
+    cache_data->mu_sum.resize(n_dists);
+    
     log_p_sample_ws.resize(n_samples);
-    mu_ws.resize(n_samples*n_dists);
+    std::fill(log_p_sample_ws.begin(), log_p_sample_ws.end(), 0.);
     
-    // Determine chi^2 of each sample
-    uint32_t k = 0;
-    for(int sample=0; sample<n_samples; sample++) {
-        log_p_sample_ws[sample] = 0.;
+    for(int dist=0; dist<n_dists; dist++) {
+        // Mean of pixel, leaving out the central pixel (start_pix = 1)
+        mu = neighbor_pixels.calc_mean_shifted(
+            pix,
+            dist,
+            neighbor_sample,
+            shift_weight,
+            1
+        );
+        ivar = neighbor_pixels.get_inv_var(pix, dist);
+        cache_data->mu_sum[dist] = -mu * norm * ivar;
         
-        for(int dist=0; dist<n_dists; dist++, k++) {
-            // Calculate mean, sigma of pixel
-            mu_ws[k] = neighbor_pixels.calc_mean_shifted(
-                pix,
-                dist,
-                neighbor_sample,
-                shift_weight,
-                1
-            );
-            ivar = neighbor_pixels.get_inv_var(pix, dist);
-
-            // Add to chi^2
+        // Add to chi^2 of each sample
+        for(int sample=0; sample<n_samples; sample++) {
             dx = neighbor_pixels.get_delta(pix, sample, dist) - mu;
             log_p_sample_ws[sample] += ivar * dx*dx;
         }
-        
+    }
+    
+    cache_data->samples.reserve(n_samples);
+    
+    if(lnp_cutoff == -std::numeric_limits<double>::infinity()) {
+        for(int sample=0; sample<n_samples; sample++) {
+            cache_data->samples.push_back(sample);
+        }
+        return cache_data;
+    }
+    
+    for(int sample=0; sample<n_samples; sample++) {
         log_p_sample_ws[sample] *= -0.5;
-
-        // Prior term
-        log_p_sample_ws[sample] -= neighbor_pixels.get_prior(pix, sample);
+        log_p_sample_ws[sample] -= neighbor_pixels.get_sum_log_dy(pix, sample);
+        log_p_sample_ws[sample] *= beta;
+        log_p_sample_ws[sample] -=
+            neighbor_pixels.get_prior(pix, sample) +
+            (1.-beta) * neighbor_pixels.get_likelihood(pix, sample);
     }
     
-    // Turn chi^2 into probability
     double log_p_max = *std::max_element(
         log_p_sample_ws.begin(),
         log_p_sample_ws.end()
     );
     
-    std::unique_ptr<NeighborGibbsCacheData> cache_data
-        = std::make_unique<NeighborGibbsCacheData>();
-    
-    cache_data->samples.reserve(n_samples);
     for(int sample=0; sample<n_samples; sample++) {
-        double lnp_sample = beta
-                            * (log_p_sample_ws[sample] - log_p_max);
-        if(lnp_sample > lnp_cutoff) {
+        if(log_p_sample_ws[sample] - log_p_max > lnp_cutoff) {
             cache_data->samples.push_back(sample);
         }
     }
-    
-    const int n_samples_cached = cache_data->samples.size();
-    cache_data->mu.reserve(n_dists*n_samples_cached);
-    for(auto s : cache_data->samples) {
-        for(int k=s*n_dists; k<(s+1)*n_dists; k++) {
-            cache_data->mu.push_back(mu_ws[k]);
-        }
-    }
 
-    return std::move(cache_data);
+    return cache_data;
 }
 
 
-//typedef LRUCache::CachedFunction<
-//            std::vector<uint16_t>,
-//            std::shared_ptr<NeighborGibbsCacheData>,
-//            LRUCache::VectorHasher<uint16_t>
-//        > NeighborGibbsCache;
-
-
 int neighbor_gibbs_step_shifted_cached(
         const int pix,
-        NeighborGibbsCacheData& cache_data,
+        const NeighborGibbsCacheData& cache_data,
         TNeighborPixels& neighbor_pixels,
         const std::vector<uint16_t>& neighbor_sample,
         std::vector<double>& log_p_sample_ws,
@@ -2107,93 +2679,70 @@ int neighbor_gibbs_step_shifted_cached(
         std::vector<double>& mu_ws,
         const double beta,
         const double shift_weight,
-        const double lnp_cutoff,
         std::mt19937& r)
 {
-    // Calculate ln(p) for each sample
+    // Takes a Gibbs step in one of the neighboring pixels, using cached
+    // data (see neighbor_gibbs_step_shifted_cache_data). Only the
+    // contribution of the central pixel to the conditional mean is
+    // calculated here. Returns the chosen sample.
+    //
+    // On return, log_p_sample_ws[i] holds the log probability of
+    // cache_data.samples[i].
+    
     const int n_dists = neighbor_pixels.get_n_dists();
     const int n_samples = cache_data.samples.size();
+    const double norm = 1. + 2.*shift_weight;
+    
+    // Profile of the central pixel, in its current slot
+    const uint16_t s0 = neighbor_sample[0];
     
-    double mu, dx, ivar;
-    double inv_cov_0;
-    double inv_cov_m1;
-    double inv_cov_p1;
+    // Conditional mean at each distance, adding in the central pixel.
+    // The shift couplings are the same as in
+    // TNeighborPixels::calc_mean_shifted.
+    mu_ws.resize(n_dists);
+    for(int dist=0; dist<n_dists; dist++) {
+        double icov_0 = neighbor_pixels.get_inv_cov(dist, pix, 0);
+        double mu = cache_data.mu_sum[dist]
+                    + icov_0 * neighbor_pixels.get_delta(0, s0, dist);
+        if(dist > 0) {
+            double icov_m1 = 0.5 * (
+                icov_0 + neighbor_pixels.get_inv_cov(dist-1, pix, 0)
+            );
+            mu += shift_weight * icov_m1
+                  * neighbor_pixels.get_delta(0, s0, dist-1);
+        }
+        if(dist < n_dists-1) {
+            double icov_p1 = 0.5 * (
+                icov_0 + neighbor_pixels.get_inv_cov(dist+1, pix, 0)
+            );
+            mu += shift_weight * icov_p1
+                  * neighbor_pixels.get_delta(0, s0, dist+1);
+        }
+        mu_ws[dist] = -mu / (norm * neighbor_pixels.get_inv_var(pix, dist));
+    }
     
-    int j = 0;
+    // Calculate ln(p) for each candidate sample
+    log_p_sample_ws.resize(std::max((int)log_p_sample_ws.size(), n_samples));
+    p_sample_ws.resize(std::max((int)p_sample_ws.size(), n_samples));
     
     for(int i=0; i<n_samples; i++) {
         uint16_t sample = cache_data.samples[i];
         
-        log_p_sample_ws[i] = 0.;
-        
-        // At each distance, update mean to take into
-        // account central pixel.
-        // The first and last distances are treated as special cases.
-
-        // First distance
-        mu = cache_data.mu[j];
-        
-        inv_cov_0 = neighbor_pixels.get_inv_cov(0, pix, 0);
-        inv_cov_p1 = neighbor_pixels.get_inv_cov(1, pix, 0);
-        
-        mu += inv_cov_0 * neighbor_pixels.get_delta(0, sample, 0)
-              + shift_weight * (
-                    inv_cov_p1
-                    * neighbor_pixels.get_delta(0, sample, 1)
-                );
-        ivar = neighbor_pixels.get_inv_var(pix, 0);
-
-        // Add to chi^2
-        dx = neighbor_pixels.get_delta(pix, sample, 0) - mu;
-        log_p_sample_ws[sample] += ivar * dx*dx;
-        
-        j++;
-        
-        // Middle distances
-        for(int dist=1; dist<n_dists-1; dist++, j++) {
-            mu = cache_data.mu[j];
-            
-            inv_cov_0 = neighbor_pixels.get_inv_cov(dist, pix, 0);
-            inv_cov_m1 = neighbor_pixels.get_inv_cov(dist-1, pix, 0);
-            inv_cov_p1 = neighbor_pixels.get_inv_cov(dist+1, pix, 0);
-            
-            mu += inv_cov_0 * neighbor_pixels.get_delta(0, sample, dist)
-                  + shift_weight * (
-                        inv_cov_m1
-                        * neighbor_pixels.get_delta(0, sample, dist-1)
-                      + inv_cov_p1
-                        * neighbor_pixels.get_delta(0, sample, dist+1)
-                    );
-            ivar = neighbor_pixels.get_inv_var(pix, dist);
-
-            // Add to chi^2
-            dx = neighbor_pixels.get_delta(pix, sample, dist) - mu;
-            log_p_sample_ws[i] += ivar * dx*dx;
+        double chi2 = 0.;
+        for(int dist=0; dist<n_dists; dist++) {
+            double dx = neighbor_pixels.get_delta(pix, sample, dist)
+                        - mu_ws[dist];
+            chi2 += neighbor_pixels.get_inv_var(pix, dist) * dx*dx;
         }
         
-        // Last distance
-        mu = cache_data.mu[j];
-        
-        inv_cov_0 = neighbor_pixels.get_inv_cov(n_dists-1, pix, 0);
-        inv_cov_m1 = neighbor_pixels.get_inv_cov(n_dists-2, pix, 0);
-        
-        mu += inv_cov_0 * neighbor_pixels.get_delta(0, sample, n_dists-1)
-              + shift_weight * (
-                    inv_cov_m1
-                    * neighbor_pixels.get_delta(0, sample, n_dists-2)
-                );
-        ivar = neighbor_pixels.get_inv_var(pix, 0);
-
-        // Add to chi^2
-        dx = neighbor_pixels.get_delta(pix, sample, n_dists-1) - mu;
-        log_p_sample_ws[i] += ivar * dx*dx;
-        
-        j++;
-        
-        log_p_sample_ws[i] *= -0.5 * beta;
+        log_p_sample_ws[i] = beta * (
+            -0.5 * chi2 - neighbor_pixels.get_sum_log_dy(pix, sample)
+        );
         
-        // Prior term
-        log_p_sample_ws[i] -= neighbor_pixels.get_prior(pix, sample);
+        // Prior and likelihood terms
+        log_p_sample_ws[i] -=
+            neighbor_pixels.get_prior(pix, sample) +
+            (1.-beta) * neighbor_pixels.get_likelihood(pix, sample);
     }
     
     // Turn chi^2 into probability
@@ -2216,22 +2765,87 @@ int neighbor_gibbs_step_shifted_cached(
         p_sample_ws.begin()+n_samples
     );
     
-    return dd(r);
+    return cache_data.samples[dd(r)];
 }
 
 
-double neighbor_gibbs_step_shifted(
+double neighbor_gibbs_cache_tv_distance(
         const int pix,
+        const NeighborGibbsCacheData& cache_data,
+        const std::vector<double>& log_p_cached,
         TNeighborPixels& neighbor_pixels,
-        std::vector<uint16_t>& neighbor_sample,
-        std::vector<double>& log_p_sample_ws,
-        std::vector<double>& p_sample_ws,
-        std::mt19937& r,
+        const std::vector<uint16_t>& neighbor_sample,
+        std::vector<double>& log_p_ws,
         const double beta,
         const double shift_weight)
 {
-    // Takes a Gibbs step in one of the neighboring pixels, choosing
-    // a sample at random, weighted by the Gaussian process prior.
+    // Total-variation distance between the distribution used by a cached
+    // Gibbs step (with log_p_cached[i] corresponding to
+    // cache_data.samples[i]) and the exact, uncached distribution. Both
+    // drop samples more than 8 below the most probable one, as the
+    // Gibbs steps do.
+    
+    const int n_samples = neighbor_pixels.get_n_samples();
+    const int n_cached = cache_data.samples.size();
+    
+    neighbor_gibbs_log_p_shifted(
+        pix,
+        neighbor_pixels,
+        neighbor_sample,
+        log_p_ws,
+        beta,
+        shift_weight
+    );
+    
+    auto normalize = [](double* lnp, int n) {
+        double lnp_max = *std::max_element(lnp, lnp+n);
+        double p_sum = 0.;
+        for(int i=0; i<n; i++) {
+            double dlnp = lnp[i] - lnp_max;
+            lnp[i] = (dlnp < -8.) ? 0. : std::exp(dlnp);
+            p_sum += lnp[i];
+        }
+        for(int i=0; i<n; i++) {
+            lnp[i] /= p_sum;
+        }
+    };
+    
+    // Exact probabilities (in place)
+    normalize(log_p_ws.data(), n_samples);
+    
+    // Cached probabilities
+    std::vector<double> p_cached(
+        log_p_cached.begin(),
+        log_p_cached.begin()+n_cached
+    );
+    normalize(p_cached.data(), n_cached);
+    
+    double tv = 0.;
+    for(int i=0; i<n_cached; i++) {
+        uint16_t sample = cache_data.samples[i];
+        tv += std::fabs(p_cached[i] - log_p_ws[sample]);
+        log_p_ws[sample] = 0.;
+    }
+    for(int sample=0; sample<n_samples; sample++) {
+        tv += log_p_ws[sample];
+    }
+    
+    return 0.5 * tv;
+}
+
+
+void neighbor_gibbs_log_p_shifted(
+        const int pix,
+        TNeighborPixels& neighbor_pixels,
+        const std::vector<uint16_t>& neighbor_sample,
+        std::vector<double>& log_p_sample_ws,
+        const double beta,
+        const double shift_weight,
+        TNeighborMeanSums* mean_sums)
+{
+    // Calculates the log probability (up to a constant) of each sample
+    // of one of the neighboring pixels, conditional on the samples
+    // chosen in the other pixels.
     
     double mu, ivar, dy, y;
 
@@ -2248,12 +2862,16 @@ double neighbor_gibbs_step_shifted(
         
     for(int dist=0; dist<n_dists; dist++) {
         // Calculate mean, sigma of pixel
-        mu = neighbor_pixels.calc_mean_shifted(
-            pix,
-            dist,
-            neighbor_sample,
-            shift_weight
-        );
+        if(mean_sums) {
+            mu = mean_sums->calc_mean_shifted(pix, dist, shift_weight);
+        } else {
+            mu = neighbor_pixels.calc_mean_shifted(
+                pix,
+                dist,
+                neighbor_sample,
+                shift_weight
+            );
+        }
         ivar = neighbor_pixels.get_inv_var(pix, dist);
         
         //double mu_0 = neighbor_pixels.calc_mean_shifted(
@@ -2303,6 +2921,36 @@ double neighbor_gibbs_step_shifted(
         //    std::cerr << std::endl << std::endl;
         //}
     }
+}
+
+
+double neighbor_gibbs_step_shifted(
+        const int pix,
+        TNeighborPixels& neighbor_pixels,
+        std::vector<uint16_t>& neighbor_sample,
+        std::vector<double>& log_p_sample_ws,
+        std::vector<double>& p_sample_ws,
+        std::mt19937& r,
+        const double beta,
+        const double shift_weight,
+        TNeighborMeanSums* mean_sums)
+{
+    // Takes a Gibbs step in one of the neighboring pixels, choosing
+    // a sample at random, weighted by the Gaussian process prior.
+    
+    int n_samples = neighbor_pixels.get_n_samples();
+
+    const int track_pix = 1;
+
+    neighbor_gibbs_log_p_shifted(
+        pix,
+        neighbor_pixels,
+        neighbor_sample,
+        log_p_sample_ws,
+        beta,
+        shift_weight,
+        mean_sums
+    );
     
     // Turn chi^2 into probability
     //std::cerr << "p_sample.size() = " << p_sample.size() << std::endl;
@@ -2328,6 +2976,10 @@ double neighbor_gibbs_step_shifted(
     int idx = d(r);
     neighbor_sample[pix] = idx;
     
+    if(mean_sums && (idx != idx_old)) {
+        mean_sums->update_pixel(pix, neighbor_sample);
+    }
+    
     // Calculate entropy of distribution
     //if((pix == track_pix) && (beta >= 0.9999)) {
     //if(beta >= 0.9999) {
@@ -2632,21 +3284,23 @@ void TDiscreteLosMcmcParams::update_priors_image(
         const double shift_weight,
         int verbosity)
 {
-    // Evaluate the probability mass for each (reddening jump, distance)
-    img = cv::Mat::zeros(n_E, n_dists, CV_FLOATING_TYPE);
+    // Evaluate the probability mass for each (reddening jump, distance).
+    // The image is reused if it already has the right shape.
+    img.create(n_E, n_dists, CV_FLOATING_TYPE);
 
-    double dE0, dE, P_dist;
+    double P_dist;
     
-    // Cache value of log(dE) for each dE
-    std::vector<double> log_dE_cache;
-    log_dE_cache.reserve(n_E * subsampling);
-    for(int y=0; y<n_E; y++) {
-        dE0 = y * img_stack->rect->dx[0];
-        for(int k=0; k<subsampling; k++) {
-            dE = dE0 + (double)k / (double)subsampling * img_stack->rect->dx[0];
-            log_dE_cache.push_back(std::log(dE));
-        }
+    // Reddening bin y > 0 covers dE in [y, y+1) * dx. Cache the log of
+    // each bin edge.
+    std::vector<double> log_dE_edge;
+    log_dE_edge.reserve(n_E+1);
+    log_dE_edge.push_back(-std::numeric_limits<double>::infinity());
+    for(int y=1; y<=n_E; y++) {
+        log_dE_edge.push_back(std::log(y * img_stack->rect->dx[0]));
     }
+
+    // Upper-tail probability of log(dE) at each bin edge
+    std::vector<double> Q_edge(n_E+1, 0.);
     
     for(int x=0; x<n_dists; x++) {
         // Calculate <log(dE)> and sigma_{log(dE)} at this distance
@@ -2691,22 +3345,30 @@ void TDiscreteLosMcmcParams::update_priors_image(
             P_dist += img.at<floating_t>(0, x);
         }
         
-        // Handle dy > 0
+        // Handle dy > 0. The mass of the log-normal distribution in each
+        // bin is a difference of its CDF at the bin edges. This is the
+        // limit of the sum of exp(-(log dE - mu)^2 / 2 sigma^2) / dE over
+        // <subsampling> points per bin, which was used previously, and
+        // is scaled to match it.
+        double sqrt_ivar_2 = std::sqrt(0.5 * inv_var);
+        for(int y=1; y<=n_E; y++) {
+            Q_edge[y] = 0.5 * std::erfc((log_dE_edge[y] - mu) * sqrt_ivar_2);
+        }
+        double norm = subsampling / img_stack->rect->dx[0]
+                      * SQRT2PI / std::sqrt(inv_var);
         for(int y=1; y<n_E; y++) {
-            dE0 = y * img_stack->rect->dx[0];
-            for(int k=0; k<subsampling; k++) {
-                dE = dE0 + (double)k / (double)subsampling * img_stack->rect->dx[0];
-                double log_dE = log_dE_cache[y*subsampling+k];
-                if(std::isfinite(log_dE)) {//dE > 0) {
-                    double delta = log_dE - mu;
-                    double P_tmp = std::exp(-0.5 * delta*delta * inv_var);
-                    // TODO: Remove alpha_skew parameter & option
-                    //P_tmp *= 1. + erf(alpha_skew * score * INV_SQRT2);
-                    P_tmp /= dE;
-                    img.at<floating_t>(y, x) += P_tmp;
-                }
+            // Lower tail: take the difference of the complementary
+            // upper tails to avoid cancellation
+            double P_bin;
+            if(log_dE_edge[y+1] < mu) {
+                P_bin = 0.5 * (
+                    std::erfc((mu - log_dE_edge[y+1]) * sqrt_ivar_2)
+                  - std::erfc((mu - log_dE_edge[y]) * sqrt_ivar_2)
+                );
+            } else {
+                P_bin = Q_edge[y] - Q_edge[y+1];
             }
-            // P_dy->at<floating_t>(y, x) /= subsampling;
+            img.at<floating_t>(y, x) = norm * P_bin;
             P_dist += img.at<floating_t>(y, x);
         }
 
@@ -2786,13 +3448,18 @@ void TDiscreteLosMcmcParams::los_integral_discrete(
         const int16_t *const y_idx,
         double *const line_int_ret)
 {
+    if(is_packed()) {
+        packed_line_int(y_idx, line_int_ret);
+        return;
+    }
+
     // For each image
     for(int k = 0; k < img_stack->N_images; k++) {
         line_int_ret[k] = 0.;
 
         // For each distance
         for(int j = 0; j < n_dists; j++) {
-            line_int_ret[k] += (double)img_stack->img[k]->at<floating_t>(y_idx[j], j);
+            line_int_ret[k] += (double)img_stack->get(k, y_idx[j], j);
         }
 
         // line_int_ret[k] *= img_stack->rect->dx[1];   // Multiply by dDM
@@ -2816,15 +3483,57 @@ void TDiscreteLosMcmcParams::los_integral_diff_step(
         const int16_t y_idx_new,
         double *const delta_line_int_ret)
 {
+    if(is_packed()) {
+        packed_diff(x_idx, y_idx_new, y_idx_old, delta_line_int_ret);
+        return;
+    }
+
     // For each image
     for(int k=0; k < img_stack->N_images; k++) {
-        delta_line_int_ret[k] = (double)img_stack->img[k]->at<floating_t>(y_idx_new, x_idx)
-                              - (double)img_stack->img[k]->at<floating_t>(y_idx_old, x_idx);
+        delta_line_int_ret[k] = (double)img_stack->get(k, y_idx_new, x_idx)
+                              - (double)img_stack->get(k, y_idx_old, x_idx);
         // delta_line_int_ret[k] *= img_stack->rect->dx[1]; // Multiply by dDM
     }
 }
 
 
+int TDiscreteLosMcmcParams::los_integral_diff_step_active(
+        const int16_t x_idx,
+        const int16_t y_idx_old,
+        const int16_t y_idx_new,
+        int *const star_ret,
+        double *const delta_line_int_ret) const
+{
+    const bool packed = is_packed();
+
+    int n = 0;
+
+    // Only stars with nonzero pixels at the old or new reddening change
+    for(uint32_t i=active_start[x_idx]; i<active_start[x_idx+1]; i++) {
+        bool in_old = (y_idx_old >= active_y_lo[i]) && (y_idx_old <= active_y_hi[i]);
+        bool in_new = (y_idx_new >= active_y_lo[i]) && (y_idx_new <= active_y_hi[i]);
+        if(!(in_old || in_new)) { continue; }
+
+        int k = active_star[i];
+        double delta = 0.;
+        if(in_new) {
+            delta += packed ? packed_value(x_idx, y_idx_new, k)
+                            : (double)img_stack->get(k, y_idx_new, x_idx);
+        }
+        if(in_old) {
+            delta -= packed ? packed_value(x_idx, y_idx_old, k)
+                            : (double)img_stack->get(k, y_idx_old, x_idx);
+        }
+
+        star_ret[n] = k;
+        delta_line_int_ret[n] = delta;
+        n++;
+    }
+
+    return n;
+}
+
+
 floating_t TDiscreteLosMcmcParams::log_dy_prior(
     const int16_t x_idx,
     const int16_t dy,
@@ -2964,15 +3673,37 @@ void TDiscreteLosMcmcParams::los_integral_diff_swap(
     int16_t y_old = y_idx[x0_idx];
     int16_t y_new = y_idx[x0_idx-1] + dy;
 
+    if(is_packed()) {
+        packed_diff(x0_idx, y_new, y_old, delta_line_int_ret);
+        return;
+    }
+
     // For each image
     for(int k = 0; k < img_stack->N_images; k++) {
-        delta_line_int_ret[k] = (double)img_stack->img[k]->at<floating_t>(y_new, x0_idx)
-                              - (double)img_stack->img[k]->at<floating_t>(y_old, x0_idx);
+        delta_line_int_ret[k] = (double)img_stack->get(k, y_new, x0_idx)
+                              - (double)img_stack->get(k, y_old, x0_idx);
         // delta_line_int_ret[k] *= img_stack->rect->dx[1]; // Multiply by dDM
     }
 }
 
 
+int TDiscreteLosMcmcParams::los_integral_diff_swap_active(
+        const int16_t x0_idx,
+        const int16_t *const y_idx,
+        int *const star_ret,
+        double *const delta_line_int_ret) const
+{
+    int16_t dy = y_idx[x0_idx+1] - y_idx[x0_idx];
+    int16_t y_old = y_idx[x0_idx];
+    int16_t y_new = y_idx[x0_idx-1] + dy;
+
+    return los_integral_diff_step_active(
+        x0_idx, y_old, y_new,
+        star_ret, delta_line_int_ret
+    );
+}
+
+
 bool TDiscreteLosMcmcParams::shift_r_step_valid(
         const int16_t x_idx,
         const int16_t dy,
@@ -3021,6 +3752,11 @@ void TDiscreteLosMcmcParams::los_integral_diff_shift_r(
 
     // Determine difference in line integral
 
+    if(is_packed()) {
+        packed_shift_diff(x_idx, n_dists, dy, y_idx_old, delta_line_int_ret);
+        return;
+    }
+
     // For each image
     for(int k=0; k < img_stack->N_images; k++) {
         delta_line_int_ret[k] = 0;
@@ -3028,8 +3764,8 @@ void TDiscreteLosMcmcParams::los_integral_diff_shift_r(
         // For each distance
         for(int j=x_idx; j<n_dists; j++) {
             delta_line_int_ret[k] +=
-                  (double)img_stack->img[k]->at<floating_t>(y_idx_old[j]+dy, j)
-                - (double)img_stack->img[k]->at<floating_t>(y_idx_old[j], j);
+                  (double)img_stack->get(k, y_idx_old[j]+dy, j)
+                - (double)img_stack->get(k, y_idx_old[j], j);
         }
     }
 }
@@ -3040,6 +3776,11 @@ void TDiscreteLosMcmcParams::los_integral_diff_shift_l(
         const int16_t *const y_idx_old,
         double *const delta_line_int_ret) {
     // Determine difference in line integral
+    if(is_packed()) {
+        packed_shift_diff(0, x_idx+1, dy, y_idx_old, delta_line_int_ret);
+        return;
+    }
+
     // For each image
     for(int k=0; k < img_stack->N_images; k++) {
         delta_line_int_ret[k] = 0;
@@ -3047,8 +3788,8 @@ void TDiscreteLosMcmcParams::los_integral_diff_shift_l(
         // For each distance
         for(int j=0; j<=x_idx; j++) {
             delta_line_int_ret[k] +=
-                  (double)img_stack->img[k]->at<floating_t>(y_idx_old[j]+dy, j)
-                - (double)img_stack->img[k]->at<floating_t>(y_idx_old[j], j);
+                  (double)img_stack->get(k, y_idx_old[j]+dy, j)
+                - (double)img_stack->get(k, y_idx_old[j], j);
         }
     }
 }
@@ -3071,6 +3812,154 @@ void TDiscreteLosMcmcParams::los_integral_diff_shift_compare_operations(
 }
 
 
+/*
+ * Shift-proposal partial sums
+ */
+
+TShiftDiffTable::TShiftDiffTable(
+        const TDiscreteLosMcmcParams& _params,
+        int _max_offset)
+    : params(_params), max_offset(_max_offset), n_offsets(2*_max_offset),
+      n_dists(_params.n_dists), n_E(_params.n_E),
+      n_stars(_params.img_stack->N_images)
+{
+    tree.resize((size_t)n_offsets * (n_dists+1) * n_stars, 0.);
+    total.resize((size_t)n_offsets * n_stars, 0.);
+    ws.resize(n_stars, 0.);
+    ws_new.resize(n_stars, 0.);
+}
+
+
+int TShiftDiffTable::offset_idx(int dy) const {
+    // Offsets are stored in the order -max_offset, ..., -1, 1, ..., max_offset
+    return (dy < 0) ? dy + max_offset : dy + max_offset - 1;
+}
+
+
+double* TShiftDiffTable::node(int d, int i) {
+    return tree.data() + ((size_t)d * (n_dists+1) + i) * n_stars;
+}
+
+
+const double* TShiftDiffTable::node(int d, int i) const {
+    return tree.data() + ((size_t)d * (n_dists+1) + i) * n_stars;
+}
+
+
+bool TShiftDiffTable::covers(int dy) const {
+    return (dy != 0) && (dy >= -max_offset) && (dy <= max_offset);
+}
+
+
+void TShiftDiffTable::point_diff(
+        int x, int16_t y, int dy,
+        double *const ret) const
+{
+    // Offsets that leave the image never enter a valid shift proposal
+    if((y+dy < 0) || (y+dy >= n_E)) {
+        std::fill(ret, ret+n_stars, 0.);
+        return;
+    }
+    params.packed_diff(x, y+dy, y, ret);
+}
+
+
+void TShiftDiffTable::prefix_sum(
+        int d, int x,
+        double *const ret) const
+{
+    // Sum over distances 0 through x (inclusive)
+    std::fill(ret, ret+n_stars, 0.);
+    for(int i=x+1; i>0; i-=(i & -i)) {
+        const double *n = node(d, i);
+        #pragma omp simd
+        for(int k=0; k<n_stars; k++) {
+            ret[k] += n[k];
+        }
+    }
+}
+
+
+void TShiftDiffTable::rebuild(const int16_t *const y_idx) {
+    for(int d=0; d<n_offsets; d++) {
+        int dy = (d < max_offset) ? d - max_offset : d - max_offset + 1;
+
+        // Leaves hold the single-distance differences ...
+        for(int i=1; i<=n_dists; i++) {
+            point_diff(i-1, y_idx[i-1], dy, node(d, i));
+        }
+
+        // ... which are then folded up into the tree, in linear time
+        for(int i=1; i<=n_dists; i++) {
+            int parent = i + (i & -i);
+            if(parent <= n_dists) {
+                double *n_p = node(d, parent);
+                const double *n_i = node(d, i);
+                #pragma omp simd
+                for(int k=0; k<n_stars; k++) {
+                    n_p[k] += n_i[k];
+                }
+            }
+        }
+
+        prefix_sum(d, n_dists-1, total.data() + (size_t)d * n_stars);
+    }
+}
+
+
+void TShiftDiffTable::update(int x, int16_t y_old, int16_t y_new) {
+    for(int d=0; d<n_offsets; d++) {
+        int dy = (d < max_offset) ? d - max_offset : d - max_offset + 1;
+
+        // Change in the single-distance difference at x
+        point_diff(x, y_new, dy, ws_new.data());
+        point_diff(x, y_old, dy, ws.data());
+        double *t = total.data() + (size_t)d * n_stars;
+        #pragma omp simd
+        for(int k=0; k<n_stars; k++) {
+            ws[k] = ws_new[k] - ws[k];
+            t[k] += ws[k];
+        }
+
+        for(int i=x+1; i<=n_dists; i+=(i & -i)) {
+            double *n = node(d, i);
+            #pragma omp simd
+            for(int k=0; k<n_stars; k++) {
+                n[k] += ws[k];
+            }
+        }
+    }
+}
+
+
+void TShiftDiffTable::diff_shift_l(
+        int x, int dy,
+        double *const delta_line_int_ret) const
+{
+    // Distances 0 through x are shifted
+    prefix_sum(offset_idx(dy), x, delta_line_int_ret);
+}
+
+
+void TShiftDiffTable::diff_shift_r(
+        int x, int dy,
+        double *const delta_line_int_ret) const
+{
+    // Distances x through n_dists-1 are shifted
+    int d = offset_idx(dy);
+    const double *t = total.data() + (size_t)d * n_stars;
+    if(x == 0) {
+        std::copy(t, t+n_stars, delta_line_int_ret);
+        return;
+    }
+    prefix_sum(d, x-1, delta_line_int_ret);
+    #pragma omp simd
+    for(int k=0; k<n_stars; k++) {
+        delta_line_int_ret[k] = t[k] - delta_line_int_ret[k];
+    }
+}
+
+
 floating_t TDiscreteLosMcmcParams::log_prior_diff_shift_l(
         const int16_t x_idx,
         const int16_t dy,
@@ -3130,7 +4019,7 @@ floating_t TDiscreteLosMcmcParams::log_prior_diff_shift_r(
 
 
 void TDiscreteLosMcmcParams::guess_EBV_profile_discrete(int16_t *const y_idx_ret, gsl_rng *r) {
-    double EBV_max_guess = guess_EBV_max(*img_stack) * (0.8 + 0.4 * gsl_rng_uniform(r));
+    double EBV_max_guess = EBV_guess_max * (0.8 + 0.4 * gsl_rng_uniform(r));
 
     int n_x = n_dists; //img_stack->rect->N_bins[1];
     int n_y = n_E; //img_stack->rect->N_bins[0];
@@ -3150,6 +4039,8 @@ void TDiscreteLosMcmcParams::guess_EBV_profile_discrete(int16_t *const y_idx_ret
 
         if(y_idx_ret[i] >= n_y) {
             y_idx_ret[i] = (int16_t)(n_y - 1);
+        } else if(y_idx_ret[i] < 0) {
+            y_idx_ret[i] = 0;
         }
     }
 
@@ -3425,6 +4316,96 @@ bool discrete_proposal_valid(
 }
 
 
+// Branch-free natural logarithm, for use inside vectorized loops.
+// The mantissa is reduced to [1/sqrt(2), sqrt(2)), and log(m) is
+// evaluated as 2 atanh(s), with s = (m-1)/(m+1) and |s| < 0.1716,
+// truncating the series after the s^13 term. The absolute error is
+// below 1e-12 over the whole range of normal doubles (about 1e-16 for
+// x near 1). Non-positive inputs are clamped to the
+// smallest normal double, giving a log of about -708.
+#pragma omp declare simd
+static inline double log_branchless(double x) {
+    x = std::max(x, std::numeric_limits<double>::min());
+
+    uint64_t bits;
+    std::memcpy(&bits, &x, sizeof(bits));
+    double e = (double)((int64_t)(bits >> 52) - 1023);
+    bits = (bits & 0x000fffffffffffffULL) | 0x3ff0000000000000ULL;
+    double m;
+    std::memcpy(&m, &bits, sizeof(m));
+
+    // Move m from [1, 2) to [1/sqrt(2), sqrt(2))
+    const bool high = (m > 1.4142135623730951);
+    m = high ? 0.5 * m : m;
+    e = high ? e + 1. : e;
+
+    double s = (m - 1.) / (m + 1.);
+    double s2 = s * s;
+    double p = 1./13.;
+    p = p * s2 + 1./11.;
+    p = p * s2 + 1./9.;
+    p = p * s2 + 1./7.;
+    p = p * s2 + 1./5.;
+    p = p * s2 + 1./3.;
+    p = p * s2 + 1.;
+
+    return 2. * s * p + e * 0.6931471805599453;
+}
+
+
+// Star counts above which the log-likelihood difference is split
+// across threads. This only happens when the temperatures are stepped
+// serially: inside the per-temperature parallel region, each temperature
+// already has its own thread, and the star loop is only vectorized.
+const int DLOGL_THREADING_THRESHOLD = 4096;
+
+// Change in log-likelihood when the line integral of each star changes
+// from <line_int> to <line_int> + <delta_line_int>. The proposed line
+// integrals are written to <line_int_prop> in the same pass, so that an
+// accepted proposal only needs to swap buffers.
+double discrete_delta_logL(
+        const double *const line_int,
+        const double *const delta_line_int,
+        double *const line_int_prop,
+        int n_stars,
+        double epsilon)
+{
+    double dlogL = 0.;
+
+    #pragma omp parallel for simd reduction(+:dlogL) schedule(static) \
+                             if((n_stars >= DLOGL_THREADING_THRESHOLD) && !omp_in_parallel())
+    for(int k = 0; k < n_stars; k++) {
+        double zeta = delta_line_int[k] / (line_int[k] + epsilon);
+        line_int_prop[k] = line_int[k] + delta_line_int[k];
+        dlogL += log_branchless(1.0 + zeta);
+    }
+
+    return dlogL;
+}
+
+
+// As discrete_delta_logL, for the <n_active> stars listed in <star_idx>,
+// with changes <delta_line_int> (one per listed star). The line integrals
+// of the other stars are unchanged.
+double discrete_delta_logL_active(
+        const double *const line_int,
+        const int *const star_idx,
+        const double *const delta_line_int,
+        int n_active,
+        double epsilon)
+{
+    double dlogL = 0.;
+
+    #pragma omp simd reduction(+:dlogL)
+    for(int i = 0; i < n_active; i++) {
+        double zeta = delta_line_int[i] / (line_int[star_idx[i]] + epsilon);
+        dlogL += log_branchless(1.0 + zeta);
+    }
+
+    return dlogL;
+}
+
+
 void sample_los_extinction_discrete(
         const std::string& out_fname,
         const std::string& group_name,
@@ -3448,6 +4429,39 @@ void sample_los_extinction_discrete(
     int n_y = params.img_stack->rect->N_bins[0];    // # of reddening pixels
     int n_stars = params.img_stack->N_images;       // # of stars
 
+    // Index the stars that contribute to each distance column, so that
+    // step and swap proposals only touch those stars
+    if(s.active_star_index && params.active_start.empty()) {
+        params.build_active_index(s.active_star_threshold);
+        if(verbosity >= 2) {
+            std::cerr << "Active-star index: "
+                      << (double)params.active_star.size() / (double)n_x
+                      << " of " << n_stars
+                      << " stars per distance column, on average."
+                      << std::endl;
+        }
+    }
+
+    // Pack the images star-major, for the line-integral kernels. Sparse
+    // images are not packed, as that would make them dense again.
+    if(s.pack_images && !params.is_packed()
+                     && !params.img_stack->is_sparse()) {
+        if(params.pack_images(s.pack_bits)) {
+            // The 8-bit errors are always reported, as that mode has
+            // not been validated on real data
+            if(params.packed_bits < 32) {
+                params.check_packed_accuracy(
+                    10,
+                    (params.packed_bits == 8) ? std::max(verbosity, 1) : verbosity
+                );
+            }
+            // Every kernel now reads the packed copy
+            if(s.release_float_images) {
+                params.img_stack->release_pixels();
+            }
+        }
+    }
+
     //
     // Derived sampling parameters
     //
@@ -3486,6 +4500,19 @@ void sample_los_extinction_discrete(
     gsl_rng *r;
     seed_gsl_rng(&r);
     
+    // The temperatures are advanced concurrently between swaps, one
+    // thread per temperature. Each temperature draws from its own
+    // random-number streams, which are seeded from the master streams.
+    int n_temp_threads = std::min((int)s.n_temperatures, omp_get_max_threads());
+    std::vector<gsl_rng*> r_temp(s.n_temperatures, nullptr);
+    std::vector<std::mt19937> r_temp_mt;
+    r_temp_mt.reserve(s.n_temperatures);
+    for(int t=0; t<s.n_temperatures; t++) {
+        r_temp.at(t) = gsl_rng_alloc(gsl_rng_taus);
+        gsl_rng_set(r_temp.at(t), gsl_rng_get(r));
+        r_temp_mt.emplace_back(params.r());
+    }
+    
     // Temperature ladder
     std::vector<double> beta;
     beta.reserve(s.n_temperatures);
@@ -3526,22 +4553,37 @@ void sample_los_extinction_discrete(
     std::vector<double> log_p(s.n_temperatures, 0.);
     std::vector<double> logPr(s.n_temperatures, 0.);
     std::vector<double> logL(s.n_temperatures, 0.);
-    double dlog_p;
     //double log_p = 0;
     //double logL = 0;
     //double logPr = 0;
-    double ln_proposal_factor = 0;
     
     //
     // Temporary variables for line integrals, etc.
     //
     std::vector<std::unique_ptr<std::vector<double>>> line_int;
-    std::vector<double> delta_line_int(n_stars, 0.);
+    // Line integrals of the proposed state, swapped into <line_int>
+    // when a proposal is accepted
+    std::vector<std::unique_ptr<std::vector<double>>> line_int_prop;
+    // One workspace per temperature, as temperatures run concurrently
+    std::vector<std::vector<double>> delta_line_int(
+        s.n_temperatures,
+        std::vector<double>(n_stars, 0.)
+    );
+    // Stars listed in delta_line_int, for proposals that use the
+    // active-star index
+    std::vector<std::vector<int>> active_star_ws(
+        s.n_temperatures,
+        std::vector<int>(n_stars, 0)
+    );
     line_int.reserve(s.n_temperatures);
+    line_int_prop.reserve(s.n_temperatures);
     for(int t=0; t<s.n_temperatures; t++) {
         line_int.push_back(
             std::make_unique<std::vector<double>>(n_stars, 0.)
         );
+        line_int_prop.push_back(
+            std::make_unique<std::vector<double>>(n_stars, 0.)
+        );
     }
     std::vector<double> line_int_test(n_stars, 0.);
     //std::vector<double> line_int_test_old(n_stars, 0.);
@@ -3610,6 +4652,29 @@ void sample_los_extinction_discrete(
         }
     }
 
+    // Partial sums used to evaluate small shift proposals
+    std::vector<std::unique_ptr<TShiftDiffTable>> shift_table(s.n_temperatures);
+    if((s.shift_table_max_offset > 0) && params.is_packed()) {
+        for(int t=0; t<s.n_temperatures; t++) {
+            shift_table.at(t) = std::make_unique<TShiftDiffTable>(
+                params,
+                s.shift_table_max_offset
+            );
+            shift_table.at(t)->rebuild(y_idx.at(t)->data());
+        }
+        if(verbosity >= 2) {
+            std::cerr << "Shift-proposal tables: "
+                      << (double)(2 * s.shift_table_max_offset)
+                         * (n_x+1) * n_stars * sizeof(double)
+                         * s.n_temperatures / (1024.*1024.)
+                      << " MB" << std::endl;
+        }
+    }
+    int64_t n_shift_table_lookups = 0;
+    int64_t n_shift_table_rebuilds = 0; // Full rebuilds after accepted shifts
+    int64_t n_active_index_lookups = 0; // Proposals using active-star index
+    int64_t n_active_stars_touched = 0; // Stars evaluated by those proposals
+
     // params.los_integral_discrete(y_idx, line_int_test_old);
 
     // for(int k = 0; k < n_x; k++) {
@@ -3728,13 +4793,36 @@ void sample_los_extinction_discrete(
     neighbor_idx.reserve(s.n_temperatures);
     // log(prior) of neighboring pixel combination
     std::vector<double> logPr_neighbor(s.n_temperatures, 0.);
-    // Sampling order for neighboring pixels. Will be shuffled.
-    std::vector<int> neighbor_gibbs_order;
-    // Workspaces used during neighbor pixel sampling
-    std::vector<double> log_p_sample_ws;
-    std::vector<double> p_sample_ws;
-    std::vector<double> mu_ws;
-    // # of samples stored in neighboring pixels
+    // Sampling order for neighboring pixels (per temperature).
+    // Will be shuffled.
+    std::vector<std::vector<int>> neighbor_gibbs_order(s.n_temperatures);
+    // Workspaces used during neighbor pixel sampling (per temperature)
+    std::vector<std::vector<double>> log_p_sample_ws(s.n_temperatures);
+    std::vector<std::vector<double>> p_sample_ws(s.n_temperatures);
+    std::vector<std::vector<double>> mu_ws(s.n_temperatures);
+    // Sample slot of the central pixel used by each temperature. The
+    // central pixel's l.o.s. profile is written into <neighbor_pixels>
+    // during the neighbor updates, so concurrent temperatures each need
+    // a slot of their own.
+    std::vector<uint16_t> central_slot(s.n_temperatures, 0);
+    
+    if(params.neighbor_pixels) {
+        if(n_neighbor_samples >= (int)s.n_temperatures) {
+            for(int t=0; t<s.n_temperatures; t++) {
+                central_slot.at(t) = t;
+            }
+        } else {
+            // Not enough slots: temperatures must share slot 0
+            n_temp_threads = 1;
+            if(verbosity >= 1) {
+                std::cerr << "Only " << n_neighbor_samples
+                          << " neighbor samples for "
+                          << s.n_temperatures << " temperatures. "
+                          << "Sampling temperatures serially."
+                          << std::endl;
+            }
+        }
+    }
     
     if(params.neighbor_pixels) {
         for(int t=0; t<s.n_temperatures; t++) {
@@ -3759,15 +4847,16 @@ void sample_los_extinction_discrete(
                     neighbor_idx.at(0)->end(),
                     std::back_inserter(*(neighbor_idx.at(t)))
                 );
+                neighbor_idx.at(t)->at(0) = central_slot.at(t);
+            }
+            
+            log_p_sample_ws.at(t).resize(n_neighbor_samples);
+            p_sample_ws.at(t).resize(n_neighbor_samples);
+            
+            neighbor_gibbs_order.at(t).reserve(n_neighbors-1);
+            for(int n=1; n<n_neighbors; n++) {
+                neighbor_gibbs_order.at(t).push_back(n);
             }
-        }
-        
-        log_p_sample_ws.resize(n_neighbor_samples);
-        p_sample_ws.resize(n_neighbor_samples);
-        
-        neighbor_gibbs_order.reserve(n_neighbors-1);
-        for(int n=1; n<n_neighbors; n++) {
-            neighbor_gibbs_order.push_back(n);
         }
     
     } else { // No neighboring pixels loaded
@@ -3780,6 +4869,20 @@ void sample_los_extinction_discrete(
             );
         }
     }
+    
+    // Running sums for the conditional means of the neighboring pixels,
+    // kept for each temperature's choice of neighbor samples. They are
+    // recomputed from scratch every <mean_sums_refresh> swaps, to
+    // flush out accumulated round-off.
+    std::vector<std::unique_ptr<TNeighborMeanSums>> mean_sums(s.n_temperatures);
+    const int mean_sums_refresh = 100;
+    if(params.neighbor_pixels) {
+        for(int t=0; t<s.n_temperatures; t++) {
+            mean_sums.at(t) = std::make_unique<TNeighborMeanSums>(
+                *(params.neighbor_pixels)
+            );
+        }
+    }
 
     // Priors on dE in central pixel
     std::vector<std::unique_ptr<cv::Mat>> lnP_dy;
@@ -3827,106 +4930,51 @@ void sample_los_extinction_discrete(
     //        << std::endl;
     //
 
-    // Hash to speed up neighbor gibbs steps
-    #define USE_NEIGHBOR_GIBBS_CACHE 0
-    #if USE_NEIGHBOR_GIBBS_CACHE
-    int gibbs_cache_capacity = 5000;
-    std::vector<
-        LRUCache::CachedFunction<
-            std::vector<uint16_t>,
-            std::shared_ptr<NeighborGibbsCacheData>,
-            LRUCache::VectorHasher<uint16_t>
-        >
-    > gibbs_step_cache;
-    
-    int gibbs_step_pix;
-    int disc_distr_res;
-    double lnp_cutoff_cache = -10.;
-    
-    std::vector<
-        std::function<void(std::shared_ptr<NeighborGibbsCacheData>&)>
-    > roll_gibbs_idx;
+    // Cache to speed up neighbor Gibbs steps (one per temperature).
+    // Keyed by the samples chosen in the other neighboring pixels.
+    typedef LRUCache::FlatCachedFunction<
+        std::vector<uint16_t>,
+        std::shared_ptr<NeighborGibbsCacheData>,
+        LRUCache::VectorHasher<uint16_t>
+    > NeighborGibbsCache;
+    std::vector<std::unique_ptr<NeighborGibbsCache>> gibbs_step_cache(
+        s.n_temperatures
+    );
+    // Pixel being stepped in each temperature (read on cache misses)
+    std::vector<int> gibbs_step_pix(s.n_temperatures, 0);
+    // Cache statistics, per temperature
+    std::vector<int64_t> n_gibbs_cache_lookups(s.n_temperatures, 0);
+    std::vector<int64_t> n_gibbs_cache_misses(s.n_temperatures, 0);
+    // Largest total-variation distance between the cached and uncached
+    // Gibbs-step distributions (only if s.gibbs_cache_check is set)
+    std::vector<double> gibbs_cache_tv_max(s.n_temperatures, 0.);
+    std::vector<std::vector<double>> log_p_check_ws(s.n_temperatures);
     
-    if(params.neighbor_pixels) {
-        gibbs_step_cache.reserve(s.n_temperatures);
-        roll_gibbs_idx.reserve(s.n_temperatures);
+    if(params.neighbor_pixels && (s.gibbs_cache_capacity > 0)) {
         for(int t=0; t<s.n_temperatures; t++) {
-            gibbs_step_cache.push_back(
-            LRUCache::CachedFunction<
-                std::vector<uint16_t>,
-                std::shared_ptr<NeighborGibbsCacheData>,
-                LRUCache::VectorHasher<uint16_t>
-            >(
-                [
-                    &gibbs_step_pix,
-                    &neighbor_pixels=*(params.neighbor_pixels),
-                    &log_p_sample_ws,
-                    &p_sample_ws,
-                    &mu_ws,
-                    bt=beta.at(t),
-                    shift_weight_ladder.at(t),
-                    lnp_cutoff_cache
-                ]
-                (const std::vector<uint16_t>& nbor_idx)
+            gibbs_step_cache.at(t) = std::make_unique<NeighborGibbsCache>(
+                [&, t](const std::vector<uint16_t>& nbor_idx)
                 -> std::shared_ptr<NeighborGibbsCacheData>
-            {
-                //uint16_t s_tmp = nbor_samp[step_pix];
-                //nbor_samp[step_pix] = neighbor_pixels.get_n_pix();
-                std::unique_ptr<NeighborGibbsCacheData> cache_entry = 
-                neighbor_gibbs_step_shifted_cache_data(
-                    gibbs_step_pix,
-                    neighbor_pixels,
-                    nbor_idx,
-                    log_p_sample_ws,
-                    p_sample_ws,
-                    mu_ws,
-                    bt,
-                    shift_weight_ladder.at(t),
-                    lnp_cutoff_cache
-                );
-                //nbor_samp[step_pix] = s_tmp;
-                return std::move(cache_entry);
-            },
-            gibbs_cache_capacity,
-            nullptr)
-            );
-            
-            roll_gibbs_idx.push_back(
-                [
-                    &gibbs_step_pix,
-                    &neighbor_pixels=*(params.neighbor_pixels),
-                    &neighbor_idx,
-                    &log_p_sample_ws,
-                    &p_sample_ws,
-                    &mu_ws,
-                    bt=beta.at(t),
-                    shift_weight_ladder.at(t),
-                    lnp_cutoff_cache,
-                    &rr=params.r,
-                    &disc_distr_res,
-                    t
-                ]
-                (std::shared_ptr<NeighborGibbsCacheData>& cache_entry)
-                -> void 
                 {
-                    disc_distr_res = neighbor_gibbs_step_shifted_cached(
-                        gibbs_step_pix,
-                        *cache_entry,
-                        neighbor_pixels,
-                        *(neighbor_idx.at(t)),
-                        log_p_sample_ws,
-                        p_sample_ws,
-                        mu_ws,
-                        bt,
+                    n_gibbs_cache_misses.at(t)++;
+                    return neighbor_gibbs_step_shifted_cache_data(
+                        gibbs_step_pix.at(t),
+                        *(params.neighbor_pixels),
+                        nbor_idx,
+                        log_p_check_ws.at(t),
+                        beta.at(t),
                         shift_weight_ladder.at(t),
-                        lnp_cutoff_cache,
-                        rr
+                        s.gibbs_cache_lnp_cutoff
                     );
-                }
+                },
+                s.gibbs_cache_capacity,
+                nullptr
             );
+            
+            // The cached steps compute their own conditional means
+            mean_sums.at(t).reset();
         }
     }
-    #endif
 
     //int w = 0;
 
@@ -3950,8 +4998,6 @@ void sample_los_extinction_discrete(
     // uint64_t n_eval_cumulative = 0;
     // uint64_t n_shift_steps = 0;
 
-    DiscreteProposal proposal_type;
-
     std::uniform_real_distribution<> uniform_dist(0., 1.0);
     
     auto t_start = std::chrono::steady_clock::now();
@@ -3966,51 +5012,114 @@ void sample_los_extinction_discrete(
         sigma_dy_neg -= (sigma_dy_neg - sigma_dy_neg_target) / tau_decay;
         params.inv_sigma_dy_neg = 1. / sigma_dy_neg;
         
-        // Sample within each temperature
+        // Sample within each temperature. The temperatures are
+        // independent until the swap, which waits for all of them (the
+        // implicit barrier at the end of the loop).
+        #pragma omp parallel for num_threads(n_temp_threads) \
+                                 schedule(static,1) \
+                                 reduction(+:n_proposals[:6], \
+                                             n_proposals_accepted[:6], \
+                                             n_proposals_valid[:6], \
+                                             n_shift_table_lookups, \
+                                             n_shift_table_rebuilds, \
+                                             n_active_index_lookups, \
+                                             n_active_stars_touched)
         for(int t=0; t<s.n_temperatures; t++) {
             int16_t* y_idx_t = y_idx.at(t)->data();
             double* line_int_t = line_int.at(t)->data();
+            double* delta_line_int_t = delta_line_int.at(t).data();
+            int* active_star_t = active_star_ws.at(t).data();
             double& logPr_t = logPr.at(t);
             double& logL_t = logL.at(t);
             double& log_p_t = log_p.at(t);
             cv::Mat& lnP_dy_t = *(lnP_dy.at(t));
             double b = beta.at(t);
+            gsl_rng* r_t = r_temp.at(t);
+            std::mt19937& r_mt_t = r_temp_mt.at(t);
+            TShiftDiffTable* shift_table_t = shift_table.at(t).get();
+            TNeighborMeanSums* mean_sums_t = mean_sums.at(t).get();
+            
+            DiscreteProposal proposal_type;
+            double ln_proposal_factor = 0;
             
             // Loop over update cycles
             for(int u=0; u<s.updates_per_swap; u++) {
                 // Update neighbors
                 if(params.neighbor_pixels) {
                     // Copy in central pixel's l.o.s. reddening profile
-                    params.set_central_delta(y_idx_t);
+                    params.set_central_delta(y_idx_t, central_slot.at(t));
+                    if(mean_sums_t) {
+                        if((u == 0) && (swap % mean_sums_refresh == 0)) {
+                            mean_sums_t->init(*(neighbor_idx.at(t)));
+                        } else {
+                            mean_sums_t->update_pixel(0, *(neighbor_idx.at(t)));
+                        }
+                    }
                     
                     for(int n=0; n<s.neighbor_steps_per_update; n++) {
                         // Randomize Gibbs step order
-                        std::shuffle(neighbor_gibbs_order.begin(),
-                                     neighbor_gibbs_order.end(),
-                                     params.r);
+                        std::shuffle(neighbor_gibbs_order.at(t).begin(),
+                                     neighbor_gibbs_order.at(t).end(),
+                                     r_mt_t);
                         
                         // Take a Gibbs step in each neighbor pixel
-                        for(auto k : neighbor_gibbs_order) {
-                            #if USE_NEIGHBOR_GIBBS_CACHE
-                            neighbor_idx[t]->at(k) = n_neighbor_samples;
-                            gibbs_step_pix = k;
-                            gibbs_step_cache.at(t)(
-                                *(neighbor_idx[t]),
-                                roll_gibbs_idx.at(t)
-                            );
-                            neighbor_idx[t]->at(k) = disc_distr_res;
-                            #else
-                            neighbor_gibbs_step_shifted(
-                                k,
-                                *(params.neighbor_pixels),
-                                *(neighbor_idx[t]),
-                                log_p_sample_ws,
-                                p_sample_ws,
-                                params.r,
-                                b,
-                                shift_weight_ladder.at(t)
-                            );
-                            #endif
+                        for(auto k : neighbor_gibbs_order.at(t)) {
+                            if(gibbs_step_cache.at(t)) {
+                                // The stepped pixel is left out of the key
+                                uint16_t s_old = neighbor_idx[t]->at(k);
+                                neighbor_idx[t]->at(k) = n_neighbor_samples;
+                                gibbs_step_pix.at(t) = k;
+                                n_gibbs_cache_lookups.at(t)++;
+                                std::shared_ptr<NeighborGibbsCacheData>
+                                    cache_entry = (*gibbs_step_cache.at(t))(
+                                        *(neighbor_idx[t])
+                                    );
+                                neighbor_idx[t]->at(k) = s_old;
+                                
+                                int s_new = neighbor_gibbs_step_shifted_cached(
+                                    k,
+                                    *cache_entry,
+                                    *(params.neighbor_pixels),
+                                    *(neighbor_idx[t]),
+                                    log_p_sample_ws.at(t),
+                                    p_sample_ws.at(t),
+                                    mu_ws.at(t),
+                                    b,
+                                    shift_weight_ladder.at(t),
+                                    r_mt_t
+                                );
+                                
+                                if(s.gibbs_cache_check) {
+                                    double tv = neighbor_gibbs_cache_tv_distance(
+                                        k,
+                                        *cache_entry,
+                                        log_p_sample_ws.at(t),
+                                        *(params.neighbor_pixels),
+                                        *(neighbor_idx[t]),
+                                        log_p_check_ws.at(t),
+                                        b,
+                                        shift_weight_ladder.at(t)
+                                    );
+                                    gibbs_cache_tv_max.at(t) = std::max(
+                                        gibbs_cache_tv_max.at(t),
+                                        tv
+                                    );
+                                }
+                                
+                                neighbor_idx[t]->at(k) = s_new;
+                            } else {
+                                neighbor_gibbs_step_shifted(
+                                    k,
+                                    *(params.neighbor_pixels),
+                                    *(neighbor_idx[t]),
+                                    log_p_sample_ws.at(t),
+                                    p_sample_ws.at(t),
+                                    r_mt_t,
+                                    b,
+                                    shift_weight_ladder.at(t),
+                                    mean_sums_t
+                                );
+                            }
                         }
                     }
                     
@@ -4033,31 +5142,31 @@ void sample_los_extinction_discrete(
                     int x_idx, dy, y_idx_new, dy1;
 
                     // Determine what type of proposal to make
-                    proposal_type.roll(r);
+                    proposal_type.roll(r_t);
                     n_proposals[proposal_type.code]++;
                     
                     if(proposal_type.step) {
                         // STEP
-                        discrete_propose_step(r, n_x, x_idx, dy);
+                        discrete_propose_step(r_t, n_x, x_idx, dy);
                         y_idx_new = y_idx_t[x_idx] + dy;
                         //std::cerr << "x_idx = " << x_idx << std::endl;
                         //std::cerr << "dy = " << dy << std::endl;
                         //std::cerr << "y_idx_new = " << y_idx_new << std::endl;
                     } else if(proposal_type.swap) {
                         // SWAP
-                        discrete_propose_swap(r, n_x, x_idx);
+                        discrete_propose_swap(r_t, n_x, x_idx);
                         dy1 = y_idx_t[x_idx+1] - y_idx_t[x_idx];
                         y_idx_new = y_idx_t[x_idx-1] + dy1;
                     } else if(proposal_type.absolute) {
                         // SHIFT_ABS_L_PROPOSAL or SHIFT_ABS_R_PROPOSAL
                         discrete_propose_shift_abs(
-                            r, y_idx_t, n_x,
+                            r_t, y_idx_t, n_x,
                             y_shift_abs_mean, y_shift_abs_max,
                             x_idx, dy, ln_proposal_factor
                         );
                     } else {
                         // SHIFT_L_PROPOSAL or SHIFT_R_PROPOSAL
-                        discrete_propose_shift(r, n_x, x_idx, dy);
+                        discrete_propose_shift(r_t, n_x, x_idx, dy);
                     }
                     
                     
@@ -4077,14 +5186,46 @@ void sample_los_extinction_discrete(
                     double dlogL = 0;
                     double dlogPr, alpha;
 
+                    // Step and swap proposals touch only one distance
+                    // column. If few stars contribute to it, only the
+                    // changes for those stars are computed.
+                    int n_active = -1; // -1: delta_line_int_t is dense
+                    bool use_active = (proposal_type.step || proposal_type.swap)
+                                      && params.use_active_index(x_idx);
+
                     // Calculate difference in line integrals and
                     // prior (between the current and proposed states).
-                    if(proposal_type.step) {
+                    if(proposal_type.step && use_active) {
+                        n_active = params.los_integral_diff_step_active(
+                            x_idx,
+                            y_idx_t[x_idx],
+                            y_idx_new,
+                            active_star_t,
+                            delta_line_int_t
+                        );
+                        dlogPr = params.log_prior_diff_step(
+                            x_idx,
+                            y_idx_t,
+                            y_idx_new,
+                            lnP_dy_t
+                        );
+                    } else if(proposal_type.swap && use_active) {
+                        n_active = params.los_integral_diff_swap_active(
+                            x_idx, y_idx_t,
+                            active_star_t,
+                            delta_line_int_t
+                        );
+                        dlogPr = params.log_prior_diff_swap(
+                            x_idx,
+                            y_idx_t,
+                            lnP_dy_t
+                        );
+                    } else if(proposal_type.step) {
                         params.los_integral_diff_step(
                             x_idx,
                             y_idx_t[x_idx],
                             y_idx_new,
-                            delta_line_int.data()
+                            delta_line_int_t
                         );
                         dlogPr = params.log_prior_diff_step(
                             x_idx,
@@ -4095,7 +5236,7 @@ void sample_los_extinction_discrete(
                     } else if(proposal_type.swap) {
                         params.los_integral_diff_swap(
                             x_idx, y_idx_t,
-                            delta_line_int.data()
+                            delta_line_int_t
                         );
                         dlogPr = params.log_prior_diff_swap(
                             x_idx,
@@ -4114,10 +5255,18 @@ void sample_los_extinction_discrete(
                         if(dlogPr
                            != -std::numeric_limits<double>::infinity())
                         {
-                            params.los_integral_diff_shift_l(
-                                x_idx, dy, y_idx_t,
-                                delta_line_int.data()
-                            );
+                            if(shift_table_t && shift_table_t->covers(dy)) {
+                                shift_table_t->diff_shift_l(
+                                    x_idx, dy,
+                                    delta_line_int_t
+                                );
+                                n_shift_table_lookups++;
+                            } else {
+                                params.los_integral_diff_shift_l(
+                                    x_idx, dy, y_idx_t,
+                                    delta_line_int_t
+                                );
+                            }
                         }
                     } else { // SHIFT_R_PROPOSAL or SHIFT_ABS_R_PROPOSAL
                         dlogPr = params.log_prior_diff_shift_r(
@@ -4131,30 +5280,44 @@ void sample_los_extinction_discrete(
                         if(dlogPr
                            != -std::numeric_limits<double>::infinity())
                         {
-                            params.los_integral_diff_shift_r(
-                                x_idx, dy, y_idx_t,
-                                delta_line_int.data()
-                            );
+                            if(shift_table_t && shift_table_t->covers(dy)) {
+                                shift_table_t->diff_shift_r(
+                                    x_idx, dy,
+                                    delta_line_int_t
+                                );
+                                n_shift_table_lookups++;
+                            } else {
+                                params.los_integral_diff_shift_r(
+                                    x_idx, dy, y_idx_t,
+                                    delta_line_int_t
+                                );
+                            }
                         }
                     }
                     
                     //std::cerr << "dlogPr = " << dlogPr << std::endl;
                     
                     // Change in likelihood
-                    if(dlogPr != -std::numeric_limits<double>::infinity()) {
-                        for(int k = 0; k < n_stars; k++) {
-                            double zeta = delta_line_int[k]
-                                          / (line_int_t[k]+epsilon);
-                            if(std::fabs(zeta) < 1.e-2) {
-                                // Taylor expansion of ln(1+zeta)
-                                // for zeta << 1.
-                                dlogL += zeta
-                                         - 0.5 * zeta*zeta
-                                         + 0.33333333*zeta*zeta*zeta;
-                            } else {
-                                dlogL += std::log(1.0 + zeta);
-                            }
+                    if(n_active >= 0) {
+                        n_active_index_lookups++;
+                        n_active_stars_touched += n_active;
+                        if(dlogPr != -std::numeric_limits<double>::infinity()) {
+                            dlogL = discrete_delta_logL_active(
+                                line_int_t,
+                                active_star_t,
+                                delta_line_int_t,
+                                n_active,
+                                epsilon
+                            );
                         }
+                    } else if(dlogPr != -std::numeric_limits<double>::infinity()) {
+                        dlogL = discrete_delta_logL(
+                            line_int_t,
+                            delta_line_int_t,
+                            line_int_prop.at(t)->data(),
+                            n_stars,
+                            epsilon
+                        );
                         
                         //std::cerr << "dlogL = " << dlogL << std::endl;
                     }
@@ -4173,7 +5336,7 @@ void sample_los_extinction_discrete(
                     if((alpha > 0) // > 0 means automatic acceptance
                        || (
                             (alpha > -10.) && // Treat ln(-10) as zero
-                            (std::exp(alpha) > gsl_rng_uniform(r))
+                            (std::exp(alpha) > gsl_rng_uniform(r_t))
                           ))
                     {
                         // ACCEPT
@@ -4182,6 +5345,13 @@ void sample_los_extinction_discrete(
                         // Update state to proposal
                         if(!proposal_type.shift) {
                             // STEP_PROPOSAL or SWAP_PROPOSAL
+                            if(shift_table_t) {
+                                shift_table_t->update(
+                                    x_idx,
+                                    y_idx_t[x_idx],
+                                    y_idx_new
+                                );
+                            }
                             y_idx_t[x_idx] = y_idx_new;
                         } else if(proposal_type.left) {
                             for(int j=0; j<=x_idx; j++) {
@@ -4192,10 +5362,27 @@ void sample_los_extinction_discrete(
                                 y_idx_t[j] += dy;
                             }
                         }
+                        
+                        // A shift moves many distances at once, so the
+                        // partial sums are recomputed from scratch. This
+                        // costs about as much as evaluating a shift
+                        // directly, so the tables only pay off while
+                        // shifts are rarely accepted (see the counts
+                        // printed at the end of the run).
+                        if(shift_table_t && proposal_type.shift) {
+                            shift_table_t->rebuild(y_idx_t);
+                            n_shift_table_rebuilds++;
+                        }
 
-                        // Update line integrals
-                        for(int k = 0; k < n_stars; k++) {
-                            line_int_t[k] += delta_line_int[k];
+                        // Update line integrals (already computed
+                        // for the proposal, if dense)
+                        if(n_active >= 0) {
+                            for(int i=0; i<n_active; i++) {
+                                line_int_t[active_star_t[i]] += delta_line_int_t[i];
+                            }
+                        } else {
+                            line_int.at(t).swap(line_int_prop.at(t));
+                            line_int_t = line_int.at(t)->data();
                         }
 
                         // Calculate line integrals exactly every
@@ -4206,6 +5393,9 @@ void sample_los_extinction_discrete(
                                 y_idx_t,
                                 line_int_t
                             );
+                            if(shift_table_t && !proposal_type.shift) {
+                                shift_table_t->rebuild(y_idx_t);
+                            }
                         }
 
                         // Update prior & likelihood
@@ -4266,9 +5456,10 @@ void sample_los_extinction_discrete(
             
             discrete_los_ascii_art(
                 n_x, n_y, y_idx_t,
-                40, 700,
+                40, n_y,
                 params.img_stack->rect->dx[0],
-                4., 19.,
+                params.img_stack->rect->min[1],
+                params.img_stack->rect->max[1],
                 std::cerr);
             std::cerr << std::endl;
 
@@ -4354,7 +5545,10 @@ void sample_los_extinction_discrete(
             double logPr_x1s0, logPr_x0s1;
             
             if(params.neighbor_pixels) {
-                params.set_central_delta(y_idx.at(t1)->data());
+                params.set_central_delta(
+                    y_idx.at(t1)->data(),
+                    central_slot.at(t1)
+                );
                 logPr_x1s1 = params.neighbor_pixels->calc_lnprob_shifted(
                     *(neighbor_idx.at(t1)),
                     shift_weight_ladder.at(t1),
@@ -4366,7 +5560,10 @@ void sample_los_extinction_discrete(
                     false
                 );
                 
-                params.set_central_delta(y_idx.at(t0)->data());
+                params.set_central_delta(
+                    y_idx.at(t0)->data(),
+                    central_slot.at(t0)
+                );
                 logPr_x0s0 = params.neighbor_pixels->calc_lnprob_shifted(
                     *(neighbor_idx.at(t0)),
                     shift_weight_ladder.at(t0),
@@ -4452,9 +5649,17 @@ void sample_los_extinction_discrete(
                 // Swap all the relevant pointers
                 y_idx.at(t1).swap(y_idx.at(t0));
                 line_int.at(t1).swap(line_int.at(t0));
+                shift_table.at(t1).swap(shift_table.at(t0));
                 neighbor_idx.at(t1).swap(neighbor_idx.at(t0));
+                mean_sums.at(t1).swap(mean_sums.at(t0));
                 lnP_dy.at(t1).swap(lnP_dy.at(t0));
                 
+                // The central-pixel slots stay with their temperatures
+                std::swap(
+                    neighbor_idx.at(t1)->at(0),
+                    neighbor_idx.at(t0)->at(0)
+                );
+                
                 // Swap all the relevant values
                 std::swap(logL.at(t1), logL.at(t0));
                 logPr.at(t1) = logPr_x0s1;
@@ -4938,6 +6143,43 @@ void sample_los_extinction_discrete(
                       << std::endl;
         }
         
+        if(shift_table.at(0)) {
+            std::cerr << n_shift_table_lookups
+                      << " shift proposals evaluated from partial sums, "
+                      << n_shift_table_rebuilds
+                      << " partial-sum rebuilds after accepted shifts."
+                      << std::endl;
+        }
+        
+        if(n_active_index_lookups > 0) {
+            std::cerr << n_active_index_lookups
+                      << " step/swap proposals used the active-star index, "
+                      << "touching "
+                      << (double)n_active_stars_touched
+                         / (double)n_active_index_lookups
+                      << " of " << n_stars << " stars on average."
+                      << std::endl;
+        }
+        
+        if(gibbs_step_cache.at(0)) {
+            std::cerr << "Neighbor Gibbs cache hit rate:";
+            for(int t=0; t<s.n_temperatures; t++) {
+                double p_hit = 1. - (double)n_gibbs_cache_misses.at(t)
+                                    / (double)n_gibbs_cache_lookups.at(t);
+                std::cerr << " " << 100. * p_hit << "%";
+            }
+            std::cerr << std::endl;
+            
+            if(s.gibbs_cache_check) {
+                std::cerr << "Max. total-variation distance between "
+                          << "cached and uncached Gibbs steps:";
+                for(int t=0; t<s.n_temperatures; t++) {
+                    std::cerr << " " << gibbs_cache_tv_max.at(t);
+                }
+                std::cerr << std::endl;
+            }
+        }
+        
         std::cerr << "Swap acceptance:";
         for(int t=0; t<s.n_temperatures-1; t++) {
             double p_accept = (double)n_swaps_accepted.at(t)
@@ -5114,6 +6356,13 @@ void sample_los_extinction_discrete(
         "DM_max",
         dm_max
     );
+    // Reddening (in mag) per pixel, which can differ between sightlines
+    H5Utils::add_watermark<double>(
+        out_fname,
+        dset_name.str(),
+        "dE",
+        params.img_stack->rect->dx[0]
+    );
     
     auto t_end = std::chrono::steady_clock::now();
     std::chrono::duration<double> t_runtime = t_end - t_start;
@@ -5124,6 +6373,9 @@ void sample_los_extinction_discrete(
         t_runtime.count()
     );
 
+    for(auto r_t : r_temp) {
+        gsl_rng_free(r_t);
+    }
     gsl_rng_free(r);
 }
 
@@ -5258,7 +6510,7 @@ void sample_neighbors_pt(
     uint64_t cache_capacity = 10000;
     int step_pix;
     std::vector<
-        LRUCache::CachedFunction<
+        LRUCache::FlatCachedFunction<
             std::vector<uint16_t>,
             std::shared_ptr<std::discrete_distribution<int>>,
             LRUCache::VectorHasher<uint16_t>
@@ -5267,7 +6519,7 @@ void sample_neighbors_pt(
     gibbs_step_cache.reserve(n_temperatures);
     for(int t=0; t<n_temperatures; t++) {
         gibbs_step_cache.push_back(
-        LRUCache::CachedFunction<
+        LRUCache::FlatCachedFunction<
             std::vector<uint16_t>,
             std::shared_ptr<std::discrete_distribution<int>>,
             LRUCache::VectorHasher<uint16_t>
@@ -5312,7 +6564,7 @@ void sample_neighbors_pt(
     };
 
     // ln(p) cache
-    LRUCache::CachedFunction<
+    LRUCache::FlatCachedFunction<
         std::vector<uint16_t>,
         double,
         LRUCache::VectorHasher<uint16_t>
@@ -5560,15 +6812,17 @@ void sample_neighbors(
         sampler.step();
     }
 
-    //for(auto it=sampler.cbegin(); it != sampler.cend(); ++it) {
-    //    for(auto s : it->first) {
-    //        if(s == neighbors.get_n_samples()) {
+    //const bridgesamp::NodeStore& nodes = sampler.get_nodes();
+    //for(bridgesamp::NodeStore::index_t i=0; i<nodes.size(); i++) {
+    //    const uint16_t* key = nodes.key(i);
+    //    for(int k=0; k<sampler.get_n_dim(); k++) {
+    //        if(key[k] == neighbors.get_n_samples()) {
     //            std::cerr << "- ";
     //        } else {
-    //            std::cerr << s << " ";
+    //            std::cerr << key[k] << " ";
     //        }
     //    }
-    //    std::cerr << ": " << it->second.logp << std::endl;
+    //    std::cerr << ": " << nodes.node(i).logp << std::endl;
     //}
 
     std::map<std::vector<uint16_t>, uint32_t> n_visits;
@@ -5624,8 +6878,11 @@ TImgStack::TImgStack(size_t _N_images) {
 TImgStack::TImgStack(size_t _N_images, TRect& _rect) {
     N_images = _N_images;
     img = new cv::Mat*[N_images];
-    for(size_t i=0; i<N_images; i++) { img[i] = NULL; }
+    for(size_t i=0; i<N_images; i++) {
+        img[i] = new cv::Mat;
+    }
     rect = new TRect(_rect);
+    alloc_arena();
 }
 
 TImgStack::~TImgStack() {
@@ -5656,9 +6913,137 @@ void TImgStack::resize(size_t _N_images) {
     for(size_t i=0; i<N_images; i++) {
         img[i] = new cv::Mat;
     }
+
+    if(rect != NULL) {
+        alloc_arena();
+    } else {
+        arena.release();
+    }
+}
+
+void TImgStack::alloc_arena() {
+    assert(rect != NULL);
+
+    const int n_rows = rect->N_bins[0];
+    const int n_cols = rect->N_bins[1];
+    const int n_pix = n_rows * n_cols;
+
+    // Pad each image, so that every image starts on a 64-byte boundary
+    const int pad = 64 / sizeof(floating_t);
+    const int n_pix_padded = ((n_pix + pad - 1) / pad) * pad;
+
+    arena = cv::Mat::zeros(N_images, n_pix_padded, CV_FLOATING_TYPE);
+    bbox.clear();
+
+    // Each image is a (reference-counted) view of one row of the arena
+    for(size_t i=0; i<N_images; i++) {
+        if(img[i] == NULL) {
+            img[i] = new cv::Mat;
+        }
+        *(img[i]) = arena.row(i).colRange(0, n_pix).reshape(0, n_rows);
+    }
+}
+
+void TImgStack::alloc_sparse_arena(const std::vector<cv::Rect>& _bbox) {
+    assert(_bbox.size() == N_images);
+
+    // Pad each image, so that every image starts on a 64-byte boundary
+    const size_t pad = 64 / sizeof(floating_t);
+    std::vector<size_t> offset(N_images+1, 0);
+    for(size_t i=0; i<N_images; i++) {
+        size_t n_pix = (size_t)_bbox[i].width * _bbox[i].height;
+        offset[i+1] = offset[i] + ((n_pix + pad - 1) / pad) * pad;
+    }
+
+    arena = cv::Mat::zeros(1, std::max(offset[N_images], pad), CV_FLOATING_TYPE);
+    bbox = _bbox;
+
+    for(size_t i=0; i<N_images; i++) {
+        if(img[i] == NULL) {
+            img[i] = new cv::Mat;
+        }
+        if(bbox[i].area() == 0) {
+            // Empty image (all pixels zero)
+            img[i]->release();
+            continue;
+        }
+        size_t n_pix = (size_t)bbox[i].width * bbox[i].height;
+        *(img[i]) = arena.colRange(offset[i], offset[i] + n_pix)
+                         .reshape(0, bbox[i].height);
+    }
+}
+
+// Bounding box of the pixels that are greater than the threshold
+static cv::Rect nonzero_bbox(const cv::Mat& img, floating_t threshold) {
+    int r0 = img.rows, r1 = -1;
+    int c0 = img.cols, c1 = -1;
+
+    for(int r=0; r<img.rows; r++) {
+        const floating_t *row = img.ptr<floating_t>(r);
+        int c_first = -1, c_last = -1;
+        for(int c=0; c<img.cols; c++) {
+            if(row[c] > threshold) {
+                if(c_first < 0) { c_first = c; }
+                c_last = c;
+            }
+        }
+        if(c_first >= 0) {
+            r0 = std::min(r0, r);
+            r1 = r;
+            c0 = std::min(c0, c_first);
+            c1 = std::max(c1, c_last);
+        }
+    }
+
+    if(r1 < 0) {
+        return cv::Rect(0, 0, 0, 0);
+    }
+    return cv::Rect(c0, r0, c1-c0+1, r1-r0+1);
+}
+
+void TImgStack::release_pixels() {
+    for(size_t i=0; i<N_images; i++) {
+        if(img[i] != NULL) { img[i]->release(); }
+    }
+    arena.release();
+    bbox.clear();
+}
+
+void TImgStack::compact(floating_t threshold) {
+    assert(rect != NULL);
+    if(is_sparse()) { return; }
+
+    std::vector<cv::Rect> new_bbox(N_images);
+    size_t n_pix_dense = 0;
+    size_t n_pix_sparse = 0;
+    for(size_t i=0; i<N_images; i++) {
+        new_bbox[i] = nonzero_bbox(*(img[i]), threshold);
+        n_pix_dense += img[i]->total();
+        n_pix_sparse += new_bbox[i].area();
+    }
+
+    // Keep the dense images alive until they have been copied
+    std::vector<cv::Mat> dense(N_images);
+    for(size_t i=0; i<N_images; i++) {
+        dense[i] = *(img[i]);
+    }
+
+    alloc_sparse_arena(new_bbox);
+
+    for(size_t i=0; i<N_images; i++) {
+        if(bbox[i].area() != 0) {
+            dense[i](bbox[i]).copyTo(*(img[i]));
+        }
+    }
+
+    std::cerr << "Compacted images to "
+              << 100. * (double)n_pix_sparse / (double)std::max(n_pix_dense, (size_t)1)
+              << "% of their original size." << std::endl;
 }
 
 void TImgStack::cull(const std::vector<bool> &keep) {
+    // Only the image headers are removed. The images that are kept
+    // remain views into the arena, which is not shrunk.
     assert(keep.size() == N_images);
 
     size_t N_tmp = 0;
@@ -5681,11 +7066,21 @@ void TImgStack::cull(const std::vector<bool> &keep) {
     delete[] img;
     img = img_tmp;
     N_images = N_tmp;
+
+    if(is_sparse()) {
+        std::vector<cv::Rect> bbox_tmp;
+        bbox_tmp.reserve(N_tmp);
+        for(size_t j=0; j<keep.size(); j++) {
+            if(keep[j]) { bbox_tmp.push_back(bbox[j]); }
+        }
+        bbox.swap(bbox_tmp);
+    }
 }
 
 void TImgStack::crop(double x_min, double x_max, double y_min, double y_max) {
     assert(x_min < x_max);
     assert(y_min < y_max);
+    assert(!is_sparse()); // Crop before compacting
 
     uint32_t x0, x1, y0, y1;
 
@@ -5749,11 +7144,23 @@ void TImgStack::set_rect(TRect& _rect) {
         delete rect;
     }
     rect = new TRect(_rect);
+
+    // (Re)allocate the images, with the new dimensions
+    alloc_arena();
 }
 
 void TImgStack::stack(cv::Mat& dest) {
-    if(N_images > 0) {
-        dest = *(img[0]);
+    if(is_sparse()) {
+        dest = cv::Mat::zeros(rect->N_bins[0], rect->N_bins[1], CV_FLOATING_TYPE);
+        for(size_t i=0; i<N_images; i++) {
+            if(bbox[i].area() != 0) {
+                cv::Mat dest_roi = dest(bbox[i]);
+                dest_roi += *(img[i]);
+            }
+        }
+    } else if(N_images > 0 && !img[0]->empty()) {
+        // Copy, so that the sum does not accumulate into the first image
+        dest = img[0]->clone();
         for(size_t i=1; i<N_images; i++) {
             dest += *(img[i]);
         }
@@ -5763,11 +7170,14 @@ void TImgStack::stack(cv::Mat& dest) {
 }
 
 bool TImgStack::initialize_to_zero(unsigned int img_idx) {
-    if(img_idx > N_images) { return false; }
+    if(img_idx >= N_images) { return false; }
     if(rect == NULL) { return false; }
+    if(is_sparse()) { return false; }
     if(img[img_idx] == NULL) {
         img[img_idx] = new cv::Mat;
     }
+    // Zeroes the image in place if it already has the right shape (as
+    // images in the arena do). Otherwise, allocates a new image.
     *(img[img_idx]) = cv::Mat::zeros(rect->N_bins[0], rect->N_bins[1], CV_FLOATING_TYPE);
     return true;
 }
@@ -5777,89 +7187,125 @@ void TImgStack::smooth(std::vector<double> sigma, double n_sigma) {
     const int N_rows = rect->N_bins[0];
     const int N_cols = rect->N_bins[1];
 
+    assert(!is_sparse()); // Smooth before compacting
+
     assert(sigma.size() == N_rows);
     assert(n_sigma > 0);
 
-    // Source and destination rows for convolution
-    floating_t *src_img_row_up, *src_img_row_down, *dest_img_row;
-    int src_row_idx_up, src_row_idx_down;
-
-    // Weight applied to each row
-    floating_t *dc = new floating_t[N_rows];
-    floating_t a, c;
+    // The kernel depends only on the destination row, and is the same
+    // for every image, so build it once, as a banded operator in
+    // compressed-row form. Source rows that fall off either edge of the
+    // image are clamped to the edge row, and their weights are folded
+    // into a single entry.
+    std::vector<int> row_start(N_rows+1);
+    std::vector<int> src_row;
+    std::vector<floating_t> weight;
+    src_row.reserve(N_rows);
+    weight.reserve(N_rows);
+
+    // Weight applied to each row offset
+    std::vector<double> dc(N_rows);
+    double a, c;
 
     // Number of times to shift image (= sigma * n_sigma)
     int m_max;
 
-    // Loop over images
-    for(int i=0; i<N_images; i++) {
-        // Skip uninitialized images (nothing to smooth)
-        if(img[i] == NULL) {
-            continue;
+    for(int dest_row_idx=0; dest_row_idx<N_rows; dest_row_idx++) {
+        // Determine kernel width (based on sigma at destination)
+        m_max = int(ceil(sigma[dest_row_idx] * n_sigma));
+        if(m_max > N_rows) { m_max = N_rows; }
+
+        // Determine weight to apply to each source row
+        a = -0.5 / (sigma[dest_row_idx]*sigma[dest_row_idx]);
+        c = 1.;
+
+        for(int m=1; m<m_max; m++) {
+            dc[m] = exp(a * (double)(m*m));
+            c += 2. * dc[m];
         }
-        
-        // Create copy of image
-        cv::Mat *img_s = new cv::Mat(img[i]->clone());
-
-        // Loop over destination rows
-        for(int dest_row_idx=0; dest_row_idx<N_rows; dest_row_idx++) {
-            // Determine kernel width (based on sigma at destination)
-            m_max = int(ceil(sigma[dest_row_idx] * n_sigma));
-            if(m_max > N_rows) { m_max = N_rows; }
-
-            // Determine weight to apply to each source pixel
-            a = -0.5 / (sigma[dest_row_idx]*sigma[dest_row_idx]);
-            c = 1.;
-
-            for(int m=1; m<m_max; m++) {
-                dc[m] = exp(a * (floating_t)(m*m));
-                c += 2. * dc[m];
+
+        // Normalize weights to sum to 1
+        a = 1. / c;
+
+        row_start[dest_row_idx] = src_row.size();
+
+        // Zero row offset
+        src_row.push_back(dest_row_idx);
+        weight.push_back(a);
+
+        // Row offsets (other than 0)
+        double w_edge_up = 0.;
+        double w_edge_down = 0.;
+
+        for(int m=1; m<m_max; m++) {
+            double w = a * dc[m];
+
+            if(dest_row_idx + m >= N_rows) {
+                w_edge_up += w;
+            } else {
+                src_row.push_back(dest_row_idx + m);
+                weight.push_back(w);
             }
 
-            // Normalize weights to sum to 1
-            a = 1. / c;
+            if(dest_row_idx - m < 0) {
+                w_edge_down += w;
+            } else {
+                src_row.push_back(dest_row_idx - m);
+                weight.push_back(w);
+            }
+        }
+
+        if(w_edge_up > 0.) {
+            src_row.push_back(N_rows - 1);
+            weight.push_back(w_edge_up);
+        }
+        if(w_edge_down > 0.) {
+            src_row.push_back(0);
+            weight.push_back(w_edge_down);
+        }
+    }
+    row_start[N_rows] = src_row.size();
 
-            // Zero row offset
-            img_s->row(dest_row_idx) *= a;
+    // Apply the operator to every image. Each thread smooths into its
+    // own scratch image, which is then copied back over the source.
+    #pragma omp parallel
+    {
+        cv::Mat img_s(N_rows, N_cols, CV_FLOATING_TYPE);
 
-            // Loop over row offsets (other than 0)
-            for(int m=1; m<m_max; m++) {
-                dc[m] *= a;
-                src_row_idx_up = dest_row_idx + m;
-                src_row_idx_down = dest_row_idx - m;
+        #pragma omp for schedule(dynamic)
+        for(int i=0; i<N_images; i++) {
+            // Skip uninitialized images (nothing to smooth)
+            if(img[i] == NULL) {
+                continue;
+            }
 
-                if(src_row_idx_up >= N_rows) { src_row_idx_up = N_rows - 1; }
-                if(src_row_idx_down < 0) { src_row_idx_down = 0; }
+            for(int dest_row_idx=0; dest_row_idx<N_rows; dest_row_idx++) {
+                floating_t *dest_img_row = img_s.ptr<floating_t>(dest_row_idx);
+                std::fill(dest_img_row, dest_img_row+N_cols, (floating_t)0);
 
-                // Loop over images
-                if(img[i] != NULL) {
-                    dest_img_row = img_s->ptr<floating_t>(dest_row_idx);
-                    src_img_row_up = img[i]->ptr<floating_t>(src_row_idx_up);
-                    src_img_row_down = img[i]->ptr<floating_t>(src_row_idx_down);
+                for(int j=row_start[dest_row_idx]; j<row_start[dest_row_idx+1]; j++) {
+                    const floating_t *src_img_row = img[i]->ptr<floating_t>(src_row[j]);
+                    const floating_t w = weight[j];
 
                     // Loop over columns
                     for(int col=0; col<N_cols; col++) {
-                        dest_img_row[col] += dc[m] * (
-                            src_img_row_up[col] + src_img_row_down[col]
-                        );
+                        dest_img_row[col] += w * src_img_row[col];
                     }
                 }
             }
+
+            // Copy smoothed image back (in place, so that views are kept)
+            img_s.copyTo(*(img[i]));
         }
-        
-        // Swap out old image for smoothed image
-        delete img[i];
-        img[i] = img_s;
     }
-
-    // Cleanup
-    delete[] dc;
 }
 
 
 void TImgStack::normalize(double norm) {
     // Calculate and divide out sum of each matrix
     for(int i=0; i<N_images; i++) {
+        if(img[i]->empty()) { continue; } // Empty sparse image
+
         double sum_img = cv::sum(*(img[i]))[0];
         
         if(sum_img < 1.e-30) {
@@ -5871,11 +7317,82 @@ void TImgStack::normalize(double norm) {
 }
 
 
+static std::unique_ptr<TImgStack> read_img_stack_sparse(
+    H5::DataSet& d,
+    H5::DataSpace& dspace,
+    TRect& rect,
+    size_t n_images
+) {
+    // Reads the images in chunks, keeping only the bounding box of the
+    // nonzero pixels of each image. The dataset is read twice: once to
+    // find the bounding boxes, and once to fill the (compact) arena.
+    const size_t n_chunk = 256;
+    const uint32_t n_rows = rect.N_bins[0];
+    const uint32_t n_cols = rect.N_bins[1];
+
+    TImgStack chunk(std::min(n_chunk, n_images), rect);
+    cv::Mat& chunk_arena = chunk.arena;
+    hsize_t mem_shape[2] = {
+        (hsize_t)chunk_arena.rows,
+        (hsize_t)chunk_arena.step1()
+    };
+    hsize_t mem_start[2] = {0, 0};
+    H5::DataSpace mem_space(2, &(mem_shape[0]));
+
+    // Reads images [i0, i0+n) into the start of the chunk stack
+    auto read_chunk = [&](size_t i0, size_t n) {
+        hsize_t file_start[3] = {i0, 0, 0};
+        hsize_t file_count[3] = {n, n_rows, n_cols};
+        dspace.selectHyperslab(H5S_SELECT_SET, &(file_count[0]), &(file_start[0]));
+        hsize_t mem_count[2] = {n, (hsize_t)n_rows*n_cols};
+        mem_space.selectHyperslab(H5S_SELECT_SET, &(mem_count[0]), &(mem_start[0]));
+        d.read(chunk_arena.ptr<floating_t>(), H5Utils::get_dtype<floating_t>(),
+               mem_space, dspace);
+    };
+
+    std::vector<cv::Rect> bbox(n_images);
+    for(size_t i0=0; i0<n_images; i0+=n_chunk) {
+        size_t n = std::min(n_chunk, n_images-i0);
+        read_chunk(i0, n);
+        for(size_t i=0; i<n; i++) {
+            bbox[i0+i] = nonzero_bbox(*(chunk.img[i]), 0);
+        }
+    }
+
+    auto img_stack = std::unique_ptr<TImgStack>(new TImgStack(n_images));
+    img_stack->rect = new TRect(rect);
+    img_stack->alloc_sparse_arena(bbox);
+
+    size_t n_pix_sparse = 0;
+    for(size_t i0=0; i0<n_images; i0+=n_chunk) {
+        size_t n = std::min(n_chunk, n_images-i0);
+        read_chunk(i0, n);
+        for(size_t i=0; i<n; i++) {
+            if(bbox[i0+i].area() != 0) {
+                (*(chunk.img[i]))(bbox[i0+i]).copyTo(*(img_stack->img[i0+i]));
+                n_pix_sparse += bbox[i0+i].area();
+            }
+        }
+    }
+
+    dspace.selectAll();
+
+    std::cout << "Sparse images use "
+              << 100. * (double)n_pix_sparse
+                      / (double)std::max((size_t)n_rows*n_cols*n_images, (size_t)1)
+              << "% of the dense image size." << std::endl;
+
+    return img_stack;
+}
+
+
 std::unique_ptr<TImgStack> read_img_stack(
     const std::string& fname,
-    const std::string& dset
+    const std::string& dset,
+    bool sparse
 ) {
     // Open dataset
+	H5Utils::IOLock io_lock;
 	std::unique_ptr<H5::H5File> f = H5Utils::openFile(fname, H5Utils::READ);
     if(!f) { return std::unique_ptr<TImgStack>(nullptr); }
 	std::unique_ptr<H5::DataSet> d = H5Utils::openDataSet(*f, dset);
@@ -5912,31 +7429,32 @@ std::unique_ptr<TImgStack> read_img_stack(
     assert(img_shape[1] == n_pix[0]);
     assert(img_shape[2] == n_pix[1]);
     
-    // Initialize image stack
     TRect rect(min, max, n_pix);
-    auto img_stack = std::unique_ptr<TImgStack>(new TImgStack(n_images, rect));
 
-    for(size_t i=0; i<n_images; i++) {
-        bool res = img_stack->initialize_to_zero(i);
-        if(!res) { return std::unique_ptr<TImgStack>(nullptr); }
+    if(sparse && (n_images > 0)) {
+        return read_img_stack_sparse(*d, dspace, rect, n_images);
     }
+
+    // Initialize image stack (allocates the arena)
+    auto img_stack = std::unique_ptr<TImgStack>(new TImgStack(n_images, rect));
     
-    // Read in images
+    // Read the images directly into the arena. Each image fills the
+    // start of one (padded) row of the arena.
     std::cout << "Reading image data ..." << std::endl;
-	float *buf = new float[n_pix[0] * n_pix[1] * n_images];
-    d->read(buf, H5Utils::get_dtype<float>());
-    
-    for(size_t i=0; i<n_images; i++) {
-        cv::Mat *img = img_stack->img[i];
-        size_t i0 = i * n_pix[0]*n_pix[1];
-        for(size_t j=0; j<n_pix[0]; j++) {
-            for(size_t k=0; k<n_pix[1]; k++) {
-                img->at<floating_t>(j,k) = buf[i0 + n_pix[1]*j + k];
-            }
-        }
+    if(n_images > 0) {
+        cv::Mat& arena = img_stack->arena;
+        hsize_t mem_shape[2] = {
+            (hsize_t)arena.rows,
+            (hsize_t)arena.step1()
+        };
+        hsize_t mem_start[2] = {0, 0};
+        hsize_t mem_count[2] = {n_images, (hsize_t)n_pix[0]*n_pix[1]};
+        H5::DataSpace mem_space(2, &(mem_shape[0]));
+        mem_space.selectHyperslab(H5S_SELECT_SET, &(mem_count[0]), &(mem_start[0]));
+        
+        d->read(arena.ptr<floating_t>(), H5Utils::get_dtype<floating_t>(),
+                mem_space, dspace);
     }
-    
-    delete[] buf;
 
     // Return image stack
     return img_stack;
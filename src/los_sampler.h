@@ -38,6 +38,7 @@
 #include <time.h>
 #include <memory>
 #include <random>
+#include <limits>
 #include <chrono>
 #include <cassert>
 
@@ -76,11 +77,21 @@ struct TMCMCOptions {
 };
 
 struct TImgStack {
-    cv::Mat **img;
+    cv::Mat **img; // Views into arena (once rect is set)
     TRect *rect;
 
     size_t N_images;
 
+    // Single block holding all the images, one per row, in the order
+    // [image][E][DM]. Rows are padded to a multiple of 64 bytes.
+    cv::Mat arena;
+
+    // Sparse images store only the bounding box of their nonzero pixels,
+    // packed one after another in the arena. bbox[i] gives the location
+    // of image i within the full (rect) image, in which img[i] is a view.
+    // Empty for dense images.
+    std::vector<cv::Rect> bbox;
+
     TImgStack(size_t _N_images);
     TImgStack(size_t _N_images, TRect &_rect);
     ~TImgStack();
@@ -94,14 +105,52 @@ struct TImgStack {
 
     bool initialize_to_zero(unsigned int img_idx);
 
+    // Allocates a zeroed arena for N_images images of the size given by
+    // rect, and points each image at its slice
+    void alloc_arena();
+
     void smooth(std::vector<double> sigma, double n_sigma=5);
     void normalize(double norm=1.0);
+
+    // Allocates a zeroed arena holding only the given bounding box of
+    // each image, and points each image at its slice
+    void alloc_sparse_arena(const std::vector<cv::Rect>& _bbox);
+
+    // Replaces each image by the bounding box of its pixels that are
+    // greater than threshold. Pixels outside the box are treated as zero.
+    void compact(floating_t threshold=0);
+
+    // Frees the pixels of every image, keeping rect and N_images. For use
+    // once nothing will read the images again.
+    void release_pixels();
+
+    bool is_sparse() const { return !bbox.empty(); }
+
+    // Pixel (row, col) of image k, in full-image coordinates. Pixels
+    // outside the bounding box of a sparse image are zero.
+    inline floating_t get(size_t k, int row, int col) const {
+        if(bbox.empty()) {
+            return img[k]->at<floating_t>(row, col);
+        }
+        const cv::Rect& b = bbox[k];
+        row -= b.y;
+        col -= b.x;
+        if(((unsigned int)row >= (unsigned int)b.height)
+           || ((unsigned int)col >= (unsigned int)b.width)) {
+            return 0;
+        }
+        return img[k]->at<floating_t>(row, col);
+    }
 };
 
 
+// If sparse is true, each image is stored as the bounding box of its
+// nonzero pixels (see TImgStack::compact), and the full image stack is
+// never held in memory.
 std::unique_ptr<TImgStack> read_img_stack(
     const std::string& fname,
-    const std::string& group
+    const std::string& group,
+    bool sparse=false
 );
 
 
@@ -129,6 +178,14 @@ struct TLOSMCMCParams {
     double *sigma_log_Delta_EBV;
     double alpha_skew;
 
+    // Running sums of each image along the distance axis, as
+    // [star][reddening][distance+1], so that the cloud model's line
+    // integrals need only one lookup per cloud. Empty until
+    // build_img_cumsum() is called. The sums are accumulated in double
+    // precision, and each is then rounded to float once.
+    std::vector<float> img_cumsum;
+    double img_cumsum_max_MB; // Memory budget for img_cumsum (0 = never build)
+
     TLOSMCMCParams(TImgStack* _img_stack, const std::vector<double>& _lnZ,
                    double _p0, unsigned int _N_runs, unsigned int _N_threads,
                    unsigned int _N_regions, double _EBV_max=-1.);
@@ -149,6 +206,9 @@ struct TLOSMCMCParams {
     double* get_line_int(unsigned int thread_num);
     float* get_Delta_EBV(unsigned int thread_num);
 
+    // Builds img_cumsum, if it fits within img_cumsum_max_MB. Returns
+    // false (leaving it empty) otherwise.
+    bool build_img_cumsum();
 };
 
 
@@ -162,6 +222,19 @@ struct TDiscreteLosMcmcParams {
 
     std::unique_ptr<TImgStack> img_stack;   // Stack of (distance, reddening) posteriors for stars
     double y_zero_idx;      // y-index corresponding to zero reddening
+    double EBV_guess_max;   // Guess of max. reddening, taken from the images on construction
+
+    // Copy of the stellar images, packed as [distance][reddening][star],
+    // so that the line-integral kernels sweep over stars contiguously.
+    // Empty (and unused) until pack_images() is called. In 16- and 8-bit
+    // mode, each pixel is instead stored as an unsigned fraction of its
+    // star's peak, in img_packed_u16 or img_packed_u8, and the pixel value
+    // is the stored value times packed_scale[star].
+    std::vector<floating_t> img_packed;
+    std::vector<uint16_t> img_packed_u16;
+    std::vector<uint8_t> img_packed_u8;
+    std::vector<double> packed_scale;
+    int packed_bits; // 0 (not packed), 32 (float), 16 or 8
 
     double* line_int;       // Line integral through line of sight for each thread
     int16_t* E_pix_idx;     // LOS reddening profile, in the form of the pixel y-index at each distance (for each thread)
@@ -196,6 +269,79 @@ struct TDiscreteLosMcmcParams {
     double* get_line_int(unsigned int thread_num);
     int16_t* get_E_pix_idx(unsigned int thread_num);
 
+    // Star-major packed copy of the image stack, with 32 (float), 16 or 8
+    // bits per pixel. Returns false (and leaves the images unpacked) for
+    // any other number of bits.
+    bool pack_images(int bits=32);
+
+    // True for the precisions supported by pack_images()
+    static bool valid_pack_bits(int bits) {
+        return (bits == 32) || (bits == 16) || (bits == 8);
+    }
+    bool is_packed() const { return packed_bits != 0; }
+
+    // Float packing only
+    inline const floating_t* packed_pixel(
+            const int16_t x_idx,
+            const int16_t y_idx) const {
+        return img_packed.data()
+               + ((size_t)x_idx * n_E + y_idx) * img_stack->N_images;
+    }
+
+    // Pixel (y_idx, x_idx) of star k, at any packing precision
+    inline double packed_value(
+            const int16_t x_idx,
+            const int16_t y_idx,
+            const int k) const {
+        size_t i = ((size_t)x_idx * n_E + y_idx) * img_stack->N_images + k;
+        switch(packed_bits) {
+            case 16: return img_packed_u16[i] * packed_scale[k];
+            case 8: return img_packed_u8[i] * packed_scale[k];
+            default: return img_packed[i];
+        }
+    }
+
+    // Line-integral kernels on the packed images, at any precision:
+    //   packed_line_int   : line integrals of the profile y_idx.
+    //   packed_diff       : pixel (y_new, x) minus pixel (y_old, x).
+    //   packed_shift_diff : change in the line integrals when y_idx is
+    //                       offset by dy in distance bins x0 <= x < x1.
+    void packed_line_int(const int16_t *const y_idx, double *const ret) const;
+    void packed_diff(int x, int16_t y_new, int16_t y_old, double *const ret) const;
+    void packed_shift_diff(int x0, int x1, int dy,
+                           const int16_t *const y_idx_old,
+                           double *const ret) const;
+
+    // Compares the packed line integrals with those from the image stack,
+    // for random reddening profiles, and reports the largest and mean
+    // errors. Returns the largest relative error. Uses its own (fixed-seed)
+    // random number generator, so that it does not disturb <r>.
+    // Rounding each pixel to the nearest step of its star's scale bounds
+    // the absolute error of a line integral by n_dists * peak / (2 q_max),
+    // where q_max = 65535 (16 bits) or 255 (8 bits).
+    double check_packed_accuracy(unsigned int n_profiles, int verbosity=0);
+
+    // Index of the stars with non-negligible probability in each distance
+    // column. Entries for column x are [active_start[x], active_start[x+1]),
+    // sorted by star, and each holds the range of reddening pixels
+    // [active_y_lo, active_y_hi] in which that star's image is nonzero.
+    // Empty until build_active_index() is called.
+    std::vector<uint32_t> active_start;
+    std::vector<uint32_t> active_star;
+    std::vector<int16_t> active_y_lo, active_y_hi;
+
+    // Pixels no greater than <threshold> times the peak of each star's
+    // image are treated as zero.
+    void build_active_index(double threshold=0.);
+
+    // True if step and swap proposals in column x should use the index
+    // (i.e., if few enough stars are active there).
+    inline bool use_active_index(const int16_t x_idx) const {
+        return !active_start.empty()
+               && (2 * (active_start[x_idx+1] - active_start[x_idx])
+                   < img_stack->N_images);
+    }
+
     // Line-of-sight integrals
     void los_integral_discrete(const int16_t *const y_idx,
                                double *const line_int_ret);
@@ -221,6 +367,17 @@ struct TDiscreteLosMcmcParams {
             const int16_t y_idx_new,
             double *const delta_line_int_ret);
 
+    // As above, but only for stars whose line integrals change (according
+    // to the active-star index). Fills <star_ret> with the indices of these
+    // stars and <delta_line_int_ret> with their changes, and returns the
+    // number of stars.
+    int los_integral_diff_step_active(
+            const int16_t x_idx,
+            const int16_t y_idx_old,
+            const int16_t y_idx_new,
+            int *const star_ret,
+            double *const delta_line_int_ret) const;
+
     floating_t log_prior_diff_step(
             const int16_t x_idx,
             const int16_t *const y_idx_los_old,
@@ -237,6 +394,12 @@ struct TDiscreteLosMcmcParams {
             const int16_t *const y_idx,
             double *const delta_line_int_ret);
 
+    int los_integral_diff_swap_active(
+            const int16_t x0_idx,
+            const int16_t *const y_idx,
+            int *const star_ret,
+            double *const delta_line_int_ret) const;
+
     floating_t log_prior_diff_swap(
             const int16_t x0_idx,
             const int16_t *const y_idx_los_old,
@@ -323,7 +486,56 @@ struct TDiscreteLosMcmcParams {
             const double shift_weight=-1.,
             int verbosity=0);
 
-    void set_central_delta(int16_t* y_idx);
+    // Copies the central pixel's l.o.s. profile into the given sample
+    // slot of the central pixel in <neighbor_pixels>
+    void set_central_delta(int16_t* y_idx, unsigned int sample=0);
+};
+
+
+// Running partial sums (over distance) of the change in each star's line
+// integral that would result from offsetting the reddening at a single
+// distance by d, for 0 < |d| <= max_offset. The sums are kept in a
+// Fenwick tree over distance, so that both the update after an accepted
+// step and the lookup for a shift proposal cost O(n_stars log n_dists),
+// rather than the O(n_stars n_dists) of a direct shift evaluation.
+// An accepted shift changes the single-distance differences across its
+// whole block by different amounts, so it requires a full rebuild, at
+// O(2 max_offset n_stars n_dists). The tables are therefore a win only
+// when shift proposals are mostly rejected.
+// Requires the packed image stack (TDiscreteLosMcmcParams::pack_images).
+class TShiftDiffTable {
+public:
+    TShiftDiffTable(const TDiscreteLosMcmcParams& params, int max_offset);
+
+    // Recompute all sums for the given l.o.s. profile
+    void rebuild(const int16_t *const y_idx);
+
+    // Account for y_idx[x] changing from y_old to y_new
+    void update(int x, int16_t y_old, int16_t y_new);
+
+    // True if shifts by dy can be looked up
+    bool covers(int dy) const;
+
+    // Same results as TDiscreteLosMcmcParams::los_integral_diff_shift_l/r
+    void diff_shift_l(int x, int dy, double *const delta_line_int_ret) const;
+    void diff_shift_r(int x, int dy, double *const delta_line_int_ret) const;
+
+private:
+    const TDiscreteLosMcmcParams& params;
+    int max_offset, n_offsets;
+    int n_dists, n_E, n_stars;
+
+    std::vector<double> tree;   // shape = (offset, node, star)
+    std::vector<double> total;  // shape = (offset, star)
+    std::vector<double> ws, ws_new;    // shape = (star)
+
+    int offset_idx(int dy) const;
+    double* node(int d, int i);
+    const double* node(int d, int i) const;
+
+    // Change in line integrals from offsetting y by dy at distance x
+    void point_diff(int x, int16_t y, int dy, double *const ret) const;
+    void prefix_sum(int d, int x, double *const ret) const;
 };
 
 
@@ -338,6 +550,19 @@ double neighbor_gibbs_step(
         double beta=1.);
 
 
+// Log probability (up to a constant) of each sample of a neighboring pixel,
+// conditional on the samples chosen in the other pixels
+void neighbor_gibbs_log_p_shifted(
+        const int pix,
+        TNeighborPixels& neighbor_pixels,
+        const std::vector<uint16_t>& neighbor_sample,
+        std::vector<double>& log_p_sample_ws,
+        const double beta,
+        const double shift_weight,
+        TNeighborMeanSums* mean_sums=nullptr);
+
+// If <mean_sums> is given, the conditional means are read from it (and it
+// is kept up to date with the chosen sample).
 double neighbor_gibbs_step_shifted(
         const int pix,
         TNeighborPixels& neighbor_pixels,
@@ -346,7 +571,8 @@ double neighbor_gibbs_step_shifted(
         std::vector<double>& p_sample_ws,
         std::mt19937& r,
         const double beta,
-        const double shift_weight);
+        const double shift_weight,
+        TNeighborMeanSums* mean_sums=nullptr);
 
 
 void randomize_neighbors(
@@ -405,6 +631,19 @@ void gen_rand_los_extinction(double *const Delta_EBV, unsigned int N, gsl_rng *r
 void los_integral(TImgStack& img_stack, const double *const subpixel, double *const ret,
                   const float *const Delta_EBV, unsigned int N_regions);
 
+// los_integral for n_walkers profiles at once, vectorized across walkers.
+// Delta_EBV is [walker][N_regions+1] and ret is [walker][image].
+void los_integral_batch(TImgStack& img_stack, const double *const subpixel, double *const ret,
+                        const float *const Delta_EBV, unsigned int N_regions, unsigned int n_walkers);
+
+// lnp_los_extinction evaluated at n points, logEBV[0..n-1]
+void lnp_los_extinction_batch(
+        const double *const *const logEBV,
+        unsigned int n,
+        unsigned int N,
+        TLOSMCMCParams &params,
+        double *const lnp);
+
 double guess_EBV_max(TImgStack &img_stack);
 
 void guess_EBV_profile(TMCMCOptions &options, TLOSMCMCParams &params, int verbosity=1);
@@ -429,8 +668,11 @@ double lnp_los_extinction_clouds(const double* x, unsigned int N, TLOSMCMCParams
 
 void gen_rand_los_extinction_clouds(double *const x, unsigned int N, gsl_rng *r, TLOSMCMCParams &params);
 
+// If cumsum is given (see TLOSMCMCParams::img_cumsum), each star costs
+// O(N_clouds), rather than O(# of distance bins).
 void los_integral_clouds(TImgStack &img_stack, const double *const subpixel, double *const ret, const double *const Delta_mu,
-                         const double *const logDelta_EBV, unsigned int N_clouds);
+                         const double *const logDelta_EBV, unsigned int N_clouds,
+                         const float *const cumsum=nullptr);
 
 
 // Sampling parameters for discrete l.o.s. model
@@ -461,6 +703,36 @@ struct TDiscreteLOSSamplingSettings {
     bool save_all_temperatures = false;
     // Outlier fraction
     double p_badstar = 1.e-5; // Higher means less weight for outliers
+    // Pack the stellar images star-major before sampling (uses a
+    // second copy of the image stack)
+    bool pack_images = true;
+    // Free the float image stack once the images are packed, so that
+    // only the packed copy is held in memory. The image stack cannot be
+    // used afterwards (e.g., by the cloud or piecewise-linear models).
+    bool release_float_images = false;
+    // Bits per packed pixel: 32 (float), or 16 or 8 (fixed point, scaled
+    // to the peak of each star's image). 8 bits is not yet validated.
+    int pack_bits = 32;
+    // Largest |dy| for which shift proposals are evaluated from running
+    // partial sums (0 = off). Requires packed images.
+    int shift_table_max_offset = 1;
+    // Capacity of the per-temperature cache of neighbor Gibbs-step data
+    // (0 = no cache)
+    unsigned int gibbs_cache_capacity = 0;
+    // Cache entries keep only the samples within this much (in ln p) of
+    // the most probable one, ignoring the central pixel. Any finite value
+    // makes the cached steps approximate, since the central pixel can
+    // favor a dropped sample. -infinity (default) keeps every sample, so
+    // the cached steps sample the same conditional as the uncached ones.
+    double gibbs_cache_lnp_cutoff = -std::numeric_limits<double>::infinity();
+    // Compare each cached Gibbs step with the uncached calculation
+    bool gibbs_cache_check = false;
+    // Evaluate step and swap proposals only for the stars with
+    // non-negligible probability in the affected distance column
+    bool active_star_index = true;
+    // Pixels no greater than this times the peak of each star's image are
+    // ignored by the active-star index (0 = exact)
+    double active_star_threshold = 0.;
 };
 
 
@@ -38,6 +38,9 @@
 #include <unordered_map>
 #include <functional>
 #include <vector>
+#include <memory>
+#include <mutex>
+#include <algorithm>
 
 
 #define LRUCACHE_VERBOSE 1 // Set to 1 for hit/miss stats, 0 for quiet
@@ -334,6 +337,629 @@ void LRUCache<TKey, TValue, THash>::bring_to_front(const TKey& key) {
 }
 
 
+/*
+ * Flat LRU cache, for keys that are vectors of a fixed length.
+ *
+ * Keys are packed into a single arena, with their hashes stored once per
+ * slot. Slots are found through an open-addressing (linear-probing) index,
+ * and the access order is an intrusive doubly linked list threaded through
+ * the slots, so that lookups and inserts allocate nothing after the first
+ * insert. The key length is fixed by the first key inserted. Keys of any
+ * other length are never cached.
+ */
+
+template<class T, class TValue>
+class FlatLRUCache {
+public:
+    typedef std::vector<T> TKey;
+
+    FlatLRUCache(uint32_t capacity, const TValue& empty_value);
+    ~FlatLRUCache();
+
+    TValue get(const TKey& key);
+    void set(const TKey& key, const TValue& value);
+
+    uint32_t size() const;
+
+    // Hash used to index keys
+    static uint64_t hash(const TKey& key);
+
+    #if LRUCACHE_VERBOSE
+    void get_stats(uint64_t& hit, uint64_t& miss, uint64_t& replace) const;
+    bool print_stats = true; // Print stats on destruction
+    #endif
+
+protected:
+    static const uint32_t npos = 0xFFFFFFFF;
+
+    struct Bucket {
+        uint32_t slot; // npos if empty
+        uint32_t tag;  // Low 32 bits of the key's hash
+    };
+
+    uint32_t capacity; // Max # of items to store.
+    TValue empty_value; // Value to return when item not in cache
+
+    uint32_t key_len; // Fixed on first insert (npos until then)
+    uint32_t n_used; // # of slots in use
+
+    // Per-slot storage
+    std::vector<T> key_arena; // capacity x key_len
+    std::vector<uint64_t> slot_hash;
+    std::vector<TValue> slot_value;
+    std::vector<uint32_t> slot_prev, slot_next; // Access order (intrusive)
+    uint32_t head, tail; // Most and least recently used slots
+
+    // Open-addressing index, with at least two buckets per slot
+    std::vector<Bucket> buckets;
+    uint64_t bucket_mask;
+
+    bool key_equal(uint32_t slot, const TKey& key) const;
+    uint32_t find(const TKey& key, uint64_t h) const;
+    uint32_t push_front(const TKey& key, uint64_t h, const TValue& value);
+    void bring_to_front(uint32_t slot);
+    void unlink(uint32_t slot);
+    void link_front(uint32_t slot);
+    void remove_lru();
+    void erase_bucket(uint64_t b);
+
+    #if LRUCACHE_VERBOSE
+    uint64_t n_hit, n_miss, n_replace;
+    #endif
+};
+
+
+// Drop-in replacement for CachedFunction, backed by a FlatLRUCache. The
+// third template parameter is accepted (and ignored) so that existing
+// CachedFunction types can be switched over by changing the class name.
+template<class TKey, class TValue, class THash=void>
+class FlatCachedFunction;
+
+template<class T, class TValue, class THash>
+class FlatCachedFunction<std::vector<T>, TValue, THash>
+    : public FlatLRUCache<T, TValue>
+{
+public:
+    typedef std::vector<T> TKey;
+
+    FlatCachedFunction(std::function<TValue(const TKey&)> f, uint32_t capacity);
+    FlatCachedFunction(std::function<TValue(const TKey&)> f, uint32_t capacity, const TValue& empty_value);
+    ~FlatCachedFunction();
+
+    TValue eval(const TKey& arg);
+    TValue operator()(const TKey& arg);
+
+    void eval(const TKey& arg, std::function<void(TValue&)>);
+    void operator()(const TKey& arg, std::function<void(TValue&)>);
+
+    TValue& eval_ref(const TKey& arg);
+
+    // Look up a key whose hash (from FlatLRUCache::hash) is already known.
+    // Returns nullptr if the key is not cached.
+    TValue* lookup(const TKey& arg, uint64_t h);
+    // Insert a value for a key whose hash is already known.
+    TValue& insert(const TKey& arg, uint64_t h, const TValue& value);
+
+private:
+    std::function<TValue(const TKey&)> f;
+    TValue uncached_value; // Holds results for keys that cannot be cached
+};
+
+
+// Thread-safe cached function. Keys are split between several
+// independently locked FlatCachedFunctions by their hashes. The function
+// itself is evaluated outside of any lock, so it must be safe to call from
+// multiple threads at once.
+template<class TKey, class TValue, class THash=void>
+class ShardedCachedFunction;
+
+template<class T, class TValue, class THash>
+class ShardedCachedFunction<std::vector<T>, TValue, THash> {
+public:
+    typedef std::vector<T> TKey;
+
+    ShardedCachedFunction(std::function<TValue(const TKey&)> f, uint32_t capacity,
+                          const TValue& empty_value=TValue(), uint32_t n_shards=16);
+    ~ShardedCachedFunction();
+
+    TValue eval(const TKey& arg);
+    TValue operator()(const TKey& arg);
+
+    void eval(const TKey& arg, std::function<void(TValue&)>);
+    void operator()(const TKey& arg, std::function<void(TValue&)>);
+
+private:
+    struct Shard {
+        std::mutex mtx;
+        std::unique_ptr<FlatCachedFunction<TKey, TValue>> cache;
+    };
+
+    std::function<TValue(const TKey&)> f;
+    std::vector<std::unique_ptr<Shard>> shards;
+
+    Shard& get_shard(uint64_t h);
+};
+
+
+/*
+ * FlatLRUCache implementation
+ */
+
+template<class T, class TValue>
+const uint32_t FlatLRUCache<T, TValue>::npos;
+
+
+template<class T, class TValue>
+FlatLRUCache<T, TValue>::FlatLRUCache(uint32_t capacity, const TValue& empty_value)
+    : capacity(std::max<uint32_t>(capacity, 1)), empty_value(empty_value),
+      key_len(npos), n_used(0), head(npos), tail(npos)
+{
+    slot_hash.resize(this->capacity);
+    slot_value.resize(this->capacity, empty_value);
+    slot_prev.resize(this->capacity, npos);
+    slot_next.resize(this->capacity, npos);
+
+    uint64_t n_buckets = 1;
+    while(n_buckets < 2 * (uint64_t)this->capacity) {
+        n_buckets <<= 1;
+    }
+    buckets.resize(n_buckets, Bucket{npos, 0});
+    bucket_mask = n_buckets - 1;
+
+    #if LRUCACHE_VERBOSE
+    n_hit = 0;
+    n_miss = 0;
+    n_replace = 0;
+    #endif
+}
+
+
+template<class T, class TValue>
+FlatLRUCache<T, TValue>::~FlatLRUCache() {
+    #if LRUCACHE_VERBOSE
+    if(print_stats) {
+        std::cout << "FlatLRUCache hits/misses/replacements = "
+                  << n_hit << " / "
+                  << n_miss << " / "
+                  << n_replace << std::endl;
+    }
+    #endif
+}
+
+
+#if LRUCACHE_VERBOSE
+template<class T, class TValue>
+void FlatLRUCache<T, TValue>::get_stats(
+        uint64_t& hit,
+        uint64_t& miss,
+        uint64_t& replace) const
+{
+    hit = n_hit;
+    miss = n_miss;
+    replace = n_replace;
+}
+#endif
+
+
+template<class T, class TValue>
+uint32_t FlatLRUCache<T, TValue>::size() const {
+    return n_used;
+}
+
+
+template<class T, class TValue>
+uint64_t FlatLRUCache<T, TValue>::hash(const TKey& key) {
+    // FNV-1a over the elements, followed by a 64-bit finalizer
+    // (from MurmurHash3), so that the low bits can index the buckets.
+    uint64_t h = 0xcbf29ce484222325ULL ^ key.size();
+    for(auto& v : key) {
+        h ^= (uint64_t)std::hash<T>{}(v);
+        h *= 0x100000001b3ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+
+template<class T, class TValue>
+bool FlatLRUCache<T, TValue>::key_equal(uint32_t slot, const TKey& key) const {
+    const T* k = key_arena.data() + (size_t)slot * key_len;
+    return std::equal(key.begin(), key.end(), k);
+}
+
+
+template<class T, class TValue>
+uint32_t FlatLRUCache<T, TValue>::find(const TKey& key, uint64_t h) const {
+    // Returns the slot holding the key, or npos if the key is not cached
+    if(key.size() != key_len) {
+        return npos;
+    }
+
+    uint32_t tag = (uint32_t)h;
+    for(uint64_t b = h & bucket_mask; ; b = (b + 1) & bucket_mask) {
+        const Bucket& bucket = buckets[b];
+        if(bucket.slot == npos) {
+            return npos;
+        }
+        if((bucket.tag == tag) && (slot_hash[bucket.slot] == h)
+                               && key_equal(bucket.slot, key)) {
+            return bucket.slot;
+        }
+    }
+}
+
+
+template<class T, class TValue>
+void FlatLRUCache<T, TValue>::unlink(uint32_t slot) {
+    uint32_t p = slot_prev[slot];
+    uint32_t n = slot_next[slot];
+    if(p != npos) { slot_next[p] = n; } else { head = n; }
+    if(n != npos) { slot_prev[n] = p; } else { tail = p; }
+}
+
+
+template<class T, class TValue>
+void FlatLRUCache<T, TValue>::link_front(uint32_t slot) {
+    slot_prev[slot] = npos;
+    slot_next[slot] = head;
+    if(head != npos) { slot_prev[head] = slot; }
+    head = slot;
+    if(tail == npos) { tail = slot; }
+}
+
+
+template<class T, class TValue>
+void FlatLRUCache<T, TValue>::bring_to_front(uint32_t slot) {
+    if(slot != head) {
+        unlink(slot);
+        link_front(slot);
+    }
+}
+
+
+template<class T, class TValue>
+void FlatLRUCache<T, TValue>::erase_bucket(uint64_t b) {
+    // Backward-shift deletion, so that no tombstones are needed: later
+    // entries in the probe run are moved back unless they would end up
+    // before their home bucket.
+    uint64_t i = b;
+    uint64_t j = b;
+    while(true) {
+        j = (j + 1) & bucket_mask;
+        if(buckets[j].slot == npos) {
+            break;
+        }
+        uint64_t k = buckets[j].tag & bucket_mask; // Home bucket of entry j
+        bool stays = (i <= j) ? ((i < k) && (k <= j))
+                              : ((i < k) || (k <= j));
+        if(!stays) {
+            buckets[i] = buckets[j];
+            i = j;
+        }
+    }
+    buckets[i].slot = npos;
+}
+
+
+template<class T, class TValue>
+void FlatLRUCache<T, TValue>::remove_lru() {
+    #if LRUCACHE_VERBOSE
+    n_replace++;
+    #endif
+
+    uint32_t slot = tail;
+    unlink(slot);
+
+    // Remove the slot from the index
+    uint64_t b = slot_hash[slot] & bucket_mask;
+    while(buckets[b].slot != slot) {
+        b = (b + 1) & bucket_mask;
+    }
+    erase_bucket(b);
+
+    slot_value[slot] = empty_value;
+    n_used--;
+}
+
+
+template<class T, class TValue>
+uint32_t FlatLRUCache<T, TValue>::push_front(
+        const TKey& key,
+        uint64_t h,
+        const TValue& value)
+{
+    // Inserts a key that is not yet cached. Returns the slot used, or
+    // npos if the key cannot be cached (wrong length).
+    #if LRUCACHE_VERBOSE
+    n_miss++;
+    #endif
+
+    if(key_len == npos) {
+        key_len = key.size();
+        key_arena.resize((size_t)capacity * key_len);
+    } else if(key.size() != key_len) {
+        return npos;
+    }
+
+    // If at capacity, remove least-recently-used key. Slots are then
+    // reused in place.
+    uint32_t slot;
+    if(n_used == capacity) {
+        slot = tail;
+        remove_lru();
+    } else {
+        slot = n_used;
+    }
+    n_used++;
+
+    // Store key, hash and value
+    std::copy(key.begin(), key.end(), key_arena.begin() + (size_t)slot * key_len);
+    slot_hash[slot] = h;
+    slot_value[slot] = value;
+    link_front(slot);
+
+    // Add to index
+    uint64_t b = h & bucket_mask;
+    while(buckets[b].slot != npos) {
+        b = (b + 1) & bucket_mask;
+    }
+    buckets[b] = Bucket{slot, (uint32_t)h};
+
+    return slot;
+}
+
+
+template<class T, class TValue>
+TValue FlatLRUCache<T, TValue>::get(const TKey& key) {
+    uint32_t slot = find(key, hash(key));
+    if(slot == npos) { // Key not found
+        #if LRUCACHE_VERBOSE
+        n_miss++;
+        #endif
+
+        return empty_value;
+    } else { // Key found
+        #if LRUCACHE_VERBOSE
+        n_hit++;
+        #endif
+
+        bring_to_front(slot);
+        return slot_value[slot];
+    }
+}
+
+
+template<class T, class TValue>
+void FlatLRUCache<T, TValue>::set(const TKey& key, const TValue& value) {
+    uint64_t h = hash(key);
+    uint32_t slot = find(key, h);
+    if(slot == npos) { // Key not in cache
+        push_front(key, h, value);
+    } else { // Key found
+        #if LRUCACHE_VERBOSE
+        n_hit++;
+        #endif
+
+        bring_to_front(slot);
+        slot_value[slot] = value;
+    }
+}
+
+
+/*
+ * FlatCachedFunction implementation
+ */
+
+template<class T, class TValue, class THash>
+FlatCachedFunction<std::vector<T>, TValue, THash>::FlatCachedFunction(
+        std::function<TValue(const TKey&)> f,
+        uint32_t capacity)
+    : FlatLRUCache<T, TValue>(capacity, TValue()), f(f)
+{}
+
+
+template<class T, class TValue, class THash>
+FlatCachedFunction<std::vector<T>, TValue, THash>::FlatCachedFunction(
+        std::function<TValue(const TKey&)> f,
+        uint32_t capacity,
+        const TValue& empty_value)
+    : FlatLRUCache<T, TValue>(capacity, empty_value), f(f)
+{}
+
+
+template<class T, class TValue, class THash>
+FlatCachedFunction<std::vector<T>, TValue, THash>::~FlatCachedFunction() {}
+
+
+template<class T, class TValue, class THash>
+TValue* FlatCachedFunction<std::vector<T>, TValue, THash>::lookup(
+        const TKey& arg,
+        uint64_t h)
+{
+    uint32_t slot = this->find(arg, h);
+    if(slot == this->npos) {
+        return nullptr;
+    }
+
+    #if LRUCACHE_VERBOSE
+    this->n_hit++;
+    #endif
+
+    this->bring_to_front(slot);
+    return &(this->slot_value[slot]);
+}
+
+
+template<class T, class TValue, class THash>
+TValue& FlatCachedFunction<std::vector<T>, TValue, THash>::insert(
+        const TKey& arg,
+        uint64_t h,
+        const TValue& value)
+{
+    uint32_t slot = this->find(arg, h);
+    if(slot != this->npos) { // Already cached: overwrite
+        this->bring_to_front(slot);
+        this->slot_value[slot] = value;
+        return this->slot_value[slot];
+    }
+
+    slot = this->push_front(arg, h, value);
+    if(slot == this->npos) { // Key cannot be cached
+        uncached_value = value;
+        return uncached_value;
+    }
+    return this->slot_value[slot];
+}
+
+
+template<class T, class TValue, class THash>
+TValue& FlatCachedFunction<std::vector<T>, TValue, THash>::eval_ref(const TKey& arg) {
+    uint64_t h = this->hash(arg);
+    TValue* cached = lookup(arg, h);
+    if(cached != nullptr) {
+        return *cached;
+    }
+    return insert(arg, h, f(arg));
+}
+
+
+template<class T, class TValue, class THash>
+TValue FlatCachedFunction<std::vector<T>, TValue, THash>::eval(const TKey& arg) {
+    return eval_ref(arg);
+}
+
+
+template<class T, class TValue, class THash>
+void FlatCachedFunction<std::vector<T>, TValue, THash>::eval(
+        const TKey& arg,
+        std::function<void(TValue&)> g)
+{
+    g(eval_ref(arg));
+}
+
+
+template<class T, class TValue, class THash>
+TValue FlatCachedFunction<std::vector<T>, TValue, THash>::operator()(const TKey& arg) {
+    return eval(arg);
+}
+
+
+template<class T, class TValue, class THash>
+void FlatCachedFunction<std::vector<T>, TValue, THash>::operator()(
+        const TKey& arg,
+        std::function<void(TValue&)> g)
+{
+    return eval(arg, g);
+}
+
+
+/*
+ * ShardedCachedFunction implementation
+ */
+
+template<class T, class TValue, class THash>
+ShardedCachedFunction<std::vector<T>, TValue, THash>::ShardedCachedFunction(
+        std::function<TValue(const TKey&)> f,
+        uint32_t capacity,
+        const TValue& empty_value,
+        uint32_t n_shards)
+    : f(f)
+{
+    n_shards = std::max<uint32_t>(n_shards, 1);
+    uint32_t shard_capacity = (capacity + n_shards - 1) / n_shards;
+    for(uint32_t k=0; k<n_shards; k++) {
+        shards.emplace_back(new Shard);
+        shards.back()->cache.reset(
+            new FlatCachedFunction<TKey, TValue>(f, shard_capacity, empty_value)
+        );
+        #if LRUCACHE_VERBOSE
+        shards.back()->cache->print_stats = false;
+        #endif
+    }
+}
+
+
+template<class T, class TValue, class THash>
+ShardedCachedFunction<std::vector<T>, TValue, THash>::~ShardedCachedFunction() {
+    #if LRUCACHE_VERBOSE
+    uint64_t n_hit = 0, n_miss = 0, n_replace = 0;
+    for(auto& shard : shards) {
+        uint64_t h, m, r;
+        shard->cache->get_stats(h, m, r);
+        n_hit += h;
+        n_miss += m;
+        n_replace += r;
+    }
+    std::cout << "ShardedCachedFunction hits/misses/replacements = "
+              << n_hit << " / "
+              << n_miss << " / "
+              << n_replace << std::endl;
+    #endif
+}
+
+
+template<class T, class TValue, class THash>
+typename ShardedCachedFunction<std::vector<T>, TValue, THash>::Shard&
+ShardedCachedFunction<std::vector<T>, TValue, THash>::get_shard(uint64_t h) {
+    // High bits choose the shard, low bits the bucket within it
+    return *shards[(h >> 32) % shards.size()];
+}
+
+
+template<class T, class TValue, class THash>
+TValue ShardedCachedFunction<std::vector<T>, TValue, THash>::eval(const TKey& arg) {
+    uint64_t h = FlatLRUCache<T, TValue>::hash(arg);
+    Shard& shard = get_shard(h);
+
+    {
+        std::lock_guard<std::mutex> lock(shard.mtx);
+        TValue* cached = shard.cache->lookup(arg, h);
+        if(cached != nullptr) {
+            return *cached;
+        }
+    }
+
+    // Evaluate without holding the lock. Another thread may insert the
+    // same key in the meantime, in which case its value is overwritten.
+    TValue value = f(arg);
+
+    std::lock_guard<std::mutex> lock(shard.mtx);
+    shard.cache->insert(arg, h, value);
+    return value;
+}
+
+
+template<class T, class TValue, class THash>
+void ShardedCachedFunction<std::vector<T>, TValue, THash>::eval(
+        const TKey& arg,
+        std::function<void(TValue&)> g)
+{
+    // The value is passed to g by copy, as the cached value may be
+    // replaced by another thread once the lock is released.
+    TValue value = eval(arg);
+    g(value);
+}
+
+
+template<class T, class TValue, class THash>
+TValue ShardedCachedFunction<std::vector<T>, TValue, THash>::operator()(const TKey& arg) {
+    return eval(arg);
+}
+
+
+template<class T, class TValue, class THash>
+void ShardedCachedFunction<std::vector<T>, TValue, THash>::operator()(
+        const TKey& arg,
+        std::function<void(TValue&)> g)
+{
+    return eval(arg, g);
+}
+
+
 } // namespace LRUCache
 
 
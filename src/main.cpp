@@ -25,6 +25,12 @@
 #include <iostream>
 #include <iomanip>
 #include <ctime>
+#include <streambuf>
+#include <string>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <memory>
 
 #include "cpp_utils.h"
 #include "model.h"
@@ -39,454 +45,761 @@
 using namespace std;
 
 
-int full_workflow(TProgramOpts &opts, int argc, char **argv) {
-    /*
-     * Determines stellar posterior densities,
-     * then determines the l.o.s. reddening.
-     */
-
+// Stream buffer that collects, for each thread between begin() and end(),
+// everything written to the stream, and writes it out in one piece at
+// end(). Output from other threads goes straight through.
+class TThreadStreamBuf : public std::streambuf {
+public:
+    TThreadStreamBuf(std::ostream& _stream)
+        : stream(_stream), orig(_stream.rdbuf())
+    {
+        stream.rdbuf(this);
+    }
 
-    /*
-     *  MCMC Options
-     */
+    ~TThreadStreamBuf() {
+        stream.rdbuf(orig);
+    }
 
-    TMCMCOptions star_options(opts.star_steps, opts.star_samplers, opts.star_p_replacement, opts.N_runs);
-    TMCMCOptions cloud_options(opts.cloud_steps, opts.cloud_samplers, opts.cloud_p_replacement, opts.N_runs);
-    TMCMCOptions los_options(opts.los_steps, opts.los_samplers, opts.los_p_replacement, opts.N_runs);
+    // Start collecting the calling thread's output
+    void begin() {
+        std::lock_guard<std::mutex> lock(mutex);
+        buf[std::this_thread::get_id()].clear();
+    }
 
-    TMCMCOptions discrete_los_options(opts.discrete_steps, 1, 0., opts.N_runs);    // TODO: Create commandline options for this
+    // Write out the calling thread's output, and stop collecting it
+    void end() {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = buf.find(std::this_thread::get_id());
+        if(it == buf.end()) { return; }
+        orig->sputn(it->second.data(), it->second.size());
+        orig->pubsync();
+        buf.erase(it);
+    }
 
+protected:
+    std::streamsize xsputn(const char *s, std::streamsize n) override {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = buf.find(std::this_thread::get_id());
+        if(it == buf.end()) { return orig->sputn(s, n); }
+        it->second.append(s, n);
+        return n;
+    }
 
-    /*
-     *  Construct models
-     */
+    int overflow(int c) override {
+        if(c == traits_type::eof()) { return traits_type::not_eof(c); }
+        char ch = traits_type::to_char_type(c);
+        return (xsputn(&ch, 1) == 1) ? c : traits_type::eof();
+    }
 
-    TStellarModel *emplib = NULL;
-    TSyntheticStellarModel *synthlib = NULL;
-    if(opts.synthetic) {
-        synthlib = new TSyntheticStellarModel(DATADIR "PS1templates.h5");
-    } else {
-        emplib = new TStellarModel(opts.LF_fname, opts.template_fname);
+    int sync() override {
+        std::lock_guard<std::mutex> lock(mutex);
+        if(buf.count(std::this_thread::get_id())) { return 0; }
+        return orig->pubsync();
     }
-    TExtinctionModel ext_model(opts.ext_model_fname);
 
-    TEBVSmoothing EBV_smoothing(opts.smoothing_alpha_coeff,
-                                opts.smoothing_beta_coeff,
-                                opts.pct_smoothing_min,
-                                opts.pct_smoothing_max);
+private:
+    std::ostream& stream;
+    std::streambuf *orig;
+    std::mutex mutex;
+    std::map<std::thread::id, std::string> buf;
+};
 
-    /*
-     *  Execute
-     */
 
-    omp_set_num_threads(opts.N_threads);
+// When several pixels are processed concurrently, holds back the cout and
+// cerr output of each pixel until it is done, so that the logs of
+// different pixels do not interleave.
+struct TPixelLogs {
+    TThreadStreamBuf out, err;
 
-    // Get list of pixels in input file
-    vector<string> pix_name;
-    get_input_pixels(opts.input_fname, pix_name);
-    cout << "# " << pix_name.size() << " pixels in input file." << endl << endl;
+    TPixelLogs() : out(cout), err(cerr) {}
 
-    // Remove the output file
-    if(opts.clobber) {
-        remove(opts.output_fname.c_str());
-    }
+    void begin() { out.begin(); err.begin(); }
 
-    H5::Exception::dontPrint();
+    void end() {
+        #pragma omp critical (cout)
+        {
+            out.end();
+            err.end();
+        }
+    }
+};
+
+
+int full_workflow_pixel(
+        TProgramOpts &opts,
+        const string &pix_name,
+        unsigned int pixel_list_no,
+        size_t n_pix,
+        TMCMCOptions star_options,
+        TMCMCOptions cloud_options,
+        TMCMCOptions los_options,
+        TMCMCOptions discrete_los_options,
+        TStellarModel *emplib,
+        TSyntheticStellarModel *synthlib,
+        TExtinctionModel &ext_model,
+        TEBVSmoothing &EBV_smoothing,
+        unsigned int n_threads)
+{
+    /*
+     * Determines stellar posterior densities in one pixel,
+     * then determines the l.o.s. reddening. Everything that
+     * depends on the pixel (l.o.s. model, image stack, sampler
+     * workspaces) is owned by this call, so that several pixels
+     * can be processed concurrently.
+     *
+     * Returns 0 on success (or if the pixel is skipped), and
+     * nonzero if processing should be aborted.
+     */
 
-    // Run each pixel
     timespec t_start, t_mid, t_end;
-
     double t_tot, t_star;
-    unsigned int pixel_list_no = 0;
 
-    for(vector<string>::iterator it = pix_name.begin(); it != pix_name.end(); ++it, pixel_list_no++) {
-        clock_gettime(CLOCK_MONOTONIC, &t_start);
+    clock_gettime(CLOCK_MONOTONIC, &t_start);
 
-        cout << "# Pixel: " << *it
-            << " (" << pixel_list_no + 1 << " of " << pix_name.size() << ")"
-            << endl;
+    cout << "# Pixel: " << pix_name
+        << " (" << pixel_list_no + 1 << " of " << n_pix << ")"
+        << endl;
 
-        // Load input photometry
-        TStellarData stellar_data(opts.input_fname, *it, opts.err_floor);
-        TGalacticLOSModel los_model(
-            stellar_data.l,
-            stellar_data.b,
-            opts.gal_struct_params
-        );
+    // Load input photometry
+    TStellarData stellar_data(opts.input_fname, pix_name, opts.err_floor);
+    TGalacticLOSModel los_model(
+        stellar_data.l,
+        stellar_data.b,
+        opts.gal_struct_params
+    );
 
-        cout << "# HEALPix index: " << stellar_data.healpix_index
-             << " (nside = " << stellar_data.nside << ")" << endl;
-        cout << "# (l, b) = "
-             << stellar_data.l << ", " << stellar_data.b << endl;
-        if(opts.SFD_prior) {
-            cout << "# E(B-V)_SFD = " << stellar_data.EBV << endl;
-        }
-        cout << "# " << stellar_data.star.size() << " stars in pixel" << endl;
+    cout << "# HEALPix index: " << stellar_data.healpix_index
+         << " (nside = " << stellar_data.nside << ")" << endl;
+    cout << "# (l, b) = "
+         << stellar_data.l << ", " << stellar_data.b << endl;
+    if(opts.SFD_prior) {
+        cout << "# E(B-V)_SFD = " << stellar_data.EBV << endl;
+    }
+    cout << "# " << stellar_data.star.size() << " stars in pixel" << endl;
 
 
-        // Check if this pixel has already been fully processed
-        if(!(opts.clobber)) {
-            bool process_pixel = false;
+    // Check if this pixel has already been fully processed
+    if(!(opts.clobber)) {
+        H5Utils::IOLock io_lock;
+        bool process_pixel = false;
 
-            std::unique_ptr<H5::H5File> out_file = H5Utils::openFile(
-                opts.output_fname,
+        std::unique_ptr<H5::H5File> out_file = H5Utils::openFile(
+            opts.output_fname,
+            H5Utils::READ | H5Utils::WRITE | H5Utils::DONOTCREATE
+        );
+
+        if(!out_file) {
+            process_pixel = true;
+
+            //cout << "File does not exist" << endl;
+        } else {
+            //cout << "File exists" << endl;
+            //stringstream group_name;
+            //group_name << stellar_data.healpix_index;
+            //group_name << stellar_data.nside << "-" << stellar_data.healpix_index;
+
+            std::unique_ptr<H5::Group> pix_group = H5Utils::openGroup(
+                *out_file,
+                pix_name,
                 H5Utils::READ | H5Utils::WRITE | H5Utils::DONOTCREATE
             );
 
-            if(!out_file) {
+            if(!pix_group) {
                 process_pixel = true;
-
-                //cout << "File does not exist" << endl;
             } else {
-                //cout << "File exists" << endl;
-                //stringstream group_name;
-                //group_name << stellar_data.healpix_index;
-                //group_name << stellar_data.nside << "-" << stellar_data.healpix_index;
-
-                std::unique_ptr<H5::Group> pix_group = H5Utils::openGroup(
-                    *out_file,
-                    *it,
-                    H5Utils::READ | H5Utils::WRITE | H5Utils::DONOTCREATE
-                );
-
-                if(!pix_group) {
-                    process_pixel = true;
-                } else {
-                    //cout << "Group exists" << endl;
-                    
-                    if(opts.force_pix.size() != 0) {
-                        std::stringstream pix_spec_ss;
-                        pix_spec_ss << stellar_data.nside
-                                    << "-" << stellar_data.healpix_index;
-                        std::string pix_spec_str = pix_spec_ss.str();
-                        for(auto const &s : opts.force_pix) {
-                            if(pix_spec_str == s) {
-                                std::cerr << "Force-reprocessing pixel " << s << std::endl;
-                                process_pixel = true;
-                                break;
-                            }
-                        }
-                    }
-                    
-                    if(opts.sample_stars) {
-                        if(!H5Utils::dataset_exists("stellar chains", *pix_group)) {
+                //cout << "Group exists" << endl;
+                
+                if(opts.force_pix.size() != 0) {
+                    std::stringstream pix_spec_ss;
+                    pix_spec_ss << stellar_data.nside
+                                << "-" << stellar_data.healpix_index;
+                    std::string pix_spec_str = pix_spec_ss.str();
+                    for(auto const &s : opts.force_pix) {
+                        if(pix_spec_str == s) {
+                            std::cerr << "Force-reprocessing pixel " << s << std::endl;
                             process_pixel = true;
+                            break;
                         }
                     }
-                    if(opts.save_surfs) {
-                        if(!H5Utils::dataset_exists("stellar pdfs", *pix_group)) {
-                            process_pixel = true;
-                        }
+                }
+                
+                if(opts.sample_stars) {
+                    if(!H5Utils::dataset_exists("stellar chains", *pix_group)) {
+                        process_pixel = true;
+                    }
+                }
+                if(opts.save_surfs) {
+                    if(!H5Utils::dataset_exists("stellar pdfs", *pix_group)) {
+                        process_pixel = true;
                     }
+                }
 
-                    if((!process_pixel) && (opts.N_clouds != 0)) {
-                        if(!H5Utils::dataset_exists("clouds", *pix_group)) {
-                            process_pixel = true;
-                        }
+                if((!process_pixel) && (opts.N_clouds != 0)) {
+                    if(!H5Utils::dataset_exists("clouds", *pix_group)) {
+                        process_pixel = true;
                     }
+                }
 
-                    if((!process_pixel) && (opts.N_regions != 0)) {
-                        if(!H5Utils::dataset_exists("los", *pix_group)) {
-                            process_pixel = true;
-                        }
+                if((!process_pixel) && (opts.N_regions != 0)) {
+                    if(!H5Utils::dataset_exists("los", *pix_group)) {
+                        process_pixel = true;
                     }
-                    
-                    if((!process_pixel) && (opts.discrete_los)) {
-                        if(!H5Utils::dataset_exists("discrete-los", *pix_group)) {
-                            process_pixel = true;
-                        }
+                }
+                
+                if((!process_pixel) && (opts.discrete_los)) {
+                    if(!H5Utils::dataset_exists("discrete-los", *pix_group)) {
+                        process_pixel = true;
                     }
+                }
 
-                    // If pixel is missing data, remove it, so that it can be regenerated
-                    if(process_pixel) {
-                        try {
-                            out_file->unlink(*it);
-                        } catch(H5::FileIException unlink_err) {
-                            cout << "Unable to remove group: '" << *it << "'"
-                                 << endl;
-                        }
+                // If pixel is missing data, remove it, so that it can be regenerated
+                if(process_pixel) {
+                    try {
+                        out_file->unlink(pix_name);
+                    } catch(H5::FileIException unlink_err) {
+                        cout << "Unable to remove group: '" << pix_name << "'"
+                             << endl;
                     }
                 }
             }
+        }
 
-            if(!process_pixel) {
-                cout << "# Pixel is already present in output. Skipping."
-                     << endl << endl;
+        if(!process_pixel) {
+            cout << "# Pixel is already present in output. Skipping."
+                 << endl << endl;
 
-                continue; // All information is already present in output file
-            }
+            return 0; // All information is already present in output file
         }
+    }
 
-        // Prepare data structures for stellar parameters
-        unsigned int n_stars = stellar_data.star.size();
-        std::unique_ptr<TImgStack> img_stack(new TImgStack(n_stars));
-        vector<bool> conv;
-        vector<double> lnZ;
-        vector<double> chi2;
-
-        bool gatherSurfs = (opts.N_regions || opts.N_clouds || opts.save_surfs);
-
-        // Sample individual stars
-        if(!opts.sample_stars) {
-            // Grid evaluation of stellar models
-            grid_eval_stars(los_model, ext_model, *emplib,
-                            stellar_data, EBV_smoothing,
-                            *img_stack, chi2,
-                            opts.save_surfs,
-                            opts.save_gridstars,
-                            opts.output_fname,
-                            opts.star_priors,
-                            opts.use_gaia,
-                            opts.mean_RV, opts.verbosity);
-        } else if(opts.synthetic) {
-            // MCMC sampling of synthetic stellar model
-            sample_indiv_synth(opts.output_fname, star_options, los_model, *synthlib, ext_model,
-                               stellar_data, *img_stack, conv, lnZ, opts.sigma_RV,
-                               opts.min_EBV, opts.save_surfs, gatherSurfs, opts.verbosity);
-        } else {
-            #ifdef _USE_PARALLEL_TEMPERING__
-            // MCMC sampling of empirical stellar model
-            sample_indiv_emp_pt(opts.output_fname, star_options, los_model,
-                                *emplib, ext_model, EBV_smoothing,
-                                stellar_data, *img_stack, conv, lnZ,
-                                opts.mean_RV, opts.sigma_RV, opts.min_EBV,
-                                opts.save_surfs, gatherSurfs, opts.star_priors,
-                                opts.verbosity);
-            #else // _USE_PARALLEL_TEMPERING
-            // MCMC sampling of empirical stellar model
-            sample_indiv_emp(opts.output_fname, star_options, los_model,
-                             *emplib, ext_model, EBV_smoothing,
-                             stellar_data, *img_stack, conv, lnZ,
-                             opts.mean_RV, opts.sigma_RV, opts.min_EBV,
-                             opts.save_surfs, gatherSurfs, opts.star_priors,
-                             opts.verbosity);
-            #endif // _USE_PARALLEL_TERMPERING
-        }
+    // Prepare data structures for stellar parameters
+    unsigned int n_stars = stellar_data.star.size();
+    std::unique_ptr<TImgStack> img_stack(new TImgStack(n_stars));
+    vector<bool> conv;
+    vector<double> lnZ;
+    vector<double> chi2;
+
+    bool gatherSurfs = (opts.N_regions || opts.N_clouds || opts.save_surfs);
+
+    // Sample individual stars
+    if(!opts.sample_stars) {
+        // Grid evaluation of stellar models
+        grid_eval_stars(los_model, ext_model, *emplib,
+                        stellar_data, EBV_smoothing,
+                        *img_stack, chi2,
+                        opts.save_surfs,
+                        opts.save_gridstars,
+                        opts.output_fname,
+                        opts.star_priors,
+                        opts.use_gaia,
+                        opts.mean_RV, opts.verbosity,
+                        opts.two_pass_grid,
+                        opts.chi2_cut,
+                        opts.subpixel_max,
+                        opts.analytic_splat,
+                        opts.kernel_cache_size,
+                        opts.adaptive_grid_factor);
+    } else if(opts.synthetic) {
+        // MCMC sampling of synthetic stellar model
+        sample_indiv_synth(opts.output_fname, star_options, los_model, *synthlib, ext_model,
+                           stellar_data, *img_stack, conv, lnZ, opts.sigma_RV,
+                           opts.min_EBV, opts.save_surfs, gatherSurfs, opts.verbosity);
+    } else {
+        #ifdef _USE_PARALLEL_TEMPERING__
+        // MCMC sampling of empirical stellar model
+        sample_indiv_emp_pt(opts.output_fname, star_options, los_model,
+                            *emplib, ext_model, EBV_smoothing,
+                            stellar_data, *img_stack, conv, lnZ,
+                            opts.mean_RV, opts.sigma_RV, opts.min_EBV,
+                            opts.save_surfs, gatherSurfs, opts.star_priors,
+                            opts.verbosity);
+        #else // _USE_PARALLEL_TEMPERING
+        // MCMC sampling of empirical stellar model
+        sample_indiv_emp(opts.output_fname, star_options, los_model,
+                         *emplib, ext_model, EBV_smoothing,
+                         stellar_data, *img_stack, conv, lnZ,
+                         opts.mean_RV, opts.sigma_RV, opts.min_EBV,
+                         opts.save_surfs, gatherSurfs, opts.star_priors,
+                         opts.verbosity);
+        #endif // _USE_PARALLEL_TERMPERING
+    }
 
-        clock_gettime(CLOCK_MONOTONIC, &t_mid);
+    clock_gettime(CLOCK_MONOTONIC, &t_mid);
 
-        // Tag output pixel with HEALPix nside and index
-        stringstream group_name;
-        group_name << "/" << *it;
+    // Tag output pixel with HEALPix nside and index
+    stringstream group_name;
+    group_name << "/" << pix_name;
 
-        try {
-            H5Utils::add_watermark<uint32_t>(opts.output_fname, group_name.str(), "nside", stellar_data.nside);
-            H5Utils::add_watermark<uint64_t>(opts.output_fname, group_name.str(), "healpix_index", stellar_data.healpix_index);
-            H5Utils::add_watermark<double>(opts.output_fname, group_name.str(), "l", stellar_data.l);
-            H5Utils::add_watermark<double>(opts.output_fname, group_name.str(), "b", stellar_data.b);
-            H5Utils::add_watermark<uint32_t>(opts.output_fname, group_name.str(), "n_stars", stellar_data.star.size());
-        } catch(H5::AttributeIException err_att_exists) { }
+    try {
+        H5Utils::add_watermark<uint32_t>(opts.output_fname, group_name.str(), "nside", stellar_data.nside);
+        H5Utils::add_watermark<uint64_t>(opts.output_fname, group_name.str(), "healpix_index", stellar_data.healpix_index);
+        H5Utils::add_watermark<double>(opts.output_fname, group_name.str(), "l", stellar_data.l);
+        H5Utils::add_watermark<double>(opts.output_fname, group_name.str(), "b", stellar_data.b);
+        H5Utils::add_watermark<uint32_t>(opts.output_fname, group_name.str(), "n_stars", stellar_data.star.size());
+    } catch(H5::AttributeIException err_att_exists) { }
 
-        // Filter based on goodness-of-fit and convergence
-        vector<bool> keep;
-        bool filter_tmp;
-        size_t n_filtered = 0;
+    // Filter based on goodness-of-fit and convergence
+    vector<bool> keep;
+    bool filter_tmp;
+    size_t n_filtered = 0;
 
-        std::vector<double> subpixel;
-        vector<double> lnZ_filtered;
+    std::vector<double> subpixel;
+    vector<double> lnZ_filtered;
 
-        if(opts.sample_stars) {
-            // For sampled stars, use convergence and lnZ
-            assert(conv.size() == lnZ.size());
-            for(vector<double>::iterator it_lnZ = lnZ.begin(); it_lnZ != lnZ.end(); ++it_lnZ) {
-                if(!std::isnan(*it_lnZ) && !is_inf_replacement(*it_lnZ)) {
-                    lnZ_filtered.push_back(*it_lnZ);
-                }
-            }
-            double lnZmax = percentile_const(lnZ_filtered, 95.0);
-            if(opts.verbosity >= 2) {
-                cout << "# ln(Z)_95pct = " << lnZmax << endl;
+    if(opts.sample_stars) {
+        // For sampled stars, use convergence and lnZ
+        assert(conv.size() == lnZ.size());
+        for(vector<double>::iterator it_lnZ = lnZ.begin(); it_lnZ != lnZ.end(); ++it_lnZ) {
+            if(!std::isnan(*it_lnZ) && !is_inf_replacement(*it_lnZ)) {
+                lnZ_filtered.push_back(*it_lnZ);
             }
+        }
+        double lnZmax = percentile_const(lnZ_filtered, 95.0);
+        if(opts.verbosity >= 2) {
+            cout << "# ln(Z)_95pct = " << lnZmax << endl;
+        }
 
-            lnZ_filtered.clear();
-            for(size_t n=0; n<conv.size(); n++) {
-                filter_tmp = conv[n]
-                             && (lnZ[n] > lnZmax - (25. + opts.ev_cut))
-                             && !std::isnan(lnZ[n])
-                             && !is_inf_replacement(lnZ[n])
-                             && (stellar_data.star[n].EBV < opts.subpixel_max);
-                keep.push_back(filter_tmp);
-                if(filter_tmp) {
-                    subpixel.push_back(stellar_data.star[n].EBV);
-                    lnZ_filtered.push_back(lnZ[n] - lnZmax);
-                } else {
-                    n_filtered++;
-                }
+        lnZ_filtered.clear();
+        for(size_t n=0; n<conv.size(); n++) {
+            filter_tmp = conv[n]
+                         && (lnZ[n] > lnZmax - (25. + opts.ev_cut))
+                         && !std::isnan(lnZ[n])
+                         && !is_inf_replacement(lnZ[n])
+                         && (stellar_data.star[n].EBV < opts.subpixel_max);
+            keep.push_back(filter_tmp);
+            if(filter_tmp) {
+                subpixel.push_back(stellar_data.star[n].EBV);
+                lnZ_filtered.push_back(lnZ[n] - lnZmax);
+            } else {
+                n_filtered++;
+            }
+        }
+    } else {
+        // For grid-evaluated stars, use chi^2 / passband
+        for(size_t n=0; n<chi2.size(); n++) {
+            filter_tmp = (chi2[n] < opts.chi2_cut)
+                         && !std::isnan(chi2[n])
+                         && !is_inf_replacement(chi2[n])
+                         && (stellar_data.star[n].EBV < opts.subpixel_max);
+            keep.push_back(filter_tmp);
+            if(filter_tmp) {
+                subpixel.push_back(stellar_data.star[n].EBV);
+                lnZ_filtered.push_back(0.); // Dummy value
+            } else {
+                n_filtered++;
             }
+        }
+        // Save # of rejected stars
+        try {
+            H5Utils::add_watermark<uint32_t>(opts.output_fname, group_name.str(), "n_stars_rejected", n_filtered);
+        } catch(H5::AttributeIException err_att_exists) { }
+        // Save rejection fraction
+        double reject_frac = (double)n_filtered / chi2.size();
+        try {
+            H5Utils::add_watermark<double>(opts.output_fname, group_name.str(), "reject_frac", reject_frac);
+        } catch(H5::AttributeIException err_att_exists) { }
+    }
+    if(gatherSurfs) { img_stack->cull(keep); }
+    if(gatherSurfs && opts.sparse_images) { img_stack->compact(); }
+
+    cout << "# of stars filtered: "
+         << n_filtered << " of " << n_stars;
+    cout << " (" << 100. * (double)n_filtered / n_stars
+         << " %)" << endl;
+
+    // Fit line-of-sight extinction profile
+    if((opts.N_clouds != 0) || (opts.N_regions != 0) || opts.discrete_los) {
+        if(n_filtered >= n_stars) {
+            cout << "Every star was rejected!" << endl;
         } else {
-            // For grid-evaluated stars, use chi^2 / passband
-            for(size_t n=0; n<chi2.size(); n++) {
-                filter_tmp = (chi2[n] < opts.chi2_cut)
-                             && !std::isnan(chi2[n])
-                             && !is_inf_replacement(chi2[n])
-                             && (stellar_data.star[n].EBV < opts.subpixel_max);
-                keep.push_back(filter_tmp);
-                if(filter_tmp) {
-                    subpixel.push_back(stellar_data.star[n].EBV);
-                    lnZ_filtered.push_back(0.); // Dummy value
+            double p0 = exp(-5. - opts.ev_cut);
+            double EBV_max = -1.;
+            if(opts.SFD_prior) {
+                if(opts.SFD_subpixel) {
+                    EBV_max = 1.;
                 } else {
-                    n_filtered++;
+                    EBV_max = stellar_data.EBV;
                 }
             }
-            // Save # of rejected stars
-            try {
-                H5Utils::add_watermark<uint32_t>(opts.output_fname, group_name.str(), "n_stars_rejected", n_filtered);
-            } catch(H5::AttributeIException err_att_exists) { }
-            // Save rejection fraction
-            double reject_frac = (double)n_filtered / chi2.size();
-            try {
-                H5Utils::add_watermark<double>(opts.output_fname, group_name.str(), "reject_frac", reject_frac);
-            } catch(H5::AttributeIException err_att_exists) { }
-        }
-        if(gatherSurfs) { img_stack->cull(keep); }
 
-        cout << "# of stars filtered: "
-             << n_filtered << " of " << n_stars;
-        cout << " (" << 100. * (double)n_filtered / n_stars
-             << " %)" << endl;
+            TLOSMCMCParams params(
+                img_stack.get(), lnZ_filtered, p0,
+                opts.N_runs, n_threads,
+                opts.N_regions, EBV_max
+            );
+            if(opts.SFD_subpixel) { params.set_subpixel_mask(subpixel); }
+            params.img_cumsum_max_MB = opts.cloud_cumsum_MB;
 
-        // Fit line-of-sight extinction profile
-        if((opts.N_clouds != 0) || (opts.N_regions != 0) || opts.discrete_los) {
-            if(n_filtered >= n_stars) {
-                cout << "Every star was rejected!" << endl;
-            } else {
-                double p0 = exp(-5. - opts.ev_cut);
-                double EBV_max = -1.;
-                if(opts.SFD_prior) {
-                    if(opts.SFD_subpixel) {
-                        EBV_max = 1.;
-                    } else {
-                        EBV_max = stellar_data.EBV;
+            if(opts.test_mode) {
+                test_extinction_profiles(params);
+            }
+
+            // Sample discrete l.o.s. model
+            if(opts.discrete_los) {
+                std::unique_ptr<TNeighborPixels> neighbor_pixels;
+
+                if((opts.neighbor_lookup_fname != "NONE") &&
+                   (opts.pixel_lookup_fname != "NONE") &&
+                   (opts.output_fname_pattern != "NONE"))
+                {
+                    // Load information on neighboring pixels
+                    cout << "Loading information on neighboring pixels ..." << endl;
+                    neighbor_pixels = std::make_unique<TNeighborPixels>(
+                        stellar_data.nside,
+                        stellar_data.healpix_index,
+                        opts.neighbor_lookup_fname,
+                        opts.pixel_lookup_fname,
+                        opts.output_fname_pattern,
+                        1000);
+                    
+                    if(!neighbor_pixels->data_loaded()) {
+                        cerr << "Failed to load neighboring pixels! Aborting."
+                             << endl;
+                        return 1;
                     }
+                    
+                    // Calculate covariance matrices tying
+                    // pixels together at each distance
+                    neighbor_pixels->init_covariance(
+                        opts.correlation_scale,
+                        opts.d_soft,
+                        opts.gamma_soft);
                 }
-
-                TLOSMCMCParams params(
-                    img_stack.get(), lnZ_filtered, p0,
-                    opts.N_runs, opts.N_threads,
-                    opts.N_regions, EBV_max
+                
+                TDiscreteLosMcmcParams discrete_los_params(
+                    std::move(img_stack),
+                    std::move(neighbor_pixels),
+                    1, 1,
+                    opts.verbosity);
+                discrete_los_params.initialize_priors(
+                    los_model,
+                    opts.log_Delta_EBV_floor,
+                    opts.log_Delta_EBV_ceil,
+                    opts.sigma_log_Delta_EBV,
+                    opts.verbosity
                 );
-                if(opts.SFD_subpixel) { params.set_subpixel_mask(subpixel); }
-
-                if(opts.test_mode) {
-                    test_extinction_profiles(params);
+                
+                std::vector<uint16_t> neighbor_sample;
+
+                if(discrete_los_params.neighbor_pixels) {
+                    cout << "Initializing dominant distances ..." << endl;
+                    discrete_los_params.neighbor_pixels->init_dominant_dist(opts.verbosity);
+
+                    //cout << "Resampling neighboring pixels ..." << endl;
+                    //sample_neighbors(*(discrete_los_params.neighbor_pixels), opts.verbosity);
+                    //sample_neighbors_pt(
+                    //    *(discrete_los_params.neighbor_pixels),
+                    //    neighbor_sample,
+                    //    opts.verbosity
+                    //);
                 }
 
-                // Sample discrete l.o.s. model
-                if(opts.discrete_los) {
-                    std::unique_ptr<TNeighborPixels> neighbor_pixels;
-
-                    if((opts.neighbor_lookup_fname != "NONE") &&
-                       (opts.pixel_lookup_fname != "NONE") &&
-                       (opts.output_fname_pattern != "NONE"))
-                    {
-                        // Load information on neighboring pixels
-                        cout << "Loading information on neighboring pixels ..." << endl;
-                        neighbor_pixels = std::make_unique<TNeighborPixels>(
-                            stellar_data.nside,
-                            stellar_data.healpix_index,
-                            opts.neighbor_lookup_fname,
-                            opts.pixel_lookup_fname,
-                            opts.output_fname_pattern,
-                            1000);
-                        
-                        if(!neighbor_pixels->data_loaded()) {
-                            cerr << "Failed to load neighboring pixels! Aborting."
-                                 << endl;
-                            return 1;
-                        }
-                        
-                        // Calculate covariance matrices tying
-                        // pixels together at each distance
-                        neighbor_pixels->init_covariance(
-                            opts.correlation_scale,
-                            opts.d_soft,
-                            opts.gamma_soft);
-                    }
-                    
-                    TDiscreteLosMcmcParams discrete_los_params(
-                        std::move(img_stack),
-                        std::move(neighbor_pixels),
-                        1, 1,
-                        opts.verbosity);
-                    discrete_los_params.initialize_priors(
+                cout << "Sampling line of sight discretely ..." << endl;
+                sample_los_extinction_discrete(
+                    opts.output_fname,
+                    pix_name,
+                    discrete_los_options,
+                    discrete_los_params,
+                    neighbor_sample,
+                    opts.dsc_samp_settings,
+                    opts.verbosity
+                );
+                cout << "Done with discrete sampling." << endl;
+            }
+
+            if(opts.N_clouds != 0) {
+                sample_los_extinction_clouds(
+                    opts.output_fname, pix_name,
+                    cloud_options, params,
+                    opts.N_clouds, opts.verbosity
+                );
+            }
+            if(opts.N_regions != 0) {
+                // Covariance matrix for guess has (anti-)correlation
+                // length of 1 distance bin
+                params.gen_guess_covariance(1.);
+
+                if(opts.disk_prior) {
+                    params.alpha_skew = 1.;
+                    params.calc_Delta_EBV_prior(
                         los_model,
                         opts.log_Delta_EBV_floor,
                         opts.log_Delta_EBV_ceil,
-                        opts.sigma_log_Delta_EBV,
-                        opts.verbosity
-                    );
-                    
-                    std::vector<uint16_t> neighbor_sample;
-
-                    if(discrete_los_params.neighbor_pixels) {
-                        cout << "Initializing dominant distances ..." << endl;
-                        discrete_los_params.neighbor_pixels->init_dominant_dist(opts.verbosity);
-
-                        //cout << "Resampling neighboring pixels ..." << endl;
-                        //sample_neighbors(*(discrete_los_params.neighbor_pixels), opts.verbosity);
-                        //sample_neighbors_pt(
-                        //    *(discrete_los_params.neighbor_pixels),
-                        //    neighbor_sample,
-                        //    opts.verbosity
-                        //);
-                    }
-
-                    cout << "Sampling line of sight discretely ..." << endl;
-                    sample_los_extinction_discrete(
-                        opts.output_fname,
-                        *it,
-                        discrete_los_options,
-                        discrete_los_params,
-                        neighbor_sample,
-                        opts.dsc_samp_settings,
+                        stellar_data.EBV,
+                        1.4,
                         opts.verbosity
                     );
-                    cout << "Done with discrete sampling." << endl;
                 }
 
-                if(opts.N_clouds != 0) {
-                    sample_los_extinction_clouds(
-                        opts.output_fname, *it,
-                        cloud_options, params,
-                        opts.N_clouds, opts.verbosity
-                    );
+                sample_los_extinction(
+                    opts.output_fname, pix_name,
+                    los_options, params, opts.verbosity
+                );
+            }
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t_end);
+    t_tot = (t_end.tv_sec - t_start.tv_sec)
+            + 1.e-9 * (t_end.tv_nsec - t_start.tv_nsec);
+    t_star = (t_mid.tv_sec - t_start.tv_sec)
+            + 1.e-9 * (t_mid.tv_nsec - t_start.tv_nsec);
+    
+    try {
+        H5Utils::add_watermark<float>(opts.output_fname, group_name.str(), "t_tot", (float)t_tot);
+        H5Utils::add_watermark<float>(opts.output_fname, group_name.str(), "t_star", (float)t_star);
+    } catch(H5::AttributeIException err_att_exists) { }
+
+    #pragma omp critical (cout)
+    {
+        if(opts.verbosity >= 1) {
+            cout << endl
+                 << "==================================================="
+                 << endl;
+        }
+        cout << "# Time elapsed for pixel: "
+             << setprecision(2) << t_tot
+             << " s (" << setprecision(2)
+             << t_tot / (double)(stellar_data.star.size())
+             << " s / star)" << endl;
+        cout << "# Percentage of time spent on l.o.s. fit: "
+             << setprecision(2) << 100. * (t_tot - t_star) / t_tot
+             << " %" << endl;
+        if(opts.verbosity >= 1) {
+            cout << "==================================================="
+                 << endl;
+        }
+        cout << endl;
+    }
+
+    return 0;
+}
+
+
+int los_workflow_pixel(
+        TProgramOpts &opts,
+        const string &pix_name,
+        unsigned int pixel_list_no,
+        size_t n_pix,
+        double l, double b, double EBV,
+        uint32_t nside, uint32_t hpidx,
+        TMCMCOptions discrete_los_options)
+{
+    /*
+     * Uses pre-computed stellar posterior densities to
+     * determine the l.o.s. reddening in one pixel.
+     *
+     * Returns 0 on success (or if the pixel is skipped), and
+     * nonzero if processing should be aborted.
+     */
+
+    timespec t_start, t_mid, t_end;
+    double t_tot, t_star;
+
+    clock_gettime(CLOCK_MONOTONIC, &t_start);
+
+    cout << "# Pixel: " << pix_name
+        << " (" << pixel_list_no + 1 << " of " << n_pix << ")"
+        << endl;
+
+    // Load input photometry
+    TGalacticLOSModel los_model(
+        l, b,
+        opts.gal_struct_params
+    );
+    
+    cout << "# HEALPix index: " << hpidx
+         << " (nside = " << nside << ")" << endl;
+    cout << "# (l, b) = "
+         << l << ", " << b << endl;
+    if(opts.SFD_prior) {
+        cout << "# E(B-V)_SFD = " << EBV << endl;
+    }
+    
+    // Load surfaces
+    std::stringstream dset_name;
+    dset_name << "/stellar_pdfs/" << pix_name << "/stellar_pdfs";
+    std::unique_ptr<TImgStack> img_stack = read_img_stack(
+        opts.input_fname,
+        dset_name.str(),
+        opts.sparse_images
+    );
+    
+    unsigned int n_stars = img_stack->N_images;
+    
+    cout << "# " << n_stars << " stars in pixel" << endl;
+
+    // Check if this pixel has already been fully processed
+    if(!(opts.clobber)) {
+        H5Utils::IOLock io_lock;
+        bool process_pixel = false;
+
+        std::unique_ptr<H5::H5File> out_file = H5Utils::openFile(
+            opts.output_fname,
+            H5Utils::READ | H5Utils::WRITE | H5Utils::DONOTCREATE
+        );
+
+        if(!out_file) {
+            process_pixel = true;
+
+            //cout << "File does not exist" << endl;
+        } else {
+            //cout << "File exists" << endl;
+            //stringstream group_name;
+            //group_name << stellar_data.healpix_index;
+            //group_name << stellar_data.nside << "-" << stellar_data.healpix_index;
+
+            std::unique_ptr<H5::Group> pix_group = H5Utils::openGroup(
+                *out_file,
+                pix_name,
+                H5Utils::READ | H5Utils::WRITE | H5Utils::DONOTCREATE
+            );
+
+            if(!pix_group) {
+                process_pixel = true;
+            } else {
+                //cout << "Group exists" << endl;
+                
+                if(opts.force_pix.size() != 0) {
+                    std::stringstream pix_spec_ss;
+                    pix_spec_ss << nside << "-" << hpidx;
+                    std::string pix_spec_str = pix_spec_ss.str();
+                    for(auto const &s : opts.force_pix) {
+                        if(pix_spec_str == s) {
+                            std::cerr << "Force-reprocessing pixel " << s << std::endl;
+                            process_pixel = true;
+                            break;
+                        }
+                    }
                 }
-                if(opts.N_regions != 0) {
-                    // Covariance matrix for guess has (anti-)correlation
-                    // length of 1 distance bin
-                    params.gen_guess_covariance(1.);
-
-                    if(opts.disk_prior) {
-                        params.alpha_skew = 1.;
-                        params.calc_Delta_EBV_prior(
-                            los_model,
-                            opts.log_Delta_EBV_floor,
-                            opts.log_Delta_EBV_ceil,
-                            stellar_data.EBV,
-                            1.4,
-                            opts.verbosity
-                        );
+                
+                if((!process_pixel) && (opts.discrete_los)) {
+                    if(!H5Utils::dataset_exists("discrete-los", *pix_group)) {
+                        process_pixel = true;
                     }
+                }
 
-                    sample_los_extinction(
-                        opts.output_fname, *it,
-                        los_options, params, opts.verbosity
-                    );
+                // If pixel is missing data, remove it, so that it can be regenerated
+                if(process_pixel) {
+                    try {
+                        out_file->unlink(pix_name);
+                    } catch(H5::FileIException unlink_err) {
+                        cout << "Unable to remove group: '" << pix_name << "'"
+                             << endl;
+                    }
                 }
             }
         }
 
-        clock_gettime(CLOCK_MONOTONIC, &t_end);
-        t_tot = (t_end.tv_sec - t_start.tv_sec)
-                + 1.e-9 * (t_end.tv_nsec - t_start.tv_nsec);
-        t_star = (t_mid.tv_sec - t_start.tv_sec)
-                + 1.e-9 * (t_mid.tv_nsec - t_start.tv_nsec);
+        if(!process_pixel) {
+            cout << "# Pixel is already present in output. Skipping."
+                 << endl << endl;
+
+            return 0; // All information is already present in output file
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t_mid);
+
+    // Tag output pixel with HEALPix nside and index
+    stringstream group_name;
+    group_name << "/" << pix_name;
+
+    try {
+        H5Utils::add_watermark<uint32_t>(opts.output_fname, group_name.str(), "nside", nside);
+        H5Utils::add_watermark<uint64_t>(opts.output_fname, group_name.str(), "healpix_index", hpidx);
+        H5Utils::add_watermark<double>(opts.output_fname, group_name.str(), "l", l);
+        H5Utils::add_watermark<double>(opts.output_fname, group_name.str(), "b", b);
+        H5Utils::add_watermark<uint32_t>(opts.output_fname, group_name.str(), "n_stars", n_stars);
+    } catch(H5::AttributeIException err_att_exists) { }
+
+    // Sample discrete l.o.s. model
+    if(opts.discrete_los) {
+        std::unique_ptr<TNeighborPixels> neighbor_pixels;
+
+        if((opts.neighbor_lookup_fname != "NONE") &&
+           (opts.pixel_lookup_fname != "NONE") &&
+           (opts.output_fname_pattern != "NONE"))
+        {
+            // Load information on neighboring pixels
+            cout << "Loading information on neighboring pixels ..." << endl;
+            neighbor_pixels = std::make_unique<TNeighborPixels>(
+                nside,
+                hpidx,
+                opts.neighbor_lookup_fname,
+                opts.pixel_lookup_fname,
+                opts.output_fname_pattern,
+                1000);
+            
+            if(!neighbor_pixels->data_loaded()) {
+                cerr << "Failed to load neighboring pixels! Aborting."
+                     << endl;
+                return 1;
+            }
+            
+            // Calculate covariance matrices tying
+            // pixels together at each distance
+            neighbor_pixels->init_covariance(
+                opts.correlation_scale,
+                opts.d_soft,
+                opts.gamma_soft);
+        }
         
-        try {
-            H5Utils::add_watermark<float>(opts.output_fname, group_name.str(), "t_tot", (float)t_tot);
-            H5Utils::add_watermark<float>(opts.output_fname, group_name.str(), "t_star", (float)t_star);
-        } catch(H5::AttributeIException err_att_exists) { }
+        TDiscreteLosMcmcParams discrete_los_params(
+            std::move(img_stack),
+            std::move(neighbor_pixels),
+            1, 1,
+            opts.verbosity
+        );
+        discrete_los_params.initialize_priors(
+            los_model,
+            opts.log_Delta_EBV_floor,
+            opts.log_Delta_EBV_ceil,
+            opts.sigma_log_Delta_EBV,
+            opts.verbosity
+        );
+        
+        std::vector<uint16_t> neighbor_sample;
+
+        if(discrete_los_params.neighbor_pixels) {
+            cout << "Initializing dominant distances ..." << endl;
+            discrete_los_params.neighbor_pixels->init_dominant_dist(opts.verbosity);
+
+            //cout << "Resampling neighboring pixels ..." << endl;
+            //sample_neighbors(*(discrete_los_params.neighbor_pixels), opts.verbosity);
+            //sample_neighbors_pt(
+            //    *(discrete_los_params.neighbor_pixels),
+            //    neighbor_sample,
+            //    opts.verbosity
+            //);
+        }
+
+        cout << "Sampling line of sight discretely ..." << endl;
+        sample_los_extinction_discrete(
+            opts.output_fname,
+            pix_name,
+            discrete_los_options,
+            discrete_los_params,
+            neighbor_sample,
+            opts.dsc_samp_settings,
+            opts.verbosity
+        );
+        cout << "Done with discrete sampling." << endl;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t_end);
+    t_tot = (t_end.tv_sec - t_start.tv_sec)
+            + 1.e-9 * (t_end.tv_nsec - t_start.tv_nsec);
+    t_star = (t_mid.tv_sec - t_start.tv_sec)
+            + 1.e-9 * (t_mid.tv_nsec - t_start.tv_nsec);
+    
+    try {
+        H5Utils::add_watermark<float>(opts.output_fname, group_name.str(), "t_tot", (float)t_tot);
+        H5Utils::add_watermark<float>(opts.output_fname, group_name.str(), "t_star", (float)t_star);
+    } catch(H5::AttributeIException err_att_exists) { }
 
+    #pragma omp critical (cout)
+    {
         if(opts.verbosity >= 1) {
             cout << endl
                  << "==================================================="
@@ -495,7 +808,7 @@ int full_workflow(TProgramOpts &opts, int argc, char **argv) {
         cout << "# Time elapsed for pixel: "
              << setprecision(2) << t_tot
              << " s (" << setprecision(2)
-             << t_tot / (double)(stellar_data.star.size())
+             << t_tot / (double)(n_stars)
              << " s / star)" << endl;
         cout << "# Percentage of time spent on l.o.s. fit: "
              << setprecision(2) << 100. * (t_tot - t_star) / t_tot
@@ -507,6 +820,125 @@ int full_workflow(TProgramOpts &opts, int argc, char **argv) {
         cout << endl;
     }
 
+    return 0;
+}
+
+
+int full_workflow(TProgramOpts &opts, int argc, char **argv) {
+    /*
+     * Determines stellar posterior densities,
+     * then determines the l.o.s. reddening.
+     */
+
+
+    /*
+     *  MCMC Options
+     */
+
+    TMCMCOptions star_options(opts.star_steps, opts.star_samplers, opts.star_p_replacement, opts.N_runs);
+    TMCMCOptions cloud_options(opts.cloud_steps, opts.cloud_samplers, opts.cloud_p_replacement, opts.N_runs);
+    TMCMCOptions los_options(opts.los_steps, opts.los_samplers, opts.los_p_replacement, opts.N_runs);
+
+    TMCMCOptions discrete_los_options(opts.discrete_steps, 1, 0., opts.N_runs);    // TODO: Create commandline options for this
+
+
+    /*
+     *  Construct models
+     */
+
+    TStellarModel *emplib = NULL;
+    TSyntheticStellarModel *synthlib = NULL;
+    if(opts.synthetic) {
+        synthlib = new TSyntheticStellarModel(DATADIR "PS1templates.h5");
+    } else {
+        emplib = new TStellarModel(opts.LF_fname, opts.template_fname);
+    }
+    // Each pixel worker constructs its own extinction model, as the
+    // spline accelerators it holds are not safe to share.
+
+    TEBVSmoothing EBV_smoothing(opts.smoothing_alpha_coeff,
+                                opts.smoothing_beta_coeff,
+                                opts.pct_smoothing_min,
+                                opts.pct_smoothing_max);
+
+    /*
+     *  Execute
+     */
+
+    omp_set_num_threads(opts.N_threads);
+
+    // Get list of pixels in input file
+    vector<string> pix_name;
+    get_input_pixels(opts.input_fname, pix_name);
+    cout << "# " << pix_name.size() << " pixels in input file." << endl << endl;
+
+    // Remove the output file
+    if(opts.clobber) {
+        remove(opts.output_fname.c_str());
+    }
+
+    H5::Exception::dontPrint();
+
+    // Run each pixel. Pixels are independent, so they are handed out
+    // to a pool of workers. Each worker owns its own extinction model,
+    // and every pixel builds its own l.o.s. model, image stack and
+    // sampler workspaces. All HDF5 I/O is serialized through
+    // H5Utils::IOLock.
+    unsigned int n_pix_workers = opts.N_pix_workers;
+    if(n_pix_workers > pix_name.size()) {
+        n_pix_workers = std::max<size_t>(1, pix_name.size());
+    }
+    // The parameter objects index per-thread workspaces by
+    // omp_get_thread_num(), which returns the worker index
+    // outside of nested regions.
+    unsigned int n_threads = std::max(opts.N_threads, n_pix_workers);
+
+    if(n_pix_workers > 1) {
+        // Pixel-level parallelism replaces the parallelism within pixels
+        omp_set_max_active_levels(1);
+        cout << "# Processing " << n_pix_workers
+             << " pixels concurrently." << endl << endl;
+    }
+
+    // Restores cout and cerr when it goes out of scope
+    std::unique_ptr<TPixelLogs> pixel_logs;
+    if(n_pix_workers > 1) { pixel_logs.reset(new TPixelLogs()); }
+
+    int status = 0;
+
+    #pragma omp parallel num_threads(n_pix_workers)
+    {
+        TExtinctionModel ext_model(opts.ext_model_fname);
+
+        #pragma omp for schedule(dynamic, 1)
+        for(size_t pixel_list_no = 0; pixel_list_no < pix_name.size(); pixel_list_no++) {
+            int status_tmp;
+            #pragma omp atomic read
+            status_tmp = status;
+            if(status_tmp != 0) { continue; }
+
+            if(pixel_logs) { pixel_logs->begin(); }
+
+            int res = full_workflow_pixel(
+                opts, pix_name[pixel_list_no],
+                pixel_list_no, pix_name.size(),
+                star_options, cloud_options,
+                los_options, discrete_los_options,
+                emplib, synthlib, ext_model, EBV_smoothing,
+                n_threads
+            );
+
+            if(pixel_logs) { pixel_logs->end(); }
+
+            if(res != 0) {
+                #pragma omp atomic write
+                status = res;
+            }
+        }
+    }
+
+    if(status != 0) { return status; }
+
 
     /*
      *  Add additional metadata to output file
@@ -603,238 +1035,61 @@ int los_workflow(TProgramOpts &opts, int argc, char **argv) {
 
     H5::Exception::dontPrint();
 
-    // Run each pixel
-    timespec t_start, t_mid, t_end;
-
-    double t_tot, t_star;
-    unsigned int pixel_list_no = 0;
-
-    for(vector<string>::iterator it = pix_name.begin(); it != pix_name.end(); ++it, pixel_list_no++) {
-        clock_gettime(CLOCK_MONOTONIC, &t_start);
-
-        cout << "# Pixel: " << *it
-            << " (" << pixel_list_no + 1 << " of " << pix_name.size() << ")"
-            << endl;
-
-        double l = pix_l.at(pixel_list_no);
-        double b = pix_b.at(pixel_list_no);
-        double EBV = pix_EBV.at(pixel_list_no);
-        uint32_t nside = pix_nside.at(pixel_list_no);
-        uint32_t hpidx = pix_idx.at(pixel_list_no);
-        
-        // Load input photometry
-        TGalacticLOSModel los_model(
-            l, b,
-            opts.gal_struct_params
-        );
-        
-        cout << "# HEALPix index: " << hpidx
-             << " (nside = " << nside << ")" << endl;
-        cout << "# (l, b) = "
-             << l << ", " << b << endl;
-        if(opts.SFD_prior) {
-            cout << "# E(B-V)_SFD = " << EBV << endl;
-        }
-        
-        // Load surfaces
-        std::stringstream dset_name;
-        dset_name << "/stellar_pdfs/" << *it << "/stellar_pdfs";
-        std::unique_ptr<TImgStack> img_stack = read_img_stack(
-            opts.input_fname,
-            dset_name.str()
-        );
-        
-        unsigned int n_stars = img_stack->N_images;
-        
-        cout << "# " << n_stars << " stars in pixel" << endl;
+    // Run each pixel. Pixels are independent, so they are handed out
+    // to a pool of workers. Every pixel builds its own l.o.s. model,
+    // image stack and sampler workspaces. All HDF5 I/O is serialized
+    // through H5Utils::IOLock.
+    unsigned int n_pix_workers = opts.N_pix_workers;
+    if(n_pix_workers > pix_name.size()) {
+        n_pix_workers = std::max<size_t>(1, pix_name.size());
+    }
 
-        // Check if this pixel has already been fully processed
-        if(!(opts.clobber)) {
-            bool process_pixel = false;
+    if(n_pix_workers > 1) {
+        // Pixel-level parallelism replaces the parallelism within pixels
+        omp_set_max_active_levels(1);
+        cout << "# Processing " << n_pix_workers
+             << " pixels concurrently." << endl << endl;
+    }
 
-            std::unique_ptr<H5::H5File> out_file = H5Utils::openFile(
-                opts.output_fname,
-                H5Utils::READ | H5Utils::WRITE | H5Utils::DONOTCREATE
+    // Restores cout and cerr when it goes out of scope
+    std::unique_ptr<TPixelLogs> pixel_logs;
+    if(n_pix_workers > 1) { pixel_logs.reset(new TPixelLogs()); }
+
+    int status = 0;
+
+    #pragma omp parallel num_threads(n_pix_workers)
+    {
+        #pragma omp for schedule(dynamic, 1)
+        for(size_t pixel_list_no = 0; pixel_list_no < pix_name.size(); pixel_list_no++) {
+            int status_tmp;
+            #pragma omp atomic read
+            status_tmp = status;
+            if(status_tmp != 0) { continue; }
+
+            if(pixel_logs) { pixel_logs->begin(); }
+
+            int res = los_workflow_pixel(
+                opts, pix_name[pixel_list_no],
+                pixel_list_no, pix_name.size(),
+                pix_l.at(pixel_list_no),
+                pix_b.at(pixel_list_no),
+                pix_EBV.at(pixel_list_no),
+                pix_nside.at(pixel_list_no),
+                pix_idx.at(pixel_list_no),
+                discrete_los_options
             );
 
-            if(!out_file) {
-                process_pixel = true;
-
-                //cout << "File does not exist" << endl;
-            } else {
-                //cout << "File exists" << endl;
-                //stringstream group_name;
-                //group_name << stellar_data.healpix_index;
-                //group_name << stellar_data.nside << "-" << stellar_data.healpix_index;
-
-                std::unique_ptr<H5::Group> pix_group = H5Utils::openGroup(
-                    *out_file,
-                    *it,
-                    H5Utils::READ | H5Utils::WRITE | H5Utils::DONOTCREATE
-                );
+            if(pixel_logs) { pixel_logs->end(); }
 
-                if(!pix_group) {
-                    process_pixel = true;
-                } else {
-                    //cout << "Group exists" << endl;
-                    
-                    if(opts.force_pix.size() != 0) {
-                        std::stringstream pix_spec_ss;
-                        pix_spec_ss << nside << "-" << hpidx;
-                        std::string pix_spec_str = pix_spec_ss.str();
-                        for(auto const &s : opts.force_pix) {
-                            if(pix_spec_str == s) {
-                                std::cerr << "Force-reprocessing pixel " << s << std::endl;
-                                process_pixel = true;
-                                break;
-                            }
-                        }
-                    }
-                    
-                    if((!process_pixel) && (opts.discrete_los)) {
-                        if(!H5Utils::dataset_exists("discrete-los", *pix_group)) {
-                            process_pixel = true;
-                        }
-                    }
-
-                    // If pixel is missing data, remove it, so that it can be regenerated
-                    if(process_pixel) {
-                        try {
-                            out_file->unlink(*it);
-                        } catch(H5::FileIException unlink_err) {
-                            cout << "Unable to remove group: '" << *it << "'"
-                                 << endl;
-                        }
-                    }
-                }
-            }
-
-            if(!process_pixel) {
-                cout << "# Pixel is already present in output. Skipping."
-                     << endl << endl;
-
-                continue; // All information is already present in output file
-            }
-        }
-
-        clock_gettime(CLOCK_MONOTONIC, &t_mid);
-
-        // Tag output pixel with HEALPix nside and index
-        stringstream group_name;
-        group_name << "/" << *it;
-
-        try {
-            H5Utils::add_watermark<uint32_t>(opts.output_fname, group_name.str(), "nside", nside);
-            H5Utils::add_watermark<uint64_t>(opts.output_fname, group_name.str(), "healpix_index", hpidx);
-            H5Utils::add_watermark<double>(opts.output_fname, group_name.str(), "l", l);
-            H5Utils::add_watermark<double>(opts.output_fname, group_name.str(), "b", b);
-            H5Utils::add_watermark<uint32_t>(opts.output_fname, group_name.str(), "n_stars", n_stars);
-        } catch(H5::AttributeIException err_att_exists) { }
-
-        // Sample discrete l.o.s. model
-        if(opts.discrete_los) {
-            std::unique_ptr<TNeighborPixels> neighbor_pixels;
-
-            if((opts.neighbor_lookup_fname != "NONE") &&
-               (opts.pixel_lookup_fname != "NONE") &&
-               (opts.output_fname_pattern != "NONE"))
-            {
-                // Load information on neighboring pixels
-                cout << "Loading information on neighboring pixels ..." << endl;
-                neighbor_pixels = std::make_unique<TNeighborPixels>(
-                    nside,
-                    hpidx,
-                    opts.neighbor_lookup_fname,
-                    opts.pixel_lookup_fname,
-                    opts.output_fname_pattern,
-                    1000);
-                
-                if(!neighbor_pixels->data_loaded()) {
-                    cerr << "Failed to load neighboring pixels! Aborting."
-                         << endl;
-                    return 1;
-                }
-                
-                // Calculate covariance matrices tying
-                // pixels together at each distance
-                neighbor_pixels->init_covariance(
-                    opts.correlation_scale,
-                    opts.d_soft,
-                    opts.gamma_soft);
+            if(res != 0) {
+                #pragma omp atomic write
+                status = res;
             }
-            
-            TDiscreteLosMcmcParams discrete_los_params(
-                std::move(img_stack),
-                std::move(neighbor_pixels),
-                1, 1,
-                opts.verbosity
-            );
-            discrete_los_params.initialize_priors(
-                los_model,
-                opts.log_Delta_EBV_floor,
-                opts.log_Delta_EBV_ceil,
-                opts.sigma_log_Delta_EBV,
-                opts.verbosity
-            );
-            
-            std::vector<uint16_t> neighbor_sample;
-
-            if(discrete_los_params.neighbor_pixels) {
-                cout << "Initializing dominant distances ..." << endl;
-                discrete_los_params.neighbor_pixels->init_dominant_dist(opts.verbosity);
-
-                //cout << "Resampling neighboring pixels ..." << endl;
-                //sample_neighbors(*(discrete_los_params.neighbor_pixels), opts.verbosity);
-                //sample_neighbors_pt(
-                //    *(discrete_los_params.neighbor_pixels),
-                //    neighbor_sample,
-                //    opts.verbosity
-                //);
-            }
-
-            cout << "Sampling line of sight discretely ..." << endl;
-            sample_los_extinction_discrete(
-                opts.output_fname,
-                *it,
-                discrete_los_options,
-                discrete_los_params,
-                neighbor_sample,
-                opts.dsc_samp_settings,
-                opts.verbosity
-            );
-            cout << "Done with discrete sampling." << endl;
         }
+    }
 
-        clock_gettime(CLOCK_MONOTONIC, &t_end);
-        t_tot = (t_end.tv_sec - t_start.tv_sec)
-                + 1.e-9 * (t_end.tv_nsec - t_start.tv_nsec);
-        t_star = (t_mid.tv_sec - t_start.tv_sec)
-                + 1.e-9 * (t_mid.tv_nsec - t_start.tv_nsec);
-        
-        try {
-            H5Utils::add_watermark<float>(opts.output_fname, group_name.str(), "t_tot", (float)t_tot);
-            H5Utils::add_watermark<float>(opts.output_fname, group_name.str(), "t_star", (float)t_star);
-        } catch(H5::AttributeIException err_att_exists) { }
+    if(status != 0) { return status; }
 
-        if(opts.verbosity >= 1) {
-            cout << endl
-                 << "==================================================="
-                 << endl;
-        }
-        cout << "# Time elapsed for pixel: "
-             << setprecision(2) << t_tot
-             << " s (" << setprecision(2)
-             << t_tot / (double)(n_stars)
-             << " s / star)" << endl;
-        cout << "# Percentage of time spent on l.o.s. fit: "
-             << setprecision(2) << 100. * (t_tot - t_star) / t_tot
-             << " %" << endl;
-        if(opts.verbosity >= 1) {
-            cout << "==================================================="
-                 << endl;
-        }
-        cout << endl;
-    }
 
     /*
      *  Add additional metadata to output file
@@ -24,6 +24,7 @@
  */
 
 #include "model.h"
+#include <omp.h>
 
 #include <vector>
 #include <string>
@@ -694,9 +695,33 @@ bool TStellarModel::load_seds(std::string seds_fname) {
 	std::cout << "# " << Mr_min_seds << " < Mr < " << Mr_max_seds << std::endl;
 	std::cout << "# " << FeH_min_seds << " < FeH < " << FeH_max_seds << std::endl;
 
+	build_template_soa();
+
 	return true;
 }
 
+// Copy the template grid into band-major arrays, so that each band
+// can be swept over all templates with unit stride.
+void TStellarModel::build_template_soa() {
+	unsigned int N = N_Mr_seds * N_FeH_seds;
+
+	absmag_soa.resize(NBANDS * N);
+	Mr_soa.resize(N);
+	FeH_soa.resize(N);
+
+	for(unsigned int Mr_idx=0; Mr_idx<N_Mr_seds; Mr_idx++) {
+		for(unsigned int FeH_idx=0; FeH_idx<N_FeH_seds; FeH_idx++) {
+			unsigned int k = Mr_idx * N_FeH_seds + FeH_idx;
+			const TSED &sed = (*sed_interp)[sed_interp->get_flat_index(Mr_idx, FeH_idx)];
+
+			for(unsigned int i=0; i<NBANDS; i++) {
+				absmag_soa[i*N + k] = sed.absmag[i];
+			}
+			sed_interp->get_xy(Mr_idx, FeH_idx, Mr_soa[k], FeH_soa[k]);
+		}
+	}
+}
+
 
 TSED TStellarModel::get_sed(double Mr, double FeH) {
 	return (*sed_interp)(Mr, FeH);
@@ -768,6 +793,22 @@ double TStellarModel::get_log_lf(double Mr) const {
 	return (*log_lf_interp)(Mr) - log_lf_norm;
 }
 
+unsigned int TStellarModel::get_N_templates() const {
+	return N_Mr_seds * N_FeH_seds;
+}
+
+const double* TStellarModel::get_absmag_soa() const {
+	return absmag_soa.data();
+}
+
+const double* TStellarModel::get_Mr_soa() const {
+	return Mr_soa.data();
+}
+
+const double* TStellarModel::get_FeH_soa() const {
+	return FeH_soa.data();
+}
+
 
 
 /****************************************************************************************************************************
@@ -1007,8 +1048,9 @@ TExtinctionModel::TExtinctionModel(std::string A_RV_fname) {
 		}
 	}
 
+	n_acc_threads = omp_get_max_threads();
 	A_spl = new gsl_spline*[NBANDS];
-	acc = new gsl_interp_accel*[NBANDS];
+	acc = new gsl_interp_accel*[NBANDS*n_acc_threads];
 
 	unsigned int N = RV.size();
 	double Acoeff_i[N];
@@ -1017,15 +1059,19 @@ TExtinctionModel::TExtinctionModel(std::string A_RV_fname) {
 	for(unsigned int i=0; i<NBANDS; i++) {
 		for(unsigned int k=0; k<N; k++) { Acoeff_i[k] = Acoeff[NBANDS*k + i]; }
 		A_spl[i] = gsl_spline_alloc(gsl_interp_cspline, N);
-		acc[i] = gsl_interp_accel_alloc();
 		gsl_spline_init(A_spl[i], RV_arr, Acoeff_i, N);
 	}
+	for(unsigned int k=0; k<NBANDS*n_acc_threads; k++) {
+		acc[k] = gsl_interp_accel_alloc();
+	}
 }
 
 TExtinctionModel::~TExtinctionModel() {
 	for(unsigned int i=0; i<NBANDS; i++) {
 		gsl_spline_free(A_spl[i]);
-		gsl_interp_accel_free(acc[i]);
+	}
+	for(unsigned int k=0; k<NBANDS*n_acc_threads; k++) {
+		gsl_interp_accel_free(acc[k]);
 	}
 	delete[] A_spl;
 	delete[] acc;
@@ -1033,7 +1079,11 @@ TExtinctionModel::~TExtinctionModel() {
 
 double TExtinctionModel::get_A(double RV, unsigned int i) {
 	if(!in_model(RV)) { return std::numeric_limits<double>::quiet_NaN(); }
-	return gsl_spline_eval(A_spl[i], RV, acc[i]);
+	unsigned int thread = omp_get_thread_num();
+	if(thread >= n_acc_threads) {
+		return gsl_spline_eval(A_spl[i], RV, NULL);
+	}
+	return gsl_spline_eval(A_spl[i], RV, acc[NBANDS*thread + i]);
 }
 
 bool TExtinctionModel::in_model(double RV) {
@@ -98,18 +98,30 @@ public:
 	// Luminosity function
 	double get_log_lf(double Mr) const;
 
+    // Structure-of-arrays view of the template grid, for batched
+    // evaluation. Template k = Mr_idx * N_FeH + FeH_idx has absolute
+    // magnitude absmag[i * N_templates + k] in band i.
+    unsigned int get_N_templates() const;
+    const double* get_absmag_soa() const;
+    const double* get_Mr_soa() const;
+    const double* get_FeH_soa() const;
+
 private:
 	// Template library data
 	double dMr_seds, dFeH_seds, Mr_min_seds, FeH_min_seds, Mr_max_seds, FeH_max_seds;	// Sample spacing for stellar SEDs
 	unsigned int N_FeH_seds, N_Mr_seds;
 	TBilinearInterp<TSED> *sed_interp;	// Bilinear interpolation of stellar SEDs in Mr and FeH
 
+	// Template grid, laid out band-major (see get_absmag_soa)
+	std::vector<double> absmag_soa, Mr_soa, FeH_soa;
+
 	// Luminosity function library data
 	TLinearInterp *log_lf_interp;
 	double log_lf_norm;
 
 	bool load_lf(std::string lf_fname);
 	bool load_seds(std::string seds_fname);
+	void build_template_soa();
 };
 
 // Returns a normalized creation function C(logM, tau),
@@ -191,7 +203,12 @@ public:
 private:
 	double RV_min, RV_max;
 	gsl_spline **A_spl;
+
+	// Spline accelerators hold mutable lookup state, so each OpenMP
+	// thread gets its own set: acc[NBANDS*thread + i]. Threads beyond
+	// n_acc_threads evaluate the splines without an accelerator.
 	gsl_interp_accel **acc;
+	unsigned int n_acc_threads;
 };
 
 // Luminosity function
@@ -98,6 +98,7 @@ bool TNeighborPixels::load_neighbor_list(
 {
     //std::cerr << "Loading " << neighbor_lookup_fname << " ..."
     //          << std::endl;
+    H5Utils::IOLock io_lock;
     std::unique_ptr<H5::H5File> f = H5Utils::openFile(
         neighbor_lookup_fname,
         H5Utils::READ);
@@ -179,6 +180,7 @@ bool TNeighborPixels::lookup_pixel_files(
         std::vector<int32_t>& file_idx)
 {
     // Load the lookup table for (nside, pix_idx) -> file_idx
+    H5Utils::IOLock io_lock;
     std::unique_ptr<H5::H5File> f = H5Utils::openFile(
             pixel_lookup_fname,
             H5Utils::READ);
@@ -271,11 +273,13 @@ bool TNeighborPixels::load_neighbor_los(
     std::sort(file_idx_sort.begin(), file_idx_sort.end());
     
     int32_t file_idx_current = -1;
+    H5Utils::IOLock io_lock;
     std::unique_ptr<H5::H5File> f = nullptr;
 
     // Clear priors and likelihoods
     prior.clear();
     likelihood.clear();
+    reddening_scale_pix.assign(n_pix, std::numeric_limits<double>::quiet_NaN());
     
     // Loop through file indices
     for(auto p : file_idx_sort) {
@@ -439,6 +443,9 @@ bool TNeighborPixels::load_neighbor_los(
         if(dm_max < -99.) {
             dm_max = H5Utils::read_attribute<double>(*dataset, "DM_max");
         }
+        if(dataset->attrExists("dE")) {
+            reddening_scale_pix.at(i) = H5Utils::read_attribute<double>(*dataset, "dE");
+        }
 
         double lon_tmp, lat_tmp;
         H5::Group group = f->openGroup(group_name.str());
@@ -473,7 +480,14 @@ void TNeighborPixels::apply_priors(
     assert( mu.size() == sigma.size() );
     assert( mu.size() == n_dists );
     
-    double log_scale = log(reddening_scale);
+    // Each neighbor's deltas are in units of its own reddening pixels,
+    // which may differ from those of the central pixel.
+    std::vector<double> log_scale(n_pix, log(reddening_scale));
+    for(int pix=0; pix<n_pix; pix++) {
+        if(pix < reddening_scale_pix.size() && std::isfinite(reddening_scale_pix[pix])) {
+            log_scale[pix] = log(reddening_scale_pix[pix]);
+        }
+    }
     
     for(int dist=n_dists-1; dist != -1; dist--) {
         for(int pix=0; pix<n_pix; pix++) {
@@ -481,7 +495,7 @@ void TNeighborPixels::apply_priors(
                 apply_priors_inner(
                     pix, sample, dist,
                     mu.at(dist), sigma.at(dist),
-                    log_scale);
+                    log_scale[pix]);
             }
         }
     }
@@ -1129,3 +1143,144 @@ unsigned int TNeighborPixels::get_n_dists() const {
     return n_dists;
 }
 
+
+/*
+ * Running sums for conditional means
+ */
+
+TNeighborMeanSums::TNeighborMeanSums(const TNeighborPixels& _neighbor_pixels)
+    : neighbor_pixels(_neighbor_pixels)
+{
+    n_pix = neighbor_pixels.get_n_pix();
+    n_dists = neighbor_pixels.get_n_dists();
+
+    delta_cur.resize(n_pix*n_dists, 0.);
+    sum_0.resize(n_pix*n_dists, 0.);
+    sum_m1.resize(n_pix*n_dists, 0.);
+    sum_p1.resize(n_pix*n_dists, 0.);
+    diff_ws.resize(n_dists, 0.);
+}
+
+
+double TNeighborMeanSums::inv_cov_m1(
+        unsigned int dist,
+        unsigned int pix0,
+        unsigned int pix1) const
+{
+    return 0.5 * (
+        neighbor_pixels.get_inv_cov(dist, pix0, pix1)
+      + neighbor_pixels.get_inv_cov(dist-1, pix0, pix1)
+    );
+}
+
+
+double TNeighborMeanSums::inv_cov_p1(
+        unsigned int dist,
+        unsigned int pix0,
+        unsigned int pix1) const
+{
+    return 0.5 * (
+        neighbor_pixels.get_inv_cov(dist, pix0, pix1)
+      + neighbor_pixels.get_inv_cov(dist+1, pix0, pix1)
+    );
+}
+
+
+void TNeighborMeanSums::init(const std::vector<uint16_t>& sample) {
+    for(int i=0; i<n_pix; i++) {
+        for(int dist=0; dist<n_dists; dist++) {
+            delta_cur[i*n_dists + dist] = neighbor_pixels.get_delta(
+                i, sample[i], dist
+            );
+        }
+    }
+
+    std::fill(sum_0.begin(), sum_0.end(), 0.);
+    std::fill(sum_m1.begin(), sum_m1.end(), 0.);
+    std::fill(sum_p1.begin(), sum_p1.end(), 0.);
+
+    for(int pix=0; pix<n_pix; pix++) {
+        for(int dist=0; dist<n_dists; dist++) {
+            int k = pix*n_dists + dist;
+            for(int i=0; i<n_pix; i++) {
+                const double *d_i = &(delta_cur[i*n_dists]);
+                sum_0[k] += neighbor_pixels.get_inv_cov(dist, pix, i)
+                            * d_i[dist];
+                if(dist > 0) {
+                    sum_m1[k] += inv_cov_m1(dist, pix, i) * d_i[dist-1];
+                }
+                if(dist < n_dists-1) {
+                    sum_p1[k] += inv_cov_p1(dist, pix, i) * d_i[dist+1];
+                }
+            }
+        }
+    }
+}
+
+
+void TNeighborMeanSums::update_pixel(
+        unsigned int pix,
+        const std::vector<uint16_t>& sample)
+{
+    // Change in the profile of this pixel
+    double *d_cur = &(delta_cur[pix*n_dists]);
+    for(int dist=0; dist<n_dists; dist++) {
+        double d_new = neighbor_pixels.get_delta(pix, sample[pix], dist);
+        diff_ws[dist] = d_new - d_cur[dist];
+        d_cur[dist] = d_new;
+    }
+
+    // Propagate to the sums of every pixel
+    for(int p=0; p<n_pix; p++) {
+        for(int dist=0; dist<n_dists; dist++) {
+            int k = p*n_dists + dist;
+            sum_0[k] += neighbor_pixels.get_inv_cov(dist, p, pix)
+                        * diff_ws[dist];
+            if(dist > 0) {
+                sum_m1[k] += inv_cov_m1(dist, p, pix) * diff_ws[dist-1];
+            }
+            if(dist < n_dists-1) {
+                sum_p1[k] += inv_cov_p1(dist, p, pix) * diff_ws[dist+1];
+            }
+        }
+    }
+}
+
+
+double TNeighborMeanSums::calc_mean_shifted(
+        unsigned int pix,
+        unsigned int dist,
+        const double shift_weight,
+        unsigned int start_pix) const
+{
+    int k = pix*n_dists + dist;
+    double s_0 = sum_0[k];
+    double s_m1 = sum_m1[k];
+    double s_p1 = sum_p1[k];
+
+    // Remove the terms of pixels that do not enter the mean: the pixel
+    // itself, and any pixels before both <start_pix> and the pixel. As in
+    // TNeighborPixels::calc_mean_shifted, every pixel after <pix> enters.
+    auto remove_pix = [&](unsigned int i) {
+        const double *d_i = &(delta_cur[i*n_dists]);
+        s_0 -= neighbor_pixels.get_inv_cov(dist, pix, i) * d_i[dist];
+        if(dist > 0) {
+            s_m1 -= inv_cov_m1(dist, pix, i) * d_i[dist-1];
+        }
+        if(dist < n_dists-1) {
+            s_p1 -= inv_cov_p1(dist, pix, i) * d_i[dist+1];
+        }
+    };
+    
+    remove_pix(pix);
+    unsigned int i_end = std::min(start_pix, pix);
+    for(unsigned int i=0; i<i_end; i++) {
+        remove_pix(i);
+    }
+
+    double norm = 1. + 2.*shift_weight;
+    double mu = s_0 + shift_weight * (s_m1 + s_p1);
+    mu *= -1. / (norm * neighbor_pixels.get_inv_var(pix, dist));
+
+    return mu;
+}
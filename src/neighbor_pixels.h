@@ -56,6 +56,10 @@ private:
     // Prior and likelihood stored for each neighbor
     std::vector<double> prior;
     std::vector<double> likelihood;
+
+    // Reddening (in mag) per pixel of each neighbor's grid. NaN if not
+    // recorded, in which case the central pixel's scale is assumed.
+    std::vector<double> reddening_scale_pix;
     
     // Locations of neibhoring pixels
     std::vector<double> lon, lat;
@@ -212,4 +216,58 @@ public:
 };
 
 
+class TNeighborMeanSums {
+    // Running precision-weighted sums over pixels, from which the
+    // conditional mean of any (pixel, distance) can be read off in O(1).
+    // The sums refer to one particular choice of samples, so each chain
+    // (e.g., each temperature) keeps its own set. When the profile chosen
+    // in one pixel changes, the sums are updated in O(n_pix * n_dists).
+private:
+    const TNeighborPixels& neighbor_pixels;
+    unsigned int n_pix, n_dists;
+
+    // Profile of each pixel currently included in the sums.
+    // shape = (pix, dist)
+    std::vector<double> delta_cur;
+
+    // Sums over all pixels i (including pix itself) of
+    //   inv_cov[dist](pix, i) * delta_i[dist]               (sum_0)
+    //   inv_cov_m1(pix, i) * delta_i[dist-1]                (sum_m1)
+    //   inv_cov_p1(pix, i) * delta_i[dist+1]                (sum_p1)
+    // where inv_cov_m1/p1 are the shift couplings used by
+    // TNeighborPixels::calc_mean_shifted. shape = (pix, dist)
+    std::vector<double> sum_0, sum_m1, sum_p1;
+
+    std::vector<double> diff_ws; // shape = (dist)
+
+    double inv_cov_m1(unsigned int dist,
+                      unsigned int pix0,
+                      unsigned int pix1) const;
+    double inv_cov_p1(unsigned int dist,
+                      unsigned int pix0,
+                      unsigned int pix1) const;
+
+public:
+    TNeighborMeanSums(const TNeighborPixels& neighbor_pixels);
+
+    // Recompute all the sums from scratch, in O(n_pix^2 * n_dists)
+    void init(const std::vector<uint16_t>& sample);
+
+    // Account for a change in the profile of the given pixel, either
+    // because a different sample was chosen for it, or because a new
+    // profile was written into its current sample.
+    void update_pixel(
+            unsigned int pix,
+            const std::vector<uint16_t>& sample);
+
+    // Same as TNeighborPixels::calc_mean_shifted, for the samples
+    // that the sums were last updated with
+    double calc_mean_shifted(
+            unsigned int pix,
+            unsigned int dist,
+            const double shift_weight,
+            unsigned int start_pix=0) const;
+};
+
+
 #endif // _NEIGHBOR_PIXELS_H__
@@ -41,6 +41,11 @@ TProgramOpts::TProgramOpts() {
     pct_smoothing_max = -1.;
 
     discrete_los = false;
+    sparse_images = false;
+    two_pass_grid = false;
+    analytic_splat = false;
+    kernel_cache_size = 0;
+    adaptive_grid_factor = 0.;
     discrete_steps = 10000;
 
     N_regions = 30;
@@ -52,6 +57,7 @@ TProgramOpts::TProgramOpts() {
     cloud_steps = 2000;
     cloud_samplers = 80;
     cloud_p_replacement = 0.2;
+    cloud_cumsum_MB = 0.;
 
     disk_prior = false;
     log_Delta_EBV_floor = -10.;
@@ -66,6 +72,7 @@ TProgramOpts::TProgramOpts() {
 
     N_runs = 4;
     N_threads = 1;
+    N_pix_workers = 1;
 
     clobber = false;
 
@@ -162,6 +169,26 @@ int get_program_opts(int argc, char **argv, TProgramOpts &opts) {
 
         ("discrete-los",
             "Use the discrete line-of-sight model.")
+        ("sparse-images",
+            "Store only the bounding box of the nonzero pixels of each "
+            "stellar PDF image, to save memory in pixels with many stars.")
+        ("two-pass-grid",
+            "In grid evaluation, fit all stars first, and render images "
+            "only for the stars that pass the chi^2 and subpixel cuts.")
+        ("analytic-splat",
+            "In grid evaluation, draw each significant stellar template "
+            "directly as a 2D Gaussian, instead of convolving the whole "
+            "image with the covariance kernel.")
+        ("kernel-cache-size",
+            po::value<unsigned int>(&(opts.kernel_cache_size)),
+            ("# of per-star convolution kernels to cache in grid evaluation, "
+             "keyed by the quantized covariance (default: " +
+                to_string(opts.kernel_cache_size) + ", i.e., off)").c_str())
+        ("adaptive-grid-factor",
+            po::value<double>(&(opts.adaptive_grid_factor)),
+            ("In grid evaluation, limit the reddening axis to this multiple of "
+             "the SFD reddening in the pixel (min. 0.5 mag), instead of 7 mag "
+             "(default: " + to_string(opts.adaptive_grid_factor) + ", i.e., off)").c_str())
         ("discrete-steps",
             po::value<unsigned int>(&(opts.discrete_steps)),
             ("# of steps to take for the discrete l.o.s. sampler "
@@ -207,6 +234,12 @@ int get_program_opts(int argc, char **argv, TProgramOpts &opts) {
             ("Probability of taking replacement step (cloud fit) "
                 "(default: " +
                 to_string(opts.cloud_p_replacement) + ")").c_str())
+        ("cloud-cumsum-mb",
+            po::value<double>(&(opts.cloud_cumsum_MB)),
+            ("Max. memory (in MB) for running sums of the images, "
+                "which speed up the cloud fit. 0 disables them "
+                "(default: " +
+                to_string(opts.cloud_cumsum_MB) + ")").c_str())
 
         ("disk-prior",
             "Assume that dust density roughly traces "
@@ -375,6 +408,79 @@ int get_program_opts(int argc, char **argv, TProgramOpts &opts) {
                  "temperature samplers will be saved as well (default: " +
                     to_string(opts.dsc_samp_settings.save_all_temperatures) +
                  ")").c_str())
+        ("dsc-pack-images",
+            po::value<bool>(&(opts.dsc_samp_settings.pack_images)),
+                ("Discrete l.o.s. sampler: If true, keep a star-major \n"
+                 "copy of the stellar images, which speeds up the \n"
+                 "line-integral updates at the cost of memory \n"
+                 "(default: " +
+                    to_string(opts.dsc_samp_settings.pack_images) +
+                 ")").c_str())
+        ("dsc-pack-bits",
+            po::value<int>(&(opts.dsc_samp_settings.pack_bits)),
+                ("Discrete l.o.s. sampler: Bits per pixel of the packed \n"
+                 "images: 32 (float), or 16 or 8 (fixed point, relative \n"
+                 "to the peak of each star's image). With fewer than 32 \n"
+                 "bits, the packed line integrals are checked against \n"
+                 "the float images, and the errors are reported at \n"
+                 "verbosity >= 1 (always, for 8 bits). 8 bits has not \n"
+                 "been validated on real data (default: " +
+                    to_string(opts.dsc_samp_settings.pack_bits) +
+                 ")").c_str())
+        ("dsc-release-float-images",
+            po::value<bool>(&(opts.dsc_samp_settings.release_float_images)),
+                ("Discrete l.o.s. sampler: If true, free the float \n"
+                 "image stack once the images are packed, so that only \n"
+                 "the packed copy stays in memory. Cannot be combined \n"
+                 "with the cloud or piecewise-linear models (default: " +
+                    to_string(opts.dsc_samp_settings.release_float_images) +
+                 ")").c_str())
+        ("dsc-shift-table-offset",
+            po::value<int>(&(opts.dsc_samp_settings.shift_table_max_offset)),
+                ("Discrete l.o.s. sampler: Largest reddening shift (in \n"
+                 "pixels) evaluated from running partial sums. Uses \n"
+                 "2 x offset x (# of distances) x (# of stars) doubles \n"
+                 "per temperature. Set to 0 to disable (default: " +
+                    to_string(opts.dsc_samp_settings.shift_table_max_offset) +
+                 ")").c_str())
+        ("dsc-gibbs-cache-capacity",
+            po::value<unsigned int>(&(opts.dsc_samp_settings.gibbs_cache_capacity)),
+                ("Discrete l.o.s. sampler: # of neighbor configurations \n"
+                 "to cache per temperature for the neighbor Gibbs \n"
+                 "steps. Set to 0 to disable the cache (default: " +
+                    to_string(opts.dsc_samp_settings.gibbs_cache_capacity) +
+                 ")").c_str())
+        ("dsc-gibbs-cache-lnp-cutoff",
+            po::value<double>(&(opts.dsc_samp_settings.gibbs_cache_lnp_cutoff)),
+                ("Discrete l.o.s. sampler: Cached neighbor samples \n"
+                 "further than this below the most probable sample \n"
+                 "(in ln p, ignoring the central pixel) are dropped. \n"
+                 "Any finite value makes the cached steps approximate. \n"
+                 "Set to -inf to keep all samples (default: " +
+                    to_string(opts.dsc_samp_settings.gibbs_cache_lnp_cutoff) +
+                 ")").c_str())
+        ("dsc-gibbs-cache-check",
+            po::value<bool>(&(opts.dsc_samp_settings.gibbs_cache_check)),
+                ("Discrete l.o.s. sampler: If true, compare every cached \n"
+                 "neighbor Gibbs step with the uncached calculation, \n"
+                 "and report the largest total-variation distance \n"
+                 "(default: " +
+                    to_string(opts.dsc_samp_settings.gibbs_cache_check) +
+                 ")").c_str())
+        ("dsc-active-star-index",
+            po::value<bool>(&(opts.dsc_samp_settings.active_star_index)),
+                ("Discrete l.o.s. sampler: If true, evaluate step and \n"
+                 "swap proposals only for the stars with non-negligible \n"
+                 "probability in the affected distance bin (default: " +
+                    to_string(opts.dsc_samp_settings.active_star_index) +
+                 ")").c_str())
+        ("dsc-active-star-threshold",
+            po::value<double>(&(opts.dsc_samp_settings.active_star_threshold)),
+                ("Discrete l.o.s. sampler: Pixels no greater than this \n"
+                 "fraction of the peak of a star's image are ignored by \n"
+                 "the active-star index. 0 is exact (default: " +
+                    to_string(opts.dsc_samp_settings.active_star_threshold) +
+                 ")").c_str())
         ("dsc-p-badstar",
             po::value<double>(&(opts.dsc_samp_settings.p_badstar)),
                 ("Stellar outlier fraction: larger values mean less \n"
@@ -530,6 +636,11 @@ int get_program_opts(int argc, char **argv, TProgramOpts &opts) {
             po::value<unsigned int>(&(opts.N_threads)),
             ("# of threads to run on (default: " +
                 to_string(opts.N_threads) + ")").c_str())
+        ("pixel-workers",
+            po::value<unsigned int>(&(opts.N_pix_workers)),
+            ("# of pixels to process concurrently. If greater than 1,\n"
+             "each pixel runs on a single thread (default: " +
+                to_string(opts.N_pix_workers) + ")").c_str())
         ("force-pix",
             po::value<std::vector<std::string>>()->multitoken(),
             ("Force the given pixels to run. E.g., \"1024-0 512-50\\n "
@@ -600,6 +711,9 @@ int get_program_opts(int argc, char **argv, TProgramOpts &opts) {
     if(vm.count("clobber")) { opts.clobber = true; }
     if(vm.count("test-los")) { opts.test_mode = true; }
     if(vm.count("discrete-los")) { opts.discrete_los = true; }
+    if(vm.count("sparse-images")) { opts.sparse_images = true; }
+    if(vm.count("two-pass-grid")) { opts.two_pass_grid = true; }
+    if(vm.count("analytic-splat")) { opts.analytic_splat = true; }
 
     // Read percent smoothing coefficients
     if(!vm["pct-smoothing-coeffs"].empty()) {
@@ -637,6 +751,31 @@ int get_program_opts(int argc, char **argv, TProgramOpts &opts) {
         return -1;
     }
 
+    if(opts.N_pix_workers < 1) {
+        cerr << "'pixel-workers' must be at least 1." << endl;
+        return -1;
+    }
+
+    if(!TDiscreteLosMcmcParams::valid_pack_bits(opts.dsc_samp_settings.pack_bits)) {
+        cerr << "'dsc-pack-bits' must be 32, 16 or 8." << endl;
+        return -1;
+    }
+
+    if(opts.dsc_samp_settings.pack_images
+       && (opts.dsc_samp_settings.pack_bits == 8)) {
+        cerr << "Warning: 'dsc-pack-bits 8' has not been validated on "
+                "real data. Each line integral may be off by up to "
+                "n_dists * peak / 510. Check the reported packing "
+                "errors." << endl;
+    }
+
+    if(opts.dsc_samp_settings.release_float_images
+       && ((opts.N_clouds != 0) || (opts.N_regions != 0))) {
+        cerr << "'dsc-release-float-images' cannot be used with the "
+                "cloud or piecewise-linear models." << endl;
+        return -1;
+    }
+
     if(opts.N_regions != 0) {
         if(120 % (opts.N_regions) != 0) {
             cerr << "# of regions in extinction profile must divide "
@@ -48,6 +48,12 @@ struct TProgramOpts {
     bool discrete_los;
     unsigned int discrete_steps;
 
+    bool sparse_images; // Store only the nonzero bounding box of each star
+    bool two_pass_grid; // Render images only for stars that pass the chi^2 cut
+    bool analytic_splat; // Draw each template as a Gaussian, instead of filter2D
+    unsigned int kernel_cache_size; // # of cached filter2D kernels (0 = off)
+    double adaptive_grid_factor; // E_max of grid, in units of SFD (0 = fixed grid)
+
     unsigned int N_regions;
     unsigned int los_steps;
     unsigned int los_samplers;
@@ -57,6 +63,7 @@ struct TProgramOpts {
     unsigned int cloud_steps;
     unsigned int cloud_samplers;
     double cloud_p_replacement;
+    double cloud_cumsum_MB;
 
     bool disk_prior;
     double log_Delta_EBV_floor;
@@ -71,6 +78,7 @@ struct TProgramOpts {
 
     unsigned int N_runs;
     unsigned int N_threads;
+    unsigned int N_pix_workers;
 
     bool clobber;
 
@@ -940,6 +940,121 @@ void sample_indiv_synth(std::string &out_fname, TMCMCOptions &options, TGalactic
     delete[] GR;
 }
 
+// Calls logP_indiv_simple_emp directly, so that the sampler can inline it
+struct TIndivEmpPdf {
+    double operator()(const double *const x, unsigned int N, TMCMCParams& params) const {
+        return logP_indiv_simple_emp(x, N, params);
+    }
+};
+
+// Burn-in and main run of the sampler for one star. The dimensionality is
+// fixed at compile time (4, or 5 if R_V varies), so that the state storage
+// and the loops over parameters in the sampler can be unrolled.
+template<unsigned int NDim>
+static TChain run_indiv_emp_sampler(
+        TMCMCParams& params, TNullLogger& logger,
+        unsigned int N_steps, unsigned int N_samplers, unsigned int N_runs,
+        double p_replacement, unsigned int max_attempts, double GR_threshold,
+        double *const GR, bool& converged, size_t& attempt, int verbosity)
+{
+    TParallelAffineSampler<TMCMCParams, TNullLogger, TIndivEmpPdf, NDim> sampler(
+        TIndivEmpPdf(), &gen_rand_state_indiv_emp, NDim, N_samplers*NDim, params, logger, N_runs);
+    sampler.set_scale(1.5);
+    sampler.set_replacement_bandwidth(0.30);
+    sampler.set_replacement_accept_bias(1.e-5);
+    sampler.set_sigma_min(0.02);
+
+    //std::cerr << "# Burn-in" << std::endl;
+
+    // Burn-in
+
+    // Round 1 (3/6)
+    sampler.step_MH(N_steps*(1./6.), false);
+    sampler.step(N_steps*(2./6.), false, 0., p_replacement);
+
+    if(verbosity >= 2) {
+        std::cout << std::endl;
+        std::cout << "scale: (";
+        std::cout << std::setprecision(2);
+        for(int k=0; k<sampler.get_N_samplers(); k++) {
+            std::cout << sampler.get_sampler(k)->get_scale() << ((k == sampler.get_N_samplers() - 1) ? "" : ", ");
+        }
+    }
+
+    // Remove spurious modes
+    sampler.set_replacement_accept_bias(1.e-2);
+    int N_steps_biased = N_steps*(1./6.);
+    if(N_steps_biased > 20) { N_steps_biased = 20; }
+    sampler.step(N_steps_biased, false, 0., 1.);
+
+    sampler.tune_stretch(6, 0.30);
+    sampler.tune_MH(6, 0.30);
+
+    if(verbosity >= 2) {
+        std::cout << ") -> (";
+        for(int k=0; k<sampler.get_N_samplers(); k++) {
+            std::cout << sampler.get_sampler(k)->get_scale() << ((k == sampler.get_N_samplers() - 1) ? "" : ", ");
+        }
+        std::cout << ")" << std::endl;
+    }
+
+    // Round 2 (3/6)
+    sampler.set_replacement_accept_bias(0.);
+    sampler.step_MH(N_steps*(1./6.), false);
+    sampler.step(N_steps*(2./6.), false, 0., p_replacement);
+
+    if(verbosity >= 2) {
+        std::cout << "scale: (";
+        std::cout << std::setprecision(2);
+        for(int k=0; k<sampler.get_N_samplers(); k++) {
+            std::cout << sampler.get_sampler(k)->get_scale() << ((k == sampler.get_N_samplers() - 1) ? "" : ", ");
+        }
+    }
+
+    sampler.tune_stretch(6, 0.30);
+    sampler.tune_MH(6, 0.30);
+
+    if(verbosity >= 2) {
+        std::cout << ") -> (";
+        for(int k=0; k<sampler.get_N_samplers(); k++) {
+            std::cout << sampler.get_sampler(k)->get_scale() << ((k == sampler.get_N_samplers() - 1) ? "" : ", ");
+        }
+        std::cout << ")" << std::endl;
+        std::cout << std::endl;
+    }
+
+    sampler.clear();
+
+    //std::cerr << "# Main run" << std::endl;
+
+    // Main run
+    converged = false;
+    for(attempt = 0; (attempt < max_attempts) && (!converged); attempt++) {
+        sampler.step((1<<attempt)*N_steps, true, 0., p_replacement);
+        //sampler.step_MH((1<<attempt)*N_steps*(1./3.), true);
+
+        converged = true;
+        sampler.get_GR_diagnostic(GR);
+        for(size_t i=0; i<NDim; i++) {
+            if(GR[i] > GR_threshold) {
+                converged = false;
+                if(attempt != max_attempts-1) {
+                    sampler.clear();
+                    //logger.clear();
+                }
+                break;
+            }
+        }
+    }
+
+    if(verbosity >= 2) {
+        sampler.print_stats();
+        std::cout << std::endl;
+    }
+
+    return sampler.get_chain();
+}
+
 void sample_indiv_emp(std::string &out_fname, TMCMCOptions &options, TGalacticLOSModel& galactic_model,
                       TStellarModel& stellar_model, TExtinctionModel& extinction_model, TEBVSmoothing& EBV_smoothing,
 					  TStellarData& stellar_data, TImgStack& img_stack, std::vector<bool> &conv, std::vector<double> &lnZ,
@@ -987,8 +1102,6 @@ void sample_indiv_emp(std::string &out_fname, TMCMCOptions &options, TGalacticLO
     double GR_threshold = 1.1;
 
     TNullLogger logger;
-    TAffineSampler<TMCMCParams, TNullLogger>::pdf_t f_pdf = &logP_indiv_simple_emp;
-    TAffineSampler<TMCMCParams, TNullLogger>::rand_state_t f_rand_state = &gen_rand_state_indiv_emp;
 
     timespec t_start, t_write, t_end;
 
@@ -1029,100 +1142,17 @@ void sample_indiv_emp(std::string &out_fname, TMCMCOptions &options, TGalacticLO
         }
 
         //std::cerr << "# Setting up sampler" << std::endl;
-        TParallelAffineSampler<TMCMCParams, TNullLogger> sampler(f_pdf, f_rand_state, ndim, N_samplers*ndim, params, logger, N_runs);
-        sampler.set_scale(1.5);
-        sampler.set_replacement_bandwidth(0.30);
-        sampler.set_replacement_accept_bias(1.e-5);
-        sampler.set_sigma_min(0.02);
-
-        //std::cerr << "# Burn-in" << std::endl;
-
-        // Burn-in
-
-        // Round 1 (3/6)
-        sampler.step_MH(N_steps*(1./6.), false);
-        sampler.step(N_steps*(2./6.), false, 0., options.p_replacement);
-
-        if(verbosity >= 2) {
-            std::cout << std::endl;
-            std::cout << "scale: (";
-            std::cout << std::setprecision(2);
-            for(int k=0; k<sampler.get_N_samplers(); k++) {
-                std::cout << sampler.get_sampler(k)->get_scale() << ((k == sampler.get_N_samplers() - 1) ? "" : ", ");
-            }
-        }
-
-        // Remove spurious modes
-        sampler.set_replacement_accept_bias(1.e-2);
-        int N_steps_biased = N_steps*(1./6.);
-        if(N_steps_biased > 20) { N_steps_biased = 20; }
-        sampler.step(N_steps_biased, false, 0., 1.);
-
-        sampler.tune_stretch(6, 0.30);
-        sampler.tune_MH(6, 0.30);
-
-        if(verbosity >= 2) {
-            std::cout << ") -> (";
-            for(int k=0; k<sampler.get_N_samplers(); k++) {
-                std::cout << sampler.get_sampler(k)->get_scale() << ((k == sampler.get_N_samplers() - 1) ? "" : ", ");
-            }
-            std::cout << ")" << std::endl;
-        }
-
-        // Round 2 (3/6)
-        sampler.set_replacement_accept_bias(0.);
-        sampler.step_MH(N_steps*(1./6.), false);
-        sampler.step(N_steps*(2./6.), false, 0., options.p_replacement);
-
-        if(verbosity >= 2) {
-            std::cout << "scale: (";
-            std::cout << std::setprecision(2);
-            for(int k=0; k<sampler.get_N_samplers(); k++) {
-                std::cout << sampler.get_sampler(k)->get_scale() << ((k == sampler.get_N_samplers() - 1) ? "" : ", ");
-            }
-        }
-
-        sampler.tune_stretch(6, 0.30);
-        sampler.tune_MH(6, 0.30);
-
-        if(verbosity >= 2) {
-            std::cout << ") -> (";
-            for(int k=0; k<sampler.get_N_samplers(); k++) {
-                std::cout << sampler.get_sampler(k)->get_scale() << ((k == sampler.get_N_samplers() - 1) ? "" : ", ");
-            }
-            std::cout << ")" << std::endl;
-            std::cout << std::endl;
-        }
-
-        sampler.clear();
-
-        //std::cerr << "# Main run" << std::endl;
-
-        // Main run
-        bool converged = false;
+        bool converged;
         size_t attempt;
-        for(attempt = 0; (attempt < max_attempts) && (!converged); attempt++) {
-            sampler.step((1<<attempt)*N_steps, true, 0., options.p_replacement);
-            //sampler.step_MH((1<<attempt)*N_steps*(1./3.), true);
-
-            converged = true;
-            sampler.get_GR_diagnostic(GR);
-            for(size_t i=0; i<ndim; i++) {
-                if(GR[i] > GR_threshold) {
-                    converged = false;
-                    if(attempt != max_attempts-1) {
-                        sampler.clear();
-                        //logger.clear();
-                    }
-                    break;
-                }
-            }
-        }
+        TChain chain = (ndim == 5) ?
+            run_indiv_emp_sampler<5>(params, logger, N_steps, N_samplers, N_runs, options.p_replacement,
+                                     max_attempts, GR_threshold, GR, converged, attempt, verbosity) :
+            run_indiv_emp_sampler<4>(params, logger, N_steps, N_samplers, N_runs, options.p_replacement,
+                                     max_attempts, GR_threshold, GR, converged, attempt, verbosity);
 
         clock_gettime(CLOCK_MONOTONIC, &t_write);
 
         // Compute evidence
-        TChain chain = sampler.get_chain();
         double lnZ_tmp = chain.get_ln_Z_harmonic(true, 10., 0.25, 0.05);
         //if(isinf(lnZ_tmp)) { lnZ_tmp = neg_inf_replacement; }
 
@@ -1139,11 +1169,6 @@ void sample_indiv_emp(std::string &out_fname, TMCMCOptions &options, TGalacticLO
 
         clock_gettime(CLOCK_MONOTONIC, &t_end);
 
-        if(verbosity >= 2) {
-            sampler.print_stats();
-            std::cout << std::endl;
-        }
-
         if(!converged) {
             N_nonconv++;
             if(verbosity >= 2) {
@@ -44,13 +44,24 @@ void star_covariance(TStellarData::TMagnitudes& mags_obs,
                      TExtinctionModel& ext_model,
                      double& inv_cov_00, double& inv_cov_01, double& inv_cov_11,
                      double RV) {
+    double A[NBANDS];
+    for(int i=0; i<NBANDS; i++) {
+        A[i] = ext_model.get_A(RV, i);
+    }
+
+    star_covariance(mags_obs, A, inv_cov_00, inv_cov_01, inv_cov_11);
+}
+
+void star_covariance(TStellarData::TMagnitudes& mags_obs,
+                     const double* A_band,
+                     double& inv_cov_00, double& inv_cov_01, double& inv_cov_11) {
     // Various useful terms
     double inv_sigma2 = 0.;         // 1 / sigma_i^2
     double A_over_sigma2 = 0.;      // A_i / sigma_i^2
     double A2_over_sigma2 = 0.;     // A_i^2 / sigma_i^2
 
     for(int i=0; i<NBANDS; i++) {
-        double A = ext_model.get_A(RV, i);
+        double A = A_band[i];
         double ivar = 1. / (mags_obs.err[i] * mags_obs.err[i]);
 
         inv_sigma2 += ivar;
@@ -108,6 +119,70 @@ void star_max_likelihood(TSED& mags_model, TStellarData::TMagnitudes& mags_obs,
     }
 }
 
+void star_max_likelihood_batch(const double* absmag, unsigned int n_templates,
+                               TStellarData::TMagnitudes& mags_obs,
+                               const double* A,
+                               double inv_cov_00, double inv_cov_01, double inv_cov_11,
+                               double* mu, double* E, double* chi2) {
+    // Same solution as star_max_likelihood, but each pass sweeps one
+    // band over all templates, so that the inner loops are contiguous
+    // and vectorize. mu and E hold the running sums
+    //   sum_i (m_i - M_i) / sigma_i^2   and   sum_i (m_i - M_i) A_i / sigma_i^2
+    // until the solve.
+    unsigned int N = n_templates;
+
+    double ivar[NBANDS];
+    for(int i=0; i<NBANDS; i++) {
+        ivar[i] = 1. / (mags_obs.err[i] * mags_obs.err[i]);
+    }
+
+    std::fill(mu, mu+N, 0.);
+    std::fill(E, E+N, 0.);
+    std::fill(chi2, chi2+N, 0.);
+
+    for(int i=0; i<NBANDS; i++) {
+        const double* M = absmag + i*N;
+        double m = mags_obs.m[i];
+        double w = ivar[i];
+        double wA = A[i] * ivar[i];
+
+        #pragma omp simd
+        for(unsigned int k=0; k<N; k++) {
+            double dm = m - M[k];
+            mu[k] += dm * w;
+            E[k] += dm * wA;
+        }
+    }
+
+    double C_01 = inv_cov_01 / inv_cov_00;
+    double C_10 = inv_cov_01 / inv_cov_11;
+    double C_det_inv = 1. / (1. - C_01 * C_10);
+    double inv_00 = 1. / inv_cov_00;
+    double inv_11 = 1. / inv_cov_11;
+
+    #pragma omp simd
+    for(unsigned int k=0; k<N; k++) {
+        double mu_0 = mu[k] * inv_00;
+        double E_0 = E[k] * inv_11;
+        mu[k] = C_det_inv * (mu_0 - C_01 * E_0);
+        E[k]  = C_det_inv * (E_0  - C_10 * mu_0);
+    }
+
+    // Compute best chi^2 by plugging in ML (mu, E)
+    for(int i=0; i<NBANDS; i++) {
+        const double* M = absmag + i*N;
+        double m = mags_obs.m[i];
+        double w = ivar[i];
+        double a = A[i];
+
+        #pragma omp simd
+        for(unsigned int k=0; k<N; k++) {
+            double delta = (m - M[k] - E[k] * a - mu[k]);
+            chi2[k] += delta*delta * w;
+        }
+    }
+}
+
 // Calculate the chi^2 of a given stellar fit, parameterized by
 // (spectral energy distribution, distance modulus, reddening),
 // with a given reddening -> extinction mapping.
@@ -242,6 +317,32 @@ void gaussian_filter(std::shared_ptr<LinearFitParams> p,
 }
 
 
+// Adds (add_diagonal pixels)^2 of variance along each axis of the grid
+static void broaden_inv_cov(double& inv_cov_00, double& inv_cov_01, double& inv_cov_11,
+                            const TRect& grid, double add_diagonal) {
+    double diag[2] = {
+        add_diagonal*grid.dx[0],
+        add_diagonal*grid.dx[1]
+    };
+
+    // std::cerr << "diagonal = (" << diag[0] << ", " << diag[1] << ")" << std::endl;
+
+    double det = inv_cov_00 * inv_cov_11 - inv_cov_01 * inv_cov_01;
+    double cov_00 = inv_cov_11 / det;
+    double cov_11 = inv_cov_00 / det;
+    double cov_01 = -inv_cov_01 / det;
+
+    cov_00 += diag[0] * diag[0];
+    cov_11 += diag[1] * diag[1];
+
+    det = cov_00 * cov_11 - cov_01 * cov_01;
+
+    inv_cov_00 = cov_11 / det;
+    inv_cov_11 = cov_00 / det;
+    inv_cov_01 = -cov_01 / det;
+}
+
+
 void gaussian_filter(double inv_cov_00, double inv_cov_01, double inv_cov_11,
                      TRect& grid, cv::Mat& img,
                      double n_sigma, int min_width,
@@ -249,26 +350,7 @@ void gaussian_filter(double inv_cov_00, double inv_cov_01, double inv_cov_11,
                      int subsample=5, int verbosity=0) {
     // Add extra smoothing along each axis
     if(add_diagonal > 0.) {
-        double diag[2] = {
-            add_diagonal*grid.dx[0],
-            add_diagonal*grid.dx[1]
-        };
-
-        // std::cerr << "diagonal = (" << diag[0] << ", " << diag[1] << ")" << std::endl;
-
-        double det = inv_cov_00 * inv_cov_11 - inv_cov_01 * inv_cov_01;
-        double cov_00 = inv_cov_11 / det;
-        double cov_11 = inv_cov_00 / det;
-        double cov_01 = -inv_cov_01 / det;
-
-        cov_00 += diag[0] * diag[0];
-        cov_11 += diag[1] * diag[1];
-
-        det = cov_00 * cov_11 - cov_01 * cov_01;
-
-        inv_cov_00 = cov_11 / det;
-        inv_cov_11 = cov_00 / det;
-        inv_cov_01 = -cov_01 / det;
+        broaden_inv_cov(inv_cov_00, inv_cov_01, inv_cov_11, grid, add_diagonal);
     }
 
     // Determine sigma along each axis
@@ -348,6 +430,104 @@ void gaussian_filter(double inv_cov_00, double inv_cov_01, double inv_cov_11,
 }
 
 
+TGaussianKernelCache::TGaussianKernelCache(const TRect& grid, uint32_t capacity, double quantum)
+    : grid(grid), quantum(quantum), n_lookups(0), n_misses(0)
+{
+    // Key: (ln inv_cov_00, ln inv_cov_11, correlation), each in units of quantum
+    cache.reset(new LRUCache::ShardedCachedFunction<std::vector<int32_t>, cv::Mat>(
+        [this](const std::vector<int32_t>& key) -> cv::Mat {
+            n_misses++;
+            double a = exp(this->quantum * key[0]);
+            double c = exp(this->quantum * key[1]);
+            double rho = this->quantum * key[2];
+            cv::Mat kernel;
+            gaussian_filter(a, rho*sqrt(a*c), c,
+                            this->grid, kernel, 5, 2, 1.0, 5);
+            return kernel;
+        },
+        capacity
+    ));
+}
+
+
+void TGaussianKernelCache::get(double inv_cov_00, double inv_cov_01, double inv_cov_11,
+                               cv::Mat& kernel, int verbosity) {
+    n_lookups++;
+
+    // Covariances that cannot be keyed are not cached
+    if(!(inv_cov_00 > 0.) || !(inv_cov_11 > 0.) || std::isinf(inv_cov_00)
+       || std::isinf(inv_cov_11) || std::isnan(inv_cov_01)) {
+        n_misses++;
+        gaussian_filter(inv_cov_00, inv_cov_01, inv_cov_11,
+                        grid, kernel, 5, 2, 1.0, 5, verbosity);
+        return;
+    }
+
+    double rho = inv_cov_01 / sqrt(inv_cov_00 * inv_cov_11);
+    std::vector<int32_t> key = {
+        (int32_t)std::lround(log(inv_cov_00) / quantum),
+        (int32_t)std::lround(log(inv_cov_11) / quantum),
+        (int32_t)std::lround(rho / quantum)
+    };
+
+    kernel = (*cache)(key);
+}
+
+
+uint64_t TGaussianKernelCache::get_n_hits() const {
+    return n_lookups - n_misses;
+}
+
+uint64_t TGaussianKernelCache::get_n_misses() const {
+    return n_misses;
+}
+
+
+// Adds weight * exp(-x^T C^-1 x / 2) to img, where x is the offset from
+// (x0, x1) and C^-1 is given along the image axes. Only pixels inside the
+// n_sigma ellipse are touched: for each row, the Gaussian is conditioned
+// on that row, so the range of columns shrinks and shifts with the row.
+void splat_gaussian(cv::Mat& img, const TRect& grid,
+                    double x0, double x1, double weight,
+                    double inv_cov_00, double inv_cov_01, double inv_cov_11,
+                    double n_sigma) {
+    // Inverse covariance in pixel units
+    double a = inv_cov_00 * grid.dx[0] * grid.dx[0];
+    double b = inv_cov_01 * grid.dx[0] * grid.dx[1];
+    double c = inv_cov_11 * grid.dx[1] * grid.dx[1];
+    double det = a*c - b*b;
+    if((det <= 0.) || (c <= 0.)) { return; }
+
+    // Center in (fractional) pixel coordinates
+    double u0 = (x0 - grid.min[0]) / grid.dx[0] - 0.5;
+    double v0 = (x1 - grid.min[1]) / grid.dx[1] - 0.5;
+
+    // Marginal width along the rows, and conditional width along columns
+    double sigma_u = sqrt(c / det);
+    double sigma_v = 1. / sqrt(c);
+    double a_marg = det / c;
+    double slope = b / c;
+
+    int i0 = std::max(0, (int)ceil(u0 - n_sigma * sigma_u));
+    int i1 = std::min((int)grid.N_bins[0] - 1, (int)floor(u0 + n_sigma * sigma_u));
+
+    for(int i=i0; i<=i1; i++) {
+        double du = (double)i - u0;
+        double row_weight = weight * exp(-0.5 * a_marg * du*du);
+        double v_cond = v0 - slope * du;
+
+        int j0 = std::max(0, (int)ceil(v_cond - n_sigma * sigma_v));
+        int j1 = std::min((int)grid.N_bins[1] - 1, (int)floor(v_cond + n_sigma * sigma_v));
+
+        floating_t* row = img.ptr<floating_t>(i);
+        for(int j=j0; j<=j1; j++) {
+            double dv = (double)j - v_cond;
+            row[j] += row_weight * exp(-0.5 * c * dv*dv);
+        }
+    }
+}
+
+
 
 
 double integrate_ML_solution(
@@ -362,10 +542,11 @@ double integrate_ML_solution(
         std::vector<float>& fit_icov,
         bool use_priors,
         bool use_gaia,
-        double RV, int verbosity)
+        double RV, int verbosity,
+        bool render,
+        bool analytic_splat,
+        TGaussianKernelCache* kernel_cache)
 {
-    //
-    TSED sed;
     unsigned int N_Mr = stellar_model.get_N_Mr();
     unsigned int N_FeH = stellar_model.get_N_FeH();
     double Mr, FeH;
@@ -373,75 +554,65 @@ double integrate_ML_solution(
     // std::cerr << "N_Mr = " << N_Mr << std::endl;
     // std::cerr << "N_FeH = " << N_FeH << std::endl;
 
+    // R_V is fixed for this star, so evaluate the extinction
+    // coefficients once, rather than once per template
+    double A[NBANDS];
+    for(int i=0; i<NBANDS; i++) {
+        A[i] = ext_model.get_A(RV, i);
+    }
+
     // Calculate covariance of ML solution for (mu, E)
     double inv_cov_00, inv_cov_01, inv_cov_11;
 
-    star_covariance(mags_obs, ext_model,
-                    inv_cov_00, inv_cov_01, inv_cov_11,
-                    RV);
+    star_covariance(mags_obs, A,
+                    inv_cov_00, inv_cov_01, inv_cov_11);
 
     // Set image of p(mu, E) to zero
     if (!img_stack.initialize_to_zero(img_idx)) {
         std::cerr << "Failed to initialize image to zero!" << std::endl;
     }
 
-    // Calculate ML (E, mu), chi^2 and prior for each (Mr, [Fe/H]) pair
-    std::vector<double> E_ML;
-    std::vector<double> mu_ML;
-    std::vector<double> chi2_ML;
-    std::vector<double> prior_ML;
-
-    unsigned int N_reserve = N_Mr*N_FeH + 1;
-    E_ML.reserve(N_reserve);
-    mu_ML.reserve(N_reserve);
-    chi2_ML.reserve(N_reserve);
-    prior_ML.reserve(N_reserve);
-
-    for(int Mr_idx=0; Mr_idx<N_Mr; Mr_idx++) {
-        for(int FeH_idx=0; FeH_idx<N_FeH; FeH_idx++) {
-            // Look up model absolute magnitudes of this stellar type
-            bool success = stellar_model.get_sed(
-                Mr_idx, FeH_idx,
-                sed, Mr, FeH);
-            if(!success) {
-                std::cerr << "SED (" << Mr_idx << ", " << FeH_idx
-                          << ") not in library!" << std::endl;
-                continue;
-            }
+    // Calculate ML (E, mu), chi^2 and prior for each (Mr, [Fe/H]) pair.
+    // Template k corresponds to (Mr_idx, FeH_idx) = (k / N_FeH, k % N_FeH).
+    unsigned int N_templates = stellar_model.get_N_templates();
+    std::vector<double> E_ML(N_templates);
+    std::vector<double> mu_ML(N_templates);
+    std::vector<double> chi2_ML(N_templates);
+    std::vector<double> prior_ML(N_templates, 0.);
+
+    star_max_likelihood_batch(
+        stellar_model.get_absmag_soa(), N_templates,
+        mags_obs, A,
+        inv_cov_00, inv_cov_01, inv_cov_11,
+        mu_ML.data(), E_ML.data(), chi2_ML.data()
+    );
 
-            // std::cerr << "Mr check: " << Mr << " == " << sed.absmag[1] << std::endl;
+    const double* Mr_grid = stellar_model.get_Mr_soa();
+    const double* FeH_grid = stellar_model.get_FeH_soa();
 
-            // Calculate max. likelihood solution for (mu, E) given this fixed stellar type
-            double mu, E, chi2;
-            star_max_likelihood(sed, mags_obs, ext_model,
-                                inv_cov_00, inv_cov_01, inv_cov_11,
-                                mu, E, chi2,
-                                RV);
-            
-            if(use_gaia) {
-                chi2 += chi2_parallax(mu, mags_obs.pi, mags_obs.pi_err);
-            }
-            
-            double prior = 0.;
-            if(use_priors) {
-                prior = los_model.log_prior_emp(mu, Mr, FeH)
-                        + stellar_model.get_log_lf(Mr);
-                if(std::isnan(prior) || std::isinf(prior)) {
-                    prior = -std::numeric_limits<double>::infinity();
-                }
-            }
-            
-            if(std::isnan(chi2) || std::isinf(chi2)) {
-                chi2 = std::numeric_limits<double>::infinity();
-            }
-            
-            // std::cerr << "p(FeH = " << FeH << ") = " << prior << std::endl;
+    for(unsigned int k=0; k<N_templates; k++) {
+        double mu = mu_ML[k];
+        double chi2 = chi2_ML[k];
 
-            E_ML.push_back(E);
-            mu_ML.push_back(mu);
-            chi2_ML.push_back(chi2);
-            prior_ML.push_back(prior);
+        if(use_gaia) {
+            chi2 += chi2_parallax(mu, mags_obs.pi, mags_obs.pi_err);
+        }
+        
+        double prior = 0.;
+        if(use_priors) {
+            prior = los_model.log_prior_emp(mu, Mr_grid[k], FeH_grid[k])
+                    + stellar_model.get_log_lf(Mr_grid[k]);
+            if(std::isnan(prior) || std::isinf(prior)) {
+                prior = -std::numeric_limits<double>::infinity();
+            }
+        }
+        
+        if(std::isnan(chi2) || std::isinf(chi2)) {
+            chi2 = std::numeric_limits<double>::infinity();
         }
+        
+        chi2_ML[k] = chi2;
+        prior_ML[k] = prior;
     }
     
     // Calculate best prior and likelihood (minimum chi^2)
@@ -471,6 +642,14 @@ double integrate_ML_solution(
     
     std::vector<double> log_p_all;
     log_p_all.reserve(mu_ML.size());
+
+    // In-bounds templates, to be splatted analytically after the loop
+    std::vector<unsigned int> splat_idx;
+    std::vector<double> splat_log_p;
+    if(render && analytic_splat) {
+        splat_idx.reserve(mu_ML.size());
+        splat_log_p.reserve(mu_ML.size());
+    }
     
     double chi2_min_filtered = std::numeric_limits<double>::infinity();
     
@@ -494,7 +673,16 @@ double integrate_ML_solution(
 
         // bool in_bounds = img_stack.rect->get_index(E_ML.at(k), mu_ML.at(k), img_idx0, img_idx1);
 
-        if(in_bounds) {
+        if(in_bounds && (!render || analytic_splat)) {
+            // Fit only: chi^2 is still restricted to in-bounds solutions
+            if(chi2_ML.at(k) < chi2_min_filtered) {
+                chi2_min_filtered = chi2_ML.at(k);
+            }
+            if(render) {
+                splat_idx.push_back(k);
+                splat_log_p.push_back(log_p);
+            }
+        } else if(in_bounds) {
             double p = exp(log_p);
             //if((a0 < 0.) || (a0 > 1.) || (a1 < 0.) || (a1 > 1.)) {
             //    std::cerr << "(a0, a1) = (" << a0 << ", " << a1 << ")" << std::endl;
@@ -540,20 +728,49 @@ double integrate_ML_solution(
     //}
 
     // Smooth PDF with covariance of the ML solution
-    cv::Mat cov_img;
-    gaussian_filter(inv_cov_11, inv_cov_01, inv_cov_00,
-                    *(img_stack.rect), cov_img, 5, 2, 1.0,
-                    5, verbosity);
-    
-    //print_matrix(cov_img, std::cerr);
+    if(render && analytic_splat && splat_idx.size()) {
+        // Each template is drawn directly as a Gaussian with the same
+        // (broadened) covariance that the filter2D kernel uses, skipping
+        // templates far below the most probable one.
+        double icov_EE = inv_cov_11;
+        double icov_EDM = inv_cov_01;
+        double icov_DMDM = inv_cov_00;
+        broaden_inv_cov(icov_EE, icov_EDM, icov_DMDM, *(img_stack.rect), 1.0);
+
+        double log_p_max = *std::max_element(splat_log_p.begin(), splat_log_p.end());
+
+        for(size_t n=0; n<splat_idx.size(); n++) {
+            double log_p = splat_log_p[n] - log_p_max;
+            if(log_p < delta_logp_threshold) { continue; }
+            unsigned int k = splat_idx[n];
+            splat_gaussian(
+                *img_stack.img[img_idx], *(img_stack.rect),
+                E_ML[k], mu_ML[k], exp(log_p),
+                icov_EE, icov_EDM, icov_DMDM,
+                5.
+            );
+        }
+    } else if(render && !analytic_splat) {
+        cv::Mat cov_img;
+        if(kernel_cache) {
+            kernel_cache->get(inv_cov_11, inv_cov_01, inv_cov_00,
+                              cov_img, verbosity);
+        } else {
+            gaussian_filter(inv_cov_11, inv_cov_01, inv_cov_00,
+                            *(img_stack.rect), cov_img, 5, 2, 1.0,
+                            5, verbosity);
+        }
+        
+        //print_matrix(cov_img, std::cerr);
 
-    cv::Mat filtered_img = cv::Mat::zeros(
-        img_stack.rect->N_bins[0],
-        img_stack.rect->N_bins[1],
-        CV_FLOATING_TYPE
-    );
-    cv::filter2D(*img_stack.img[img_idx], filtered_img, CV_FLOATING_TYPE, cov_img);
-    *img_stack.img[img_idx] = cv::max(filtered_img, 0.); // Copy over matrix, setting negative values to zero
+        cv::Mat filtered_img = cv::Mat::zeros(
+            img_stack.rect->N_bins[0],
+            img_stack.rect->N_bins[1],
+            CV_FLOATING_TYPE
+        );
+        cv::filter2D(*img_stack.img[img_idx], filtered_img, CV_FLOATING_TYPE, cov_img);
+        *img_stack.img[img_idx] = cv::max(filtered_img, 0.); // Copy over matrix, setting negative values to zero
+    }
     
     //for(int j=0; j<img_stack.rect->N_bins[0]; j++) {
     //    for(int k=0; k<img_stack.rect->N_bins[1]; k++) {
@@ -650,53 +867,140 @@ void grid_eval_stars(TGalacticLOSModel& los_model,
                      std::string out_fname,
                      bool use_priors,
                      bool use_gaia,
-                     double RV, int verbosity) {
+                     double RV, int verbosity,
+                     bool two_pass,
+                     double chi2_cut,
+                     double subpixel_max,
+                     bool analytic_splat,
+                     uint32_t kernel_cache_capacity,
+                     double adaptive_E_factor) {
     // Timing
     auto t_start = std::chrono::steady_clock::now();
 
-    // Set up image stack for stellar PDFs
+    // Set up image stack for stellar PDFs. By default, the reddening axis
+    // covers 0 < E < 7, but in adaptive mode it is cut off at a multiple of
+    // the largest SFD reddening in the pixel, at the same resolution.
+    double E_max = 7.;
+    if(adaptive_E_factor > 0.) {
+        double EBV_ref = stellar_data.EBV;
+        for(auto& star : stellar_data.star) {
+            if(std::isfinite(star.EBV) && (star.EBV > EBV_ref)) {
+                EBV_ref = star.EBV;
+            }
+        }
+        const double E_max_floor = 0.5;
+        if(std::isfinite(EBV_ref)) {
+            E_max = std::min(E_max, std::max(E_max_floor, adaptive_E_factor * EBV_ref));
+        }
+        E_max = 0.1 * ceil(10. * E_max); // Whole number of 0.1 mag
+    }
+
     double min[2] = {-0.2,  3.75};   // (E, DM)
-	double max[2] = { 7.2, 19.25};  // (E, DM)
-	unsigned int N_bins[2] = {740, 124};
+	double max[2] = {E_max + 0.2, 19.25};  // (E, DM)
+	unsigned int N_bins[2] = {(unsigned int)std::lround(100. * (E_max + 0.4)), 124};
 	TRect rect(min, max, N_bins);
+
+    if((adaptive_E_factor > 0.) && (verbosity >= 1)) {
+        std::cerr << "Adaptive grid: E_max = " << E_max
+                  << " (" << N_bins[0] << " reddening bins)" << std::endl;
+    }
     img_stack.set_rect(rect);
 
+    // Stars with similar photometric errors share convolution kernels
+    std::unique_ptr<TGaussianKernelCache> kernel_cache;
+    if((kernel_cache_capacity > 0) && !analytic_splat) {
+        kernel_cache.reset(new TGaussianKernelCache(rect, kernel_cache_capacity));
+    }
+
     // Loop over all stars and evaluate PDFs on grid in (mu, E)
     int n_stars = stellar_data.star.size();
     chi2.clear();
+    chi2.resize(n_stars);
     
     // Name of group to save data to
     std::stringstream group_name;
     group_name << "/" << stellar_data.pix_name;
     
-    // Create empty vector of stellar data to save
-    std::vector<std::vector<TDMESaveData> > fit_centers;
-    std::vector<float> fit_icovs;
-    fit_centers.reserve(n_stars);
-    fit_icovs.reserve(n_stars);
+    // Create empty vector of stellar data to save. Each star writes
+    // only to its own slot, so that the stars can be evaluated in
+    // parallel, and the results are gathered in star order afterwards.
+    std::vector<std::vector<TDMESaveData> > fit_centers(n_stars);
+    std::vector<std::vector<float> > fit_icov_star(n_stars);
 
+    #pragma omp parallel for schedule(dynamic)
     for(int i=0; i<n_stars; i++) {
         if(verbosity >= 2) {
+            #pragma omp critical (cout)
             std::cerr << "Star " << i+1 << " of " << n_stars << std::endl;
         }
-        
-        fit_centers.push_back(
-            std::vector<TDMESaveData>()
-        );
 
-        double chi2_min = integrate_ML_solution(
+        chi2[i] = integrate_ML_solution(
             stellar_model, los_model,
             stellar_data[i], ext_model,
             img_stack, i,
             save_gaussians,
-            fit_centers.at(i),
-            fit_icovs,
+            fit_centers[i],
+            fit_icov_star[i],
             use_priors,
             use_gaia,
             RV,
-            verbosity
+            verbosity,
+            !two_pass,
+            analytic_splat,
+            kernel_cache.get()
         );
-        chi2.push_back(chi2_min);
+    }
+
+    // Second pass: render only the stars that will survive the
+    // goodness-of-fit cut. This is the same cut as in full_workflow.
+    int n_rendered = n_stars;
+
+    if(two_pass) {
+        std::vector<int> render_idx;
+        render_idx.reserve(n_stars);
+        for(int i=0; i<n_stars; i++) {
+            if((chi2[i] < chi2_cut)
+               && !std::isnan(chi2[i])
+               && !is_inf_replacement(chi2[i])
+               && (stellar_data.star[i].EBV < subpixel_max)) {
+                render_idx.push_back(i);
+            }
+        }
+        n_rendered = render_idx.size();
+
+        #pragma omp parallel for schedule(dynamic)
+        for(int j=0; j<n_rendered; j++) {
+            int i = render_idx[j];
+            std::vector<TDMESaveData> centers_dummy;
+            std::vector<float> icov_dummy;
+            integrate_ML_solution(
+                stellar_model, los_model,
+                stellar_data[i], ext_model,
+                img_stack, i,
+                false,
+                centers_dummy,
+                icov_dummy,
+                use_priors,
+                use_gaia,
+                RV,
+                verbosity,
+                true,
+                analytic_splat,
+                kernel_cache.get()
+            );
+        }
+
+        if(verbosity >= 1) {
+            std::cerr << "Rendered " << n_rendered << " of " << n_stars
+                      << " stellar images (two-pass grid evaluation)."
+                      << std::endl;
+        }
+    }
+
+    std::vector<float> fit_icovs;
+    fit_icovs.reserve(3 * n_stars);
+    for(auto& icov : fit_icov_star) {
+        fit_icovs.insert(fit_icovs.end(), icov.begin(), icov.end());
     }
     
     // Save individual Gaussians for each star
@@ -712,21 +1016,24 @@ void grid_eval_stars(TGalacticLOSModel& los_model,
     
     // Save chi^2/passband for each star
     //std::cerr << "Saving chi^2/passband for stars ..." << std::endl;
-	std::unique_ptr<H5::H5File> file = H5Utils::openFile(out_fname);
-	if(file) {
-        std::unique_ptr<H5::DataSet> chi2_dset = H5Utils::createDataSet(
-            *file,
-            group_name.str(),
-            "star_chi2",
-            chi2
-        );
-        //std::cerr << "chi^2 values written." << std::endl;
-    } else {
-        std::cerr << "! Failed to open " << out_fname << " !" << std::endl;
+    {
+        H5Utils::IOLock io_lock;
+        std::unique_ptr<H5::H5File> file = H5Utils::openFile(out_fname);
+        if(file) {
+            std::unique_ptr<H5::DataSet> chi2_dset = H5Utils::createDataSet(
+                *file,
+                group_name.str(),
+                "star_chi2",
+                chi2
+            );
+            //std::cerr << "chi^2 values written." << std::endl;
+        } else {
+            std::cerr << "! Failed to open " << out_fname << " !" << std::endl;
+        }
     }
 
     // Crop to correct (E, DM) range
-    img_stack.crop(0., 7., 4., 19.);
+    img_stack.crop(0., E_max, 4., 19.);
 
     // Smooth the individual stellar surfaces along E(B-V) axis, with
 	// kernel that varies with E(B-V).
@@ -786,6 +1093,14 @@ void grid_eval_stars(TGalacticLOSModel& los_model,
                   << std::endl
                   << "  *  total: " << dt_total.count() / n_stars << " ms"
                   << std::endl << std::endl;
+        if(kernel_cache) {
+            uint64_t n_hits = kernel_cache->get_n_hits();
+            uint64_t n_misses = kernel_cache->get_n_misses();
+            std::cerr << "Kernel cache: " << n_hits << " hits, "
+                      << n_misses << " misses ("
+                      << 100. * n_hits / std::max<uint64_t>(n_hits + n_misses, 1)
+                      << "% hit rate)" << std::endl << std::endl;
+        }
     }
 }
 
@@ -810,6 +1125,7 @@ bool save_gridstars(
     // Open up file and create group
 	H5::Exception::dontPrint();
 
+	H5Utils::IOLock io_lock;
 	std::unique_ptr<H5::H5File> file = H5Utils::openFile(fname);
 	if(!file) { return false; }
 
@@ -9,6 +9,7 @@
 #include <memory>
 #include <cstdlib>
 #include <chrono>
+#include <atomic>
 
 #include <Eigen/Dense>
 
@@ -49,6 +50,20 @@ void star_max_likelihood(TSED& mags_model, TStellarData::TMagnitudes& mags_obs,
                          double& mu, double& E, double& chi2,
                          double RV=3.1);
 
+// A[i] is the extinction coefficient A_i(RV) in band i.
+void star_covariance(TStellarData::TMagnitudes& mags_obs,
+                     const double* A,
+                     double& inv_cov_00, double& inv_cov_01, double& inv_cov_11);
+
+// Maximum-likelihood (mu, E) and chi^2 for every template at once.
+// absmag is band-major, as returned by TStellarModel::get_absmag_soa(),
+// and mu, E and chi2 must each hold n_templates entries.
+void star_max_likelihood_batch(const double* absmag, unsigned int n_templates,
+                               TStellarData::TMagnitudes& mags_obs,
+                               const double* A,
+                               double inv_cov_00, double inv_cov_01, double inv_cov_11,
+                               double* mu, double* E, double* chi2);
+
 struct TDMESaveData {
     float dm;
     float E;
@@ -58,6 +73,30 @@ struct TDMESaveData {
     float ln_prior;
 };
 
+// Cache of the convolution kernels built by gaussian_filter, keyed by the
+// inverse covariance, quantized to a relative precision of ~quantum. The
+// kernel for a key is always built from the quantized covariance, so the
+// result does not depend on the order in which stars are evaluated. Safe
+// to share between threads.
+class TGaussianKernelCache {
+public:
+    TGaussianKernelCache(const TRect& grid, uint32_t capacity, double quantum=0.01);
+
+    void get(double inv_cov_00, double inv_cov_01, double inv_cov_11,
+             cv::Mat& kernel, int verbosity=0);
+
+    uint64_t get_n_hits() const;
+    uint64_t get_n_misses() const;
+
+private:
+    TRect grid;
+    double quantum;
+
+    std::atomic<uint64_t> n_lookups, n_misses;
+
+    std::unique_ptr<LRUCache::ShardedCachedFunction<std::vector<int32_t>, cv::Mat> > cache;
+};
+
 double integrate_ML_solution(
     TStellarModel& stellar_model,
     TGalacticLOSModel& los_model,
@@ -70,8 +109,22 @@ double integrate_ML_solution(
     std::vector<float>& fit_icov,
     bool use_priors,
     bool use_gaia,
-    double RV, int verbosity);
-
+    double RV, int verbosity,
+    bool render=true,
+    bool analytic_splat=false,
+    TGaussianKernelCache* kernel_cache=nullptr);
+
+// Adds weight * exp(-x^T C^-1 x / 2) to img, for pixels within n_sigma
+// of (x0, x1). The inverse covariance is given along the image axes.
+void splat_gaussian(cv::Mat& img, const TRect& grid,
+                    double x0, double x1, double weight,
+                    double inv_cov_00, double inv_cov_01, double inv_cov_11,
+                    double n_sigma);
+
+// With two_pass set, the ML solutions and chi^2 are computed for every
+// star first, and only the stars that pass the chi^2 and subpixel cuts
+// have their images rendered. The images of the other stars are left
+// zero, and are culled afterwards.
 void grid_eval_stars(TGalacticLOSModel& los_model, TExtinctionModel& ext_model,
                      TStellarModel& stellar_model, TStellarData& stellar_data,
                      TEBVSmoothing& EBV_smoothing,
@@ -79,7 +132,13 @@ void grid_eval_stars(TGalacticLOSModel& los_model, TExtinctionModel& ext_model,
                      bool save_surfs, bool save_gaussians,
                      std::string out_fname,
                      bool use_priors, bool use_gaia,
-                     double RV, int verbosity);
+                     double RV, int verbosity,
+                     bool two_pass=false,
+                     double chi2_cut=std::numeric_limits<double>::infinity(),
+                     double subpixel_max=std::numeric_limits<double>::infinity(),
+                     bool analytic_splat=false,
+                     uint32_t kernel_cache_capacity=0,
+                     double adaptive_E_factor=0.);
 
 bool save_gridstars(
     const std::string& fname,